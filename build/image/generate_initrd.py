@@ -26,6 +26,8 @@ import shutil
 import subprocess
 import sys
 
+import lz4_compress
+
 
 def Main():
     parser = argparse.ArgumentParser()
@@ -36,6 +38,12 @@ def Main():
         action="append",
         nargs=2,
         metavar=("NAME", "IMAGE"))
+    parser.add_argument(
+        "--compress",
+        action="append",
+        default=[],
+        metavar="NAME",
+        help="secondary VM whose image is LZ4 compressed")
     parser.add_argument("--staging", required=True)
     parser.add_argument("--output", required=True)
     args = parser.parse_args()
@@ -57,7 +65,13 @@ def Main():
         for vm in args.secondary_vm:
             (vm_name, vm_image) = vm
             staged_files.append(vm_name)
-            shutil.copy(vm_image, os.path.join(args.staging, vm_name))
+            if vm_name in args.compress:
+                with open(vm_image, "rb") as f:
+                    data = bytearray(f.read())
+                with open(os.path.join(args.staging, vm_name), "wb") as f:
+                    f.write(lz4_compress.compress(data))
+            else:
+                shutil.copy(vm_image, os.path.join(args.staging, vm_name))
     # Package files into an initial RAM disk.
     with open(args.output, "w") as initrd:
         # Move into the staging directory so the file names taken by cpio don't
@@ -0,0 +1,172 @@
+#!/usr/bin/env python
+#
+# Copyright 2019 The Hafnium Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compress a VM image into an LZ4 frame.
+
+This is a simple greedy compressor so that building images doesn't depend on
+the lz4 tool or Python module. Its output can be decompressed by either, and by
+the hypervisor's loader.
+"""
+
+import argparse
+import struct
+import sys
+
+FRAME_MAGIC = 0x184D2204
+# Version 01, independent blocks, no checksums or content size.
+FRAME_FLG = 0x60
+# Blocks of up to 4MB.
+FRAME_BD = 0x70
+BLOCK_MAX = 4 << 20
+BLOCK_UNCOMPRESSED = 1 << 31
+
+MIN_MATCH = 4
+MAX_OFFSET = 0xffff
+# The last match must start at least 12 bytes before the end of the block, and
+# the last 5 bytes must be literals.
+MATCH_START_LIMIT = 12
+LAST_LITERALS = 5
+
+PRIME32_1 = 0x9E3779B1
+PRIME32_2 = 0x85EBCA77
+PRIME32_3 = 0xC2B2AE3D
+PRIME32_4 = 0x27D4EB2F
+PRIME32_5 = 0x165667B1
+MASK32 = 0xffffffff
+
+
+def rotl32(x, r):
+    return ((x << r) | (x >> (32 - r))) & MASK32
+
+
+def xxh32(data, seed=0):
+    """Returns the xxHash32 of the given data, used for the header checksum."""
+    data = bytearray(data)
+    length = len(data)
+    i = 0
+    if length >= 16:
+        acc = [(seed + PRIME32_1 + PRIME32_2) & MASK32,
+               (seed + PRIME32_2) & MASK32, seed & MASK32,
+               (seed - PRIME32_1) & MASK32]
+        while i + 16 <= length:
+            for lane in range(4):
+                word, = struct.unpack_from("<I", data, i)
+                acc[lane] = (rotl32(
+                    (acc[lane] + word * PRIME32_2) & MASK32, 13) *
+                             PRIME32_1) & MASK32
+                i += 4
+        h = (rotl32(acc[0], 1) + rotl32(acc[1], 7) + rotl32(acc[2], 12) +
+             rotl32(acc[3], 18)) & MASK32
+    else:
+        h = (seed + PRIME32_5) & MASK32
+    h = (h + length) & MASK32
+    while i + 4 <= length:
+        word, = struct.unpack_from("<I", data, i)
+        h = (rotl32((h + word * PRIME32_3) & MASK32, 17) * PRIME32_4) & MASK32
+        i += 4
+    while i < length:
+        h = (rotl32((h + data[i] * PRIME32_5) & MASK32, 11) *
+             PRIME32_1) & MASK32
+        i += 1
+    h ^= h >> 15
+    h = (h * PRIME32_2) & MASK32
+    h ^= h >> 13
+    h = (h * PRIME32_3) & MASK32
+    h ^= h >> 16
+    return h
+
+
+def append_length(out, length):
+    """Appends the part of a length which doesn't fit in the token."""
+    if length < 15:
+        return
+    length -= 15
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def append_sequence(out, literals, offset=0, match_len=0):
+    """Appends literals followed by a match, or just literals if match_len is 0."""
+    match_code = match_len - MIN_MATCH if match_len else 0
+    out.append(min(len(literals), 15) << 4 | min(match_code, 15))
+    append_length(out, len(literals))
+    out += literals
+    if match_len:
+        out += struct.pack("<H", offset)
+        append_length(out, match_code)
+
+
+def compress_block(data):
+    """Compresses a block with greedy matching on 4-byte hashes."""
+    out = bytearray()
+    last_seen = {}
+    anchor = 0
+    i = 0
+    match_limit = len(data) - MATCH_START_LIMIT
+    while i < match_limit:
+        key = bytes(data[i:i + MIN_MATCH])
+        candidate = last_seen.get(key)
+        last_seen[key] = i
+        if candidate is None or i - candidate > MAX_OFFSET:
+            i += 1
+            continue
+        match_len = MIN_MATCH
+        match_end_limit = len(data) - LAST_LITERALS
+        while (i + match_len < match_end_limit and
+               data[candidate + match_len] == data[i + match_len]):
+            match_len += 1
+        append_sequence(out, data[anchor:i], i - candidate, match_len)
+        i += match_len
+        anchor = i
+    append_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def compress(data):
+    """Returns the given data compressed into an LZ4 frame."""
+    descriptor = bytes(bytearray([FRAME_FLG, FRAME_BD]))
+    out = bytearray(struct.pack("<I", FRAME_MAGIC))
+    out += descriptor
+    out.append((xxh32(descriptor) >> 8) & 0xff)
+    for begin in range(0, len(data), BLOCK_MAX):
+        block = data[begin:begin + BLOCK_MAX]
+        compressed = compress_block(block)
+        if len(compressed) < len(block):
+            out += struct.pack("<I", len(compressed))
+            out += compressed
+        else:
+            out += struct.pack("<I", len(block) | BLOCK_UNCOMPRESSED)
+            out += block
+    out += struct.pack("<I", 0)
+    return bytes(out)
+
+
+def Main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--input", required=True)
+    parser.add_argument("--output", required=True)
+    args = parser.parse_args()
+    with open(args.input, "rb") as f:
+        data = bytearray(f.read())
+    with open(args.output, "wb") as f:
+        f.write(compress(data))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(Main())
@@ -0,0 +1,124 @@
+#!/usr/bin/env python
+#
+# Copyright 2019 The Hafnium Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Decode a dump of the hypervisor's binary trace buffer.
+
+The hypervisor only records event IDs and integer arguments in `hf_trace_buffer`.
+The format strings are taken from the event table in hfo2/src/trace.rs. The dump
+may be of the buffer alone or of a larger memory region containing it, in which
+case the buffer is found by its magic unless an offset is given.
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+TRACE_MAGIC = 0x3145434152544648
+TRACE_CPU_UNKNOWN = 0xffff
+TRACE_SEQ_WRITING = 0xffffffffffffffff
+HEADER = struct.Struct("<QQQ")
+RECORD = struct.Struct("<QQQQQQ")
+
+EVENT_RE = re.compile(r'^\s*(\w+) = (\d+) => "(.*)",\s*$')
+
+
+def read_events(path):
+    """Returns a map from event ID to (name, format) parsed from trace.rs."""
+    events = {}
+    with open(path) as f:
+        in_table = False
+        for line in f:
+            if line.startswith("trace_events! {"):
+                in_table = True
+            elif in_table and line.startswith("}"):
+                break
+            elif in_table:
+                match = EVENT_RE.match(line)
+                if match:
+                    name, event_id, fmt = match.groups()
+                    events[int(event_id)] = (name, fmt)
+    return events
+
+
+def find_buffer(dump):
+    offset = dump.find(struct.pack("<Q", TRACE_MAGIC))
+    if offset < 0:
+        raise ValueError("trace buffer magic not found")
+    return offset
+
+
+def decode(dump, offset, events):
+    magic, capacity, written = HEADER.unpack_from(dump, offset)
+    if magic != TRACE_MAGIC:
+        raise ValueError("bad trace buffer magic {:#x}".format(magic))
+
+    records = []
+    base = offset + HEADER.size
+    for i in range(min(capacity, written)):
+        seq, timestamp, event, a, b, c = RECORD.unpack_from(
+            dump, base + i * RECORD.size)
+        # Slots never written, or being written when the dump was taken,
+        # have no sequence number.
+        if seq == 0 or seq == TRACE_SEQ_WRITING:
+            continue
+        records.append((seq - 1, timestamp, event, (a, b, c)))
+
+    lost = written - len(records)
+    if lost:
+        print("# {} earlier or incomplete records lost".format(lost))
+
+    for seq, timestamp, event, args in sorted(records):
+        event_id = event & 0xffff
+        cpu = (event >> 16) & 0xffff
+        cpu = "?" if cpu == TRACE_CPU_UNKNOWN else str(cpu)
+        if event_id in events:
+            _, fmt = events[event_id]
+            # The format strings only use the subset of Rust's formatting
+            # syntax which Python shares.
+            text = fmt.format(*args)
+        else:
+            text = "unknown event {}: {:#x} {:#x} {:#x}".format(
+                event_id, *args)
+        print("{:>20} [{}] {}".format(timestamp, cpu, text))
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    parser = argparse.ArgumentParser()
+    parser.add_argument("dump", help="memory dump containing hf_trace_buffer")
+    parser.add_argument(
+        "--offset",
+        type=lambda x: int(x, 0),
+        help="offset of hf_trace_buffer in the dump")
+    parser.add_argument(
+        "--events",
+        default=os.path.join(root, "hfo2", "src", "trace.rs"),
+        help="source file holding the trace event table")
+    args = parser.parse_args()
+
+    events = read_events(args.events)
+    with open(args.dump, "rb") as f:
+        dump = f.read()
+
+    offset = args.offset if args.offset is not None else find_buffer(dump)
+    decode(dump, offset, events)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -69,6 +69,29 @@ pub enum HfVCpuRunReturn {
     /// MUST treat this as `HfVCpuRunReturn::WaitForInterrupt` for this vCPU and
     /// `HfVCpuRunReturn::WakeUp` for all the other vCPUs of the VM.
     Aborted,
+
+    /// The vCPU has voluntarily yielded the CPU in favour of another vCPU,
+    /// specified by `HfVCpuRunReturn::DirectedYield`, which it is waiting on.
+    /// The scheduler SHOULD run the target vCPU if it is runnable and MUST call
+    /// `hf_vcpu_run` on the yielding vCPU at a later point.
+    DirectedYield {
+        vm_id: spci_vm_id_t,
+        vcpu: spci_vcpu_index_t,
+    },
+
+    /// The vCPU of a demand-paged VM has faulted on the page at `ipa` of the
+    /// VM's memory, which the VM doesn't own, with the given access. The
+    /// scheduler SHOULD supply the page with `hf_vm_page_supply`, and MUST call
+    /// `hf_vcpu_run` on the vCPU at a later point, which retries the access.
+    PageFault { ipa: u64, access: HfPageFaultAccess },
+}
+
+/// The access which caused a fault reported with `HfVCpuRunReturn::PageFault`.
+#[derive(Clone, Copy, PartialEq)]
+pub enum HfPageFaultAccess {
+    Read = 0,
+    Write = 1,
+    Execute = 2,
 }
 
 #[derive(Clone, Copy, PartialEq)]
@@ -99,6 +122,8 @@ impl HfVCpuRunReturn {
             Message { vm_id } => 5 | (u64::from(vm_id) << 8),
             NotifyWaiters => 6,
             Aborted => 7,
+            DirectedYield { vm_id, vcpu } => 8 | (u64::from(vm_id) << 32) | (u64::from(vcpu) << 16),
+            PageFault { ipa, access } => 9 | ((access as u64) << 8) | (ipa & !0xfff),
         }
     }
 }
@@ -195,4 +220,24 @@ mod test {
         let res = HfVCpuRunReturn::Aborted;
         assert_eq!(res.into_raw(), 7);
     }
+
+    /// Encode directed yield response without leaking.
+    #[test]
+    fn abi_hf_vcpu_run_return_encode_directed_yield() {
+        let res = HfVCpuRunReturn::DirectedYield {
+            vm_id: 0x1234,
+            vcpu: 0xabcd,
+        };
+        assert_eq!(res.into_raw(), 0x1234abcd0008);
+    }
+
+    /// Encode page fault response, dropping the offset within the page.
+    #[test]
+    fn abi_hf_vcpu_run_return_encode_page_fault() {
+        let res = HfVCpuRunReturn::PageFault {
+            ipa: 0x8765_4321,
+            access: HfPageFaultAccess::Write,
+        };
+        assert_eq!(res.into_raw(), 0x8765_4109);
+    }
 }
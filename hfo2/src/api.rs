@@ -28,7 +28,8 @@ use crate::types::*;
 // To eliminate the risk of deadlocks, we define a partial order for the acquisition of locks held
 // concurrently by the same physical CPU. Our current ordering requirements are as follows:
 //
-// vcpu::execution_lock -> vm::lock -> vcpu::interrupts_lock -> mm_stage1_lock -> dlog sl
+// vcpu::execution_lock -> vm::lock -> vcpu::interrupts_lock -> cpu::timer_wheel_lock ->
+// mm_stage1_lock -> dlog sl
 //
 // Locks of the same kind require the lock of lowest address to be locked first, see
 // `sl_lock_both()`.
@@ -77,6 +78,43 @@ pub unsafe extern "C" fn api_spci_yield(
     SpciReturn::Success
 }
 
+/// Retrieves the next VM with vCPUs whose virtual timer has expired while they
+/// were blocked on the calling physical CPU. Only primary VMs are allowed to
+/// call this.
+///
+/// Returns -1 on failure or if there are no more expired vCPUs; otherwise the
+/// VM id in bits [47:32] and a bitmap of its now runnable vCPUs in bits [31:0].
+#[no_mangle]
+pub unsafe extern "C" fn api_timer_expired_get(current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    match hypervisor().timer_expired_get(&current) {
+        Some((vm_id, vcpus)) => (i64::from(vm_id) << 32) | i64::from(vcpus),
+        None => -1,
+    }
+}
+
+/// Returns to the primary VM to allow this CPU to be used by the given target
+/// vCPU, which the current vCPU is waiting on. The current vCPU is marked as
+/// ready to be scheduled again.
+///
+/// Returns:
+///  - -1 on failure because the target VM or vCPU doesn't exist or is the
+///    calling vCPU.
+///  - 0 on success.
+#[no_mangle]
+pub unsafe extern "C" fn api_vcpu_yield_to(
+    target_vm_id: spci_vm_id_t,
+    target_vcpu_idx: spci_vcpu_index_t,
+    current: *const VCpu,
+    next: *mut *const VCpu,
+) -> i64 {
+    let mut current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    let (ret, vcpu) = hypervisor().vcpu_yield_to(target_vm_id, target_vcpu_idx, &mut current);
+
+    *next = some_or!(vcpu, return ret);
+    ret
+}
+
 /// Switches to the primary so that it can switch to the target, or kick tit if
 /// it is already running on a different physical CPU.
 #[no_mangle]
@@ -95,6 +133,19 @@ pub unsafe extern "C" fn api_abort(current: *const VCpu) -> *const VCpu {
     hypervisor().abort(&mut current)
 }
 
+/// Handles a stage-2 fault the vCPU couldn't recover from, reporting it to the
+/// primary VM if the vCPU's VM is demand-paged and the page is missing, or
+/// aborting the VM otherwise.
+#[no_mangle]
+pub unsafe extern "C" fn api_page_fault(
+    current: *const VCpu,
+    f: *const VCpuFaultInfo,
+) -> *const VCpu {
+    let mut current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    let f = &*f;
+    hypervisor().page_fault(&mut current, f.ipaddr, f.mode)
+}
+
 /// Returns the ID of the VM.
 #[no_mangle]
 pub unsafe extern "C" fn api_vm_get_id(current: *const VCpu) -> spci_vm_id_t {
@@ -173,6 +224,32 @@ pub unsafe extern "C" fn api_vm_configure(
     ret
 }
 
+/// Configures the page the hypervisor publishes the run state of every vCPU to.
+/// Only primary VMs are allowed to call this, and only once.
+///
+/// Returns 0 on success, or -1 on failure.
+#[no_mangle]
+pub unsafe extern "C" fn api_vcpu_state_configure(page: ipaddr_t, current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .vcpu_state_configure(page, &current)
+        .map(|_| 0)
+        .unwrap_or(-1)
+}
+
+/// Configures the page the hypervisor publishes the times of the calling VM's
+/// vCPUs to. Only secondary VMs are allowed to call this, and only once.
+///
+/// Returns 0 on success, or -1 on failure.
+#[no_mangle]
+pub unsafe extern "C" fn api_steal_time_configure(page: ipaddr_t, current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .steal_time_configure(page, &current)
+        .map(|_| 0)
+        .unwrap_or(-1)
+}
+
 /// Copies data from the sender's send buffer to the recipient's receive buffer
 /// and notifies the recipient.
 ///
@@ -192,22 +269,41 @@ pub unsafe extern "C" fn api_spci_msg_send(
 }
 
 /// Receives a message from the mailbox. If one isn't available, this function
-/// can optionally block the caller until one becomes available.
+/// can optionally block the caller until one becomes available, or until
+/// `timeout_ns` nanoseconds have passed if it is not 0.
 ///
 /// No new messages can be received until the mailbox has been cleared.
 #[no_mangle]
 pub unsafe extern "C" fn api_spci_msg_recv(
     attributes: SpciMsgRecvAttributes,
+    timeout_ns: u64,
     current: *const VCpu,
     next: *mut *const VCpu,
 ) -> SpciReturn {
     let mut current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
-    let (ret, vcpu) = hypervisor().spci_msg_recv(attributes, &mut current);
+    let (ret, vcpu) = hypervisor().spci_msg_recv(attributes, timeout_ns, &mut current);
 
     *next = some_or!(vcpu, return ret);
     ret
 }
 
+/// Returns the time, in virtual counter ticks, the given vCPU has spent on the
+/// given `enum hf_vcpu_time` activity, or -1 on failure. Only primary VMs are
+/// allowed to call this.
+#[no_mangle]
+pub unsafe extern "C" fn api_vcpu_time_get(
+    vm_id: spci_vm_id_t,
+    vcpu_idx: spci_vcpu_index_t,
+    time: u32,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .vcpu_time_get(vm_id, vcpu_idx, time, &current)
+        .map(|ticks| ticks as i64)
+        .unwrap_or(-1)
+}
+
 /// Retrieves the next VM whose mailbox became writable. For a VM to be notified
 /// by this function, the caller must have called api_mailbox_send before with
 /// the notify argument set to true, and this call must have failed because the
@@ -313,6 +409,27 @@ pub unsafe extern "C" fn api_interrupt_inject(
     ret
 }
 
+/// Injects a virtual interrupt of the given ID into every vCPU of the given
+/// target VM. Only primary VMs are allowed to call this.
+///
+/// Returns:
+///  - -1 on failure because the target VM doesn't exist, the interrupt ID is
+///    invalid, or the caller is not the primary VM.
+///  - otherwise a bitmap, indexed by vCPU index, of the vCPUs the primary VM
+///    now needs to wake up or kick.
+#[no_mangle]
+pub unsafe extern "C" fn api_interrupt_inject_all(
+    target_vm_id: spci_vm_id_t,
+    intid: intid_t,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .interrupt_inject_all(target_vm_id, intid, &current)
+        .map(|vcpus| vcpus as i64)
+        .unwrap_or(-1)
+}
+
 /// Shares memory from the calling VM with another. The memory can be shared in different modes.
 ///
 /// TODO: the interface for sharing memory will need to be enhanced to allow sharing with different
@@ -355,6 +472,182 @@ pub unsafe extern "C" fn api_debug_log(c: c_char, current: *const VCpu) -> i64 {
     0
 }
 
+/// Sends the first `len` characters packed in `chars0` and `chars1`, least
+/// significant byte first, to the debug log for the VM.
+///
+/// Returns the number of characters sent, or -1 on failure.
+#[no_mangle]
+pub unsafe extern "C" fn api_debug_log_chunk(
+    len: usize,
+    chars0: u64,
+    chars1: u64,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .debug_log_chunk(len, [chars0, chars1], &current)
+        .map(|len| len as i64)
+        .unwrap_or(-1)
+}
+
+/// Returns the time, in virtual counter ticks, spent on the given
+/// `enum hf_boot_phase`, or -1 on failure. Only primary VMs are allowed to call
+/// this.
+#[no_mangle]
+pub unsafe extern "C" fn api_boot_time_get(
+    phase: u32,
+    vm_id: spci_vm_id_t,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .boot_time_get(phase, vm_id, &current)
+        .map(|ticks| ticks as i64)
+        .unwrap_or(-1)
+}
+
+/// Resets the given secondary VM to its state at boot. Only primary VMs are
+/// allowed to call this.
+///
+/// Returns -1 on failure, or 0 on success.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_reset(vm_id: spci_vm_id_t, current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    if hypervisor().vm_reset(vm_id, &current).is_ok() {
+        0
+    } else {
+        -1
+    }
+}
+
+/// Enables or disables dirty logging for the given secondary VM. Only primary
+/// VMs are allowed to call this.
+///
+/// Returns -1 on failure, or 0 on success.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_dirty_log_enable(
+    vm_id: spci_vm_id_t,
+    enable: bool,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    if hypervisor()
+        .vm_dirty_log_enable(vm_id, enable, &current)
+        .is_ok()
+    {
+        0
+    } else {
+        -1
+    }
+}
+
+/// Returns a bitmap of which of the `HF_MEMORY_LOG_PAGES` pages from `begin`
+/// the given secondary VM has written since they were last returned, and
+/// write-protects them again. Only primary VMs are allowed to call this.
+///
+/// Returns -1 on failure.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_dirty_log_get(
+    vm_id: spci_vm_id_t,
+    begin: ipaddr_t,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .vm_dirty_log_get(vm_id, begin, &current)
+        .map(|dirty| dirty as i64)
+        .unwrap_or(-1)
+}
+
+/// Clears the access flags of all of the given secondary VM's memory. Only
+/// primary VMs are allowed to call this.
+///
+/// Returns -1 on failure, or the number of pages the VM accessed since the flags
+/// were last cleared.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_access_log_reset(vm_id: spci_vm_id_t, current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .vm_access_log_reset(vm_id, &current)
+        .map(|accessed| accessed as i64)
+        .unwrap_or(-1)
+}
+
+/// Returns a bitmap of which of the `HF_MEMORY_LOG_PAGES` pages from `begin`
+/// the given secondary VM has accessed since its access flags were last
+/// cleared. Only primary VMs are allowed to call this.
+///
+/// Returns -1 on failure.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_access_log_get(
+    vm_id: spci_vm_id_t,
+    begin: ipaddr_t,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .vm_access_log_get(vm_id, begin, &current)
+        .map(|accessed| accessed as i64)
+        .unwrap_or(-1)
+}
+
+/// Asks the given secondary VM to return the given number of pages of its
+/// memory to the primary VM, replacing any previous request. Only primary VMs
+/// are allowed to call this.
+///
+/// Returns:
+///  - -1 on failure.
+///  - 0 on success if no further action is needed.
+///  - 1 if the primary VM now needs to wake up or kick the VM's first vCPU.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_balloon_inflate(
+    vm_id: spci_vm_id_t,
+    pages: u64,
+    current: *const VCpu,
+) -> i64 {
+    let mut current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .vm_balloon_inflate(vm_id, pages as usize, &mut current)
+        .unwrap_or(-1)
+}
+
+/// Supplies the given page of the primary VM to the given demand-paged
+/// secondary VM. Only primary VMs are allowed to call this.
+///
+/// Returns -1 on failure, or 0 on success.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_page_supply(
+    vm_id: spci_vm_id_t,
+    ipa: ipaddr_t,
+    current: *const VCpu,
+) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    if hypervisor().vm_page_supply(vm_id, ipa, &current).is_ok() {
+        0
+    } else {
+        -1
+    }
+}
+
+/// Returns the number of pages the primary VM has asked the calling VM to
+/// return to it, which it hasn't donated yet.
+#[no_mangle]
+pub unsafe extern "C" fn api_balloon_request_get(current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor().balloon_request_get(&current) as i64
+}
+
+/// Returns the start, or the end if `end` is set, of the given range of the
+/// calling VM's memory, or -1 if there is no such range.
+#[no_mangle]
+pub unsafe extern "C" fn api_vm_mem_range_get(index: u32, end: bool, current: *const VCpu) -> i64 {
+    let current = ManuallyDrop::new(VCpuExecutionLocked::from_raw(current));
+    hypervisor()
+        .vm_mem_range_get(index, end, &current)
+        .map(|ipa| ipa_addr(ipa) as i64)
+        .unwrap_or(-1)
+}
+
 #[cfg(test)]
 mod test {
     use super::*;
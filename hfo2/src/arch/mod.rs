@@ -56,4 +56,25 @@ extern "C" {
     /// currently active vCPU, or 0 if it has already expired. This is undefined
     /// if the timer is not enabled.
     pub fn arch_timer_remaining_ns_current() -> u64;
+
+    /// Returns the absolute deadline, in counter ticks, of the virtual timer of
+    /// the currently active vCPU. This is undefined if the timer is not
+    /// enabled.
+    pub fn arch_timer_deadline_current() -> u64;
+
+    /// Returns the current value of the counter the virtual timer compares
+    /// against.
+    pub fn arch_timer_count() -> u64;
+
+    /// Converts a number of counter ticks to the equivalent number of
+    /// nanoseconds.
+    pub fn arch_timer_ticks_to_ns(ticks: u64) -> u64;
+
+    /// Converts a number of nanoseconds to the equivalent number of counter
+    /// ticks.
+    pub fn arch_timer_ns_to_ticks(ns: u64) -> u64;
+
+    /// Arms the hypervisor timer of the current physical CPU to fire at the
+    /// given absolute counter value, or disables it if `ticks` is `u64::MAX`.
+    pub fn arch_timer_hyp_set_deadline(ticks: u64);
 }
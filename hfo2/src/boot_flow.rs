@@ -14,14 +14,20 @@
  * limitations under the License.
  */
 
+use core::mem;
+use core::slice;
+
 use crate::addr::*;
 use crate::arch::*;
 use crate::boot_params::*;
+use crate::boot_time::*;
 use crate::fdt::*;
 use crate::fdt_handler::*;
 use crate::manifest::*;
 use crate::mm::*;
 use crate::mpool::*;
+use crate::page::*;
+use crate::utils::*;
 
 // from "inc/hf/plat/boot_flow.h"
 extern "C" {
@@ -63,32 +69,53 @@ pub fn boot_flow_init(
     ptable: &mut PageTable<Stage1>,
     manifest: &mut Manifest,
     boot_params: &mut BootParams,
+    boot_times: &mut BootTimes,
     ppool: &MPool,
 ) -> Result<(), ()> {
     // Get the memory map from the FDT.
-    let mut fdt_root = unsafe { map(ptable, plat::get_fdt_addr(), ppool) }.ok_or_else(|| {
-        dlog!("Unable to map FDT.\n");
+    let fdt_root = unsafe { map(ptable, plat::get_fdt_addr(), ppool) }.ok_or_else(|| {
+        dlog_error!("Unable to map FDT.\n");
     })?;
 
     let ret = try {
-        fdt_root.find_child("\0".as_ptr()).ok_or_else(|| {
-            dlog!("Unable to find FDT root node.\n");
+        // Index the FDT in a boot-time buffer, so that looking up a node doesn't rescan the
+        // nodes before it.
+        let index_len = FdtIndex::table_len(&fdt_root);
+        let index_pages =
+            round_up(index_len * mem::size_of::<FdtIndexEntry>(), PAGE_SIZE) / PAGE_SIZE;
+        let index_table = ppool.alloc_pages(index_pages, 1).map_err(|_| {
+            dlog_error!("Unable to allocate memory for FDT index.\n");
         })?;
+        let index_table = index_table.into_raw();
 
-        manifest.init(&fdt_root).map_err(|e| {
-            dlog!(
-                "Could not parse manifest: {}.\n",
-                <Error as Into<&'static str>>::into(e)
-            );
-        })?;
+        let parsed: Result<(), ()> = try {
+            let fdt = FdtIndex::new(&fdt_root, unsafe {
+                slice::from_raw_parts_mut(index_table as *mut FdtIndexEntry, index_len)
+            })
+            .ok_or_else(|| {
+                dlog_error!("Unable to find FDT root node.\n");
+            })?;
+            boot_times.lap(BootPhase::Fdt);
 
-        boot_params.init(&fdt_root).map_err(|_| {
-            dlog!("Could not parse boot params.\n");
-        })?;
+            manifest.init(&fdt).map_err(|e| {
+                dlog_error!(
+                    "Could not parse manifest: {}.\n",
+                    <Error as Into<&'static str>>::into(e)
+                );
+            })?;
+            boot_times.lap(BootPhase::Manifest);
+
+            boot_params.init(&fdt).map_err(|_| {
+                dlog_error!("Could not parse boot params.\n");
+            })?;
+        };
+
+        ppool.free_pages(unsafe { Pages::from_raw(index_table, index_pages) });
+        parsed?;
     };
 
     unsafe { unmap(ptable, pa_addr(plat::get_fdt_addr()) as _, ppool) }.map_err(|_| {
-        dlog!("Unable to unmap FDT.\n");
+        dlog_error!("Unable to unmap FDT.\n");
     })?;
 
     ret
@@ -70,15 +70,19 @@ impl BootParamsUpdate {
 
 impl BootParams {
     /// Extract the boot parameters from the FDT and the boot-flow driver.
-    pub fn init<'a>(&mut self, fdt_root: &FdtNode<'a>) -> Result<(), ()> {
+    pub fn init<'a>(&mut self, fdt: &FdtIndex<'a, '_>) -> Result<(), ()> {
         self.mem_ranges_count = 0;
         self.kernel_arg = plat::get_kernel_arg();
 
-        let (begin, end) = plat::get_initrd_range(fdt_root)?;
+        let fdt_root = fdt.node(fdt.root());
+        let (begin, end) = plat::get_initrd_range(&fdt_root)?;
         self.initrd_begin = begin;
         self.initrd_end = end;
 
-        self.cpu_count = fdt_root.find_cpus(&mut self.cpu_ids).ok_or(())?;
+        let cpus = fdt.find_path(b"/cpus").ok_or_else(|| {
+            dlog_error!("Unable to find 'cpus'\n");
+        })?;
+        self.cpu_count = fdt.node(cpus).read_cpus(&mut self.cpu_ids).ok_or(())?;
         fdt_root.find_memory_ranges(self).ok_or(())?;
 
         Ok(())
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2019 Jeehoon Kang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Timing of the phases of boot, so that it can be told where boot time goes. The table is logged
+//! at the end of boot and the primary VM can query it with `hf_boot_time_get`.
+
+use core::sync::atomic::Ordering;
+
+use crate::arch::*;
+use crate::types::*;
+use crate::vm::*;
+
+/// A phase of boot. Mirrors `enum hf_boot_phase` in inc/vmapi/hf/abi.h.
+#[derive(Clone, Copy)]
+pub enum BootPhase {
+    /// Building the hypervisor's page table.
+    PageTable,
+
+    /// Parsing the boot parameters from the FDT.
+    Fdt,
+
+    /// Parsing the manifest from the FDT.
+    Manifest,
+
+    /// Mapping and indexing the initrd.
+    Initrd,
+
+    /// Loading the primary VM.
+    LoadPrimary,
+
+    /// Loading the secondary VMs, except for those whose loading is deferred.
+    LoadSecondary,
+
+    /// Patching the primary VM's FDT.
+    PatchFdt,
+
+    /// Defragmenting the hypervisor's page table.
+    Defrag,
+}
+
+const BOOT_PHASE_COUNT: usize = 8;
+
+/// The value of `enum hf_boot_phase` which asks for the time taken to load a given secondary VM.
+pub const HF_BOOT_PHASE_LOAD_VM: u32 = 8;
+
+impl BootPhase {
+    pub fn from_raw(raw: u32) -> Option<Self> {
+        match raw {
+            0 => Some(BootPhase::PageTable),
+            1 => Some(BootPhase::Fdt),
+            2 => Some(BootPhase::Manifest),
+            3 => Some(BootPhase::Initrd),
+            4 => Some(BootPhase::LoadPrimary),
+            5 => Some(BootPhase::LoadSecondary),
+            6 => Some(BootPhase::PatchFdt),
+            7 => Some(BootPhase::Defrag),
+            _ => None,
+        }
+    }
+
+    fn name(self) -> &'static str {
+        match self {
+            BootPhase::PageTable => "page table",
+            BootPhase::Fdt => "FDT",
+            BootPhase::Manifest => "manifest",
+            BootPhase::Initrd => "initrd",
+            BootPhase::LoadPrimary => "load primary",
+            BootPhase::LoadSecondary => "load secondaries",
+            BootPhase::PatchFdt => "patch FDT",
+            BootPhase::Defrag => "defrag",
+        }
+    }
+}
+
+/// Time, in virtual counter ticks, spent on each `BootPhase`. It is only written by the boot CPU
+/// during boot.
+pub struct BootTimes {
+    phases: [u64; BOOT_PHASE_COUNT],
+
+    /// The counter value when the last phase ended.
+    last: u64,
+}
+
+impl BootTimes {
+    pub const fn new() -> Self {
+        Self {
+            phases: [0; BOOT_PHASE_COUNT],
+            last: 0,
+        }
+    }
+
+    /// Starts timing the first phase.
+    pub fn start(&mut self) {
+        self.last = unsafe { arch_timer_count() };
+    }
+
+    /// Adds the time since the last phase ended to the given phase. A phase may be timed in
+    /// several parts.
+    pub fn lap(&mut self, phase: BootPhase) {
+        self.lap_at(phase, unsafe { arch_timer_count() });
+    }
+
+    fn lap_at(&mut self, phase: BootPhase, now: u64) {
+        self.phases[phase as usize] += now.wrapping_sub(self.last);
+        self.last = now;
+    }
+
+    pub fn get(&self, phase: BootPhase) -> u64 {
+        self.phases[phase as usize]
+    }
+
+    /// Logs the time spent on each phase and on loading each secondary VM loaded so far.
+    pub fn log(&self, vm_manager: &VmManager) {
+        let us = |ticks: u64| unsafe { arch_timer_ticks_to_ns(ticks) } / 1000;
+
+        dlog_info!("Boot times (us):\n");
+        for raw in 0..BOOT_PHASE_COUNT as u32 {
+            let phase = BootPhase::from_raw(raw).unwrap();
+            dlog_info!("  {:<18}{:>10}\n", phase.name(), us(self.get(phase)));
+        }
+
+        for vm in vm_manager.iter().filter(|vm| vm.id != HF_PRIMARY_VM_ID) {
+            let ticks = vm.load_ticks.load(Ordering::Relaxed);
+            if ticks != 0 {
+                dlog_info!("  load VM{:<13}{:>10}\n", vm.id, us(ticks));
+            }
+        }
+
+        dlog_info!("  {:<18}{:>10}\n", "total", us(self.phases.iter().sum()));
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn boot_times_lap() {
+        let mut times = BootTimes::new();
+        times.last = 100;
+
+        times.lap_at(BootPhase::PageTable, 150);
+        times.lap_at(BootPhase::Fdt, 160);
+        times.lap_at(BootPhase::Manifest, 200);
+        times.lap_at(BootPhase::Fdt, 205);
+
+        assert_eq!(times.get(BootPhase::PageTable), 50);
+        assert_eq!(times.get(BootPhase::Fdt), 15);
+        assert_eq!(times.get(BootPhase::Manifest), 40);
+        assert_eq!(times.get(BootPhase::Defrag), 0);
+        assert_eq!(times.phases.iter().sum::<u64>(), 105);
+    }
+}
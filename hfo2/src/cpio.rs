@@ -15,9 +15,13 @@
  */
 
 use core::mem;
+use core::ptr;
+use core::slice;
 
 use crate::memiter::*;
+use crate::std::*;
 use crate::types::*;
+use crate::utils::*;
 
 extern "C" {
     fn strcmp(a: *const u8, b: *const u8) -> c_int;
@@ -60,7 +64,7 @@ pub fn parse_cpio(it: &mut MemIter) -> Option<CpioResult> {
     // TODO: Check that string is null-terminated.
 
     /* Stop enumerating files when we hit the end marker. */
-    if unsafe { strcmp(name, &("TRAILER!!!\n".as_bytes()[0])) } == 0 {
+    if unsafe { strcmp(name, &("TRAILER!!!\0".as_bytes()[0])) } == 0 {
         return None;
     }
 
@@ -71,30 +75,252 @@ pub fn parse_cpio(it: &mut MemIter) -> Option<CpioResult> {
     })
 }
 
-/// Looks for a file in the given cpio archive. The filename is not null-terminated, so we use a
-/// memory iterator to represent it. The file, if found, is returned in the `it` argument.
-pub fn find_file_memiter(cpio: &MemIter, filename: &MemIter) -> Option<MemIter> {
-    let mut iter = cpio.clone();
+/// A slot of the `CpioIndex` hash table.
+#[derive(Clone, Copy)]
+pub struct CpioIndexEntry {
+    hash: u32,
 
-    while let Some(result) = parse_cpio(&mut iter) {
-        if unsafe { filename.iseq(result.name) } {
-            return Some(unsafe { MemIter::from_raw(result.contents, result.size) });
+    /// The null-terminated name of the file, or null if the slot is free.
+    name: *const u8,
+    contents: *const u8,
+    size: usize,
+}
+
+impl CpioIndexEntry {
+    pub const EMPTY: Self = Self {
+        hash: 0,
+        name: ptr::null(),
+        contents: ptr::null(),
+        size: 0,
+    };
+}
+
+/// An index of the files in a cpio archive by name, built in a single pass over it, so looking up
+/// a file doesn't parse the headers of all the files before it. Like a linear search, it finds the
+/// first of files with the same name, and only the files before the archive is found truncated.
+/// The table is borrowed so it can live in a boot-time buffer.
+pub struct CpioIndex<'a> {
+    table: &'a mut [CpioIndexEntry],
+}
+
+impl<'a> CpioIndex<'a> {
+    /// Returns the number of table entries `new` needs to index the given cpio archive. The table
+    /// is kept at most half full.
+    pub fn table_len(cpio: &MemIter) -> usize {
+        let mut iter = cpio.clone();
+        let mut count: usize = 0;
+
+        while parse_cpio(&mut iter).is_some() {
+            count += 1;
+        }
+
+        (count * 2).next_power_of_two()
+    }
+
+    /// Indexes the files in the given cpio archive. The length of `table` must be a power of two,
+    /// and should be at least `table_len(cpio)`.
+    pub fn new(cpio: &MemIter, table: &'a mut [CpioIndexEntry]) -> Option<Self> {
+        if !table.len().is_power_of_two() {
+            return None;
+        }
+
+        for entry in table.iter_mut() {
+            *entry = CpioIndexEntry::EMPTY;
+        }
+
+        let index = Self { table };
+        let mut iter = cpio.clone();
+        let mut count = 0;
+
+        while let Some(result) = parse_cpio(&mut iter) {
+            let name = unsafe { Self::name(result.name) };
+            let (slot, found) = index.lookup(name);
+
+            // Keep the first of files with the same name.
+            if found {
+                continue;
+            }
+
+            // Keep a free slot so lookups terminate.
+            if count + 1 == index.table.len() {
+                return None;
+            }
+
+            index.table[slot] = CpioIndexEntry {
+                hash: fnv1a(FNV1A_INIT, name),
+                name: result.name,
+                contents: result.contents,
+                size: result.size,
+            };
+            count += 1;
+        }
+
+        Some(index)
+    }
+
+    /// Returns the given null-terminated name, without the terminator.
+    unsafe fn name<'b>(name: *const u8) -> &'b [u8] {
+        slice::from_raw_parts(name, strnlen_s(name, usize::max_value()))
+    }
+
+    /// Returns the slot of the file with the given name and true, or the free slot it would be
+    /// inserted in and false.
+    fn lookup(&self, name: &[u8]) -> (usize, bool) {
+        let hash = fnv1a(FNV1A_INIT, name);
+        let mask = self.table.len() - 1;
+        let mut slot = hash as usize & mask;
+
+        loop {
+            let entry = &self.table[slot];
+            if entry.name.is_null() {
+                return (slot, false);
+            }
+
+            if entry.hash == hash && unsafe { Self::name(entry.name) } == name {
+                return (slot, true);
+            }
+
+            slot = (slot + 1) & mask;
         }
     }
 
-    None
+    fn find(&self, name: &[u8]) -> Option<MemIter> {
+        let (slot, found) = self.lookup(name);
+        if !found {
+            return None;
+        }
+
+        let entry = &self.table[slot];
+        Some(unsafe { MemIter::from_raw(entry.contents, entry.size) })
+    }
+
+    /// Looks for a file in the indexed cpio archive. The filename is not null-terminated, so we
+    /// use a memory iterator to represent it.
+    pub fn find_file_memiter(&self, filename: &MemIter) -> Option<MemIter> {
+        self.find(unsafe { filename.as_slice() })
+    }
+
+    /// Looks for a file in the indexed cpio archive.
+    pub unsafe fn find_file(&self, filename: *const u8) -> Option<MemIter> {
+        self.find(Self::name(filename))
+    }
 }
 
-/// Looks for a file in the given cpio archive. The file, if found, is returned in the `it`
-/// argument.
-pub unsafe fn find_file(cpio: &MemIter, filename: *const u8) -> Option<MemIter> {
-    let mut iter = cpio.clone();
+#[cfg(test)]
+mod test {
+    extern crate std;
+    use std::format;
+    use std::vec;
+    use std::vec::Vec;
+
+    use super::*;
+
+    /// Looks for a file by parsing the archive from the start.
+    fn find_file(cpio: &MemIter, filename: *const u8) -> Option<MemIter> {
+        let mut iter = cpio.clone();
 
-    while let Some(result) = parse_cpio(&mut iter) {
-        if strcmp(filename, result.name) == 0 {
-            return Some(MemIter::from_raw(result.contents, result.size));
+        while let Some(result) = parse_cpio(&mut iter) {
+            if unsafe { strcmp(filename, result.name) } == 0 {
+                return Some(unsafe { MemIter::from_raw(result.contents, result.size) });
+            }
         }
+
+        None
+    }
+
+    /// Appends a file to a cpio archive in the old binary format.
+    fn add_file(archive: &mut Vec<u8>, name: &str, contents: &[u8]) {
+        let mut header = [0u16; mem::size_of::<CpioHeader>() / 2];
+        header[0] = 0o070707;
+        header[10] = name.len() as u16 + 1;
+        header[11] = (contents.len() >> 16) as u16;
+        header[12] = contents.len() as u16;
+        for field in header.iter() {
+            archive.extend_from_slice(&field.to_ne_bytes());
+        }
+
+        archive.extend_from_slice(name.as_bytes());
+        archive.resize(archive.len() + 1 + (name.len() + 1) % 2, 0);
+        archive.extend_from_slice(contents);
+        archive.resize(archive.len() + contents.len() % 2, 0);
     }
 
-    None
+    /// Checks that the index finds the same files as a linear search, and returns how many it found.
+    fn index_and_check(archive: &[u8], names: &[&str]) -> usize {
+        let cpio = unsafe { MemIter::from_raw(archive.as_ptr(), archive.len()) };
+        let mut table = vec![CpioIndexEntry::EMPTY; CpioIndex::table_len(&cpio)];
+        let index = CpioIndex::new(&cpio, &mut table).unwrap();
+
+        let mut count = 0;
+        for name in names {
+            let asciz = format!("{}\0", name);
+            let expected = find_file(&cpio, asciz.as_ptr());
+            let found = unsafe { index.find_file(asciz.as_ptr()) };
+            assert_eq!(
+                found.as_ref().map(|it| unsafe { it.as_slice().to_vec() }),
+                expected.map(|it| unsafe { it.as_slice().to_vec() }),
+                "{}",
+                name
+            );
+
+            let filename = unsafe { MemIter::from_raw(name.as_ptr(), name.len()) };
+            assert_eq!(
+                index.find_file_memiter(&filename).map(|it| it.get_next()),
+                found.as_ref().map(|it| it.get_next())
+            );
+
+            count += found.is_some() as usize;
+        }
+
+        count
+    }
+
+    #[test]
+    fn cpio_index_many_files() {
+        let mut archive = Vec::new();
+        let names: Vec<_> = (0..100).map(|i| format!("file{}", i)).collect();
+        for (i, name) in names.iter().enumerate() {
+            add_file(&mut archive, name, &vec![i as u8; i]);
+        }
+        add_file(&mut archive, "TRAILER!!!", &[]);
+
+        let mut names: Vec<&str> = names.iter().map(|name| name.as_str()).collect();
+        names.extend_from_slice(&["file100", "file", "TRAILER!!!", ""]);
+        assert_eq!(index_and_check(&archive, &names), 100);
+    }
+
+    #[test]
+    fn cpio_index_duplicate_names() {
+        let mut archive = Vec::new();
+        add_file(&mut archive, "vmlinuz", b"first");
+        add_file(&mut archive, "initrd.img", b"initrd");
+        add_file(&mut archive, "vmlinuz", b"second");
+        add_file(&mut archive, "TRAILER!!!", &[]);
+
+        assert_eq!(index_and_check(&archive, &["vmlinuz", "initrd.img"]), 2);
+
+        let cpio = unsafe { MemIter::from_raw(archive.as_ptr(), archive.len()) };
+        let mut table = vec![CpioIndexEntry::EMPTY; CpioIndex::table_len(&cpio)];
+        let index = CpioIndex::new(&cpio, &mut table).unwrap();
+        let vmlinuz = unsafe { index.find_file("vmlinuz\0".as_ptr()) }.unwrap();
+        assert_eq!(unsafe { vmlinuz.as_slice() }, b"first");
+    }
+
+    #[test]
+    fn cpio_index_truncated() {
+        let mut archive = Vec::new();
+        add_file(&mut archive, "vm1", b"kernel1");
+        add_file(&mut archive, "vm2", b"kernel2");
+        add_file(&mut archive, "vm3", b"kernel3");
+        add_file(&mut archive, "TRAILER!!!", &[]);
+
+        // Cut the archive in the middle of each file in turn.
+        let mut found = 0;
+        for len in 0..archive.len() {
+            let count = index_and_check(&archive[..len], &["vm1", "vm2", "vm3"]);
+            assert!(count >= found);
+            found = count;
+        }
+        assert_eq!(found, 3);
+    }
 }
@@ -17,14 +17,18 @@
 use core::mem::{self, ManuallyDrop, MaybeUninit};
 use core::ops::Deref;
 use core::ptr;
+use core::sync::atomic::{AtomicU64, Ordering};
 
 use crate::addr::*;
 use crate::arch::*;
+use crate::dlog::*;
 use crate::init::*;
 use crate::mm::*;
 use crate::page::*;
 use crate::spinlock::*;
+use crate::steal_time::*;
 use crate::types::*;
+use crate::utils::*;
 use crate::vm::*;
 
 use arrayvec::ArrayVec;
@@ -67,7 +71,7 @@ pub const STACK_SIZE: usize = PAGE_SIZE;
 pub const INTERRUPT_REGISTER_BITS: usize = 32;
 
 #[repr(C)]
-#[derive(PartialEq)]
+#[derive(Clone, Copy, PartialEq)]
 pub enum VCpuStatus {
     /// The vcpu is switched off.
     Off,
@@ -239,12 +243,75 @@ impl ArchRegs {
     }
 }
 
+/// Tracks the virtual timer deadlines of blocked vCPUs, so that the hypervisor timer (cnthp) can
+/// tell the primary VM when they become runnable instead of the primary keeping a timer per vCPU.
+///
+/// There are at most `MAX_VMS * MAX_CPUS` vCPUs, so deadlines are kept in a flat table indexed
+/// by VM and vCPU rather than in hashed slots.
+pub struct TimerWheel {
+    /// Absolute deadline, in counter ticks, of each tracked vCPU.
+    deadlines: [[Option<u64>; MAX_CPUS]; MAX_VMS],
+}
+
+// The expired vCPUs of a VM are reported as a u32 bitmap.
+const_assert!(MAX_CPUS <= 32);
+
+impl TimerWheel {
+    pub fn new() -> Self {
+        Self {
+            deadlines: [[None; MAX_CPUS]; MAX_VMS],
+        }
+    }
+
+    fn get_vm_index(vm_id: spci_vm_id_t) -> usize {
+        (vm_id - HF_VM_ID_OFFSET) as _
+    }
+
+    /// Starts tracking the deadline of the given vCPU, replacing any previous one.
+    pub fn insert(&mut self, vm_id: spci_vm_id_t, vcpu_idx: spci_vcpu_index_t, deadline: u64) {
+        self.deadlines[Self::get_vm_index(vm_id)][vcpu_idx as usize] = Some(deadline);
+    }
+
+    /// Stops tracking the deadline of the given vCPU, if any.
+    pub fn remove(&mut self, vm_id: spci_vm_id_t, vcpu_idx: spci_vcpu_index_t) {
+        self.deadlines[Self::get_vm_index(vm_id)][vcpu_idx as usize] = None;
+    }
+
+    /// Returns the earliest deadline being tracked, if any.
+    pub fn next_deadline(&self) -> Option<u64> {
+        self.deadlines.iter().flatten().filter_map(|d| *d).min()
+    }
+
+    /// Finds the first VM with vCPUs whose deadline is at or before `now`, and stops tracking
+    /// them.
+    ///
+    /// Returns the VM ID and a bitmap of its expired vCPUs.
+    pub fn fetch_expired(&mut self, now: u64) -> Option<(spci_vm_id_t, u32)> {
+        for (vm_index, deadlines) in self.deadlines.iter_mut().enumerate() {
+            let mut vcpus = 0u32;
+
+            for (vcpu_index, deadline) in deadlines.iter_mut().enumerate() {
+                if deadline.map_or(false, |d| d <= now) {
+                    *deadline = None;
+                    vcpus |= 1 << vcpu_index;
+                }
+            }
+
+            if vcpus != 0 {
+                return Some((vm_index as spci_vm_id_t + HF_VM_ID_OFFSET, vcpus));
+            }
+        }
+
+        None
+    }
+}
+
 #[repr(C)]
 pub struct VCpuFaultInfo {
-    ipaddr: ipaddr_t,
+    pub ipaddr: ipaddr_t,
     vaddr: vaddr_t,
     pc: vaddr_t,
-    mode: Mode,
+    pub mode: Mode,
 }
 
 pub struct VCpuInner {
@@ -254,6 +321,13 @@ pub struct VCpuInner {
     pub state: VCpuStatus,
     pub cpu: *const Cpu,
     pub regs: ArchRegs,
+
+    /// The virtual counter value when the vCPU was last switched to or from, or started.
+    pub last_switch: u64,
+
+    /// The virtual counter value at which the vCPU gives up waiting for a message, if it is
+    /// blocked in a mailbox receive with a timeout.
+    pub recv_deadline: Option<u64>,
 }
 
 impl VCpuInner {
@@ -264,6 +338,8 @@ impl VCpuInner {
             state: VCpuStatus::Off,
             cpu: ptr::null(),
             regs: ArchRegs::default(),
+            last_switch: 0,
+            recv_deadline: None,
         }
     }
 
@@ -273,6 +349,7 @@ impl VCpuInner {
     pub fn on(&mut self, entry: ipaddr_t, arg: uintreg_t) {
         self.regs.set_pc_arg(entry, arg);
         self.state = VCpuStatus::Ready;
+        self.last_switch = unsafe { arch_timer_count() };
     }
 
     /// Check whether self is an off state, for the purpose of turning vCPUs on
@@ -292,6 +369,11 @@ pub struct VCpu {
     /// If a vCPU of secondary VMs is running, its lock is logically held by the running pCPU.
     pub inner: SpinLock<VCpuInner>,
     pub interrupts: SpinLock<Interrupts>,
+    pub times: VCpuTimes,
+
+    /// The virtual counter value from which the vCPU, while blocked, has been able to run again,
+    /// or `u64::MAX` if it hasn't. The time since then is accounted as steal time.
+    runnable_since: AtomicU64,
 }
 
 impl VCpu {
@@ -300,6 +382,8 @@ impl VCpu {
             vm,
             inner: SpinLock::new(VCpuInner::new()),
             interrupts: SpinLock::new(Interrupts::new()),
+            times: VCpuTimes::new(),
+            runnable_since: AtomicU64::new(core::u64::MAX),
         }
     }
 
@@ -313,6 +397,68 @@ impl VCpu {
         assert!(index < core::u16::MAX as isize);
         index as _
     }
+
+    /// Charges the time since the vCPU was last switched to what it has been doing: running if
+    /// `running`, or otherwise what its state says. The counters are also published to the VM's
+    /// steal-time page if it has one. `vcpu_inner` must be the vCPU's execution-locked inner
+    /// state.
+    ///
+    /// A blocked vCPU is only charged for being blocked until it was able to run again, and for
+    /// steal time after that.
+    pub fn account_time(&self, vcpu_inner: &mut VCpuInner, running: bool) {
+        let now = unsafe { arch_timer_count() };
+        let last_switch = mem::replace(&mut vcpu_inner.last_switch, now);
+
+        let time = if running {
+            VCpuTime::Running
+        } else {
+            some_or!(VCpuTime::from_state(vcpu_inner.state), return)
+        };
+
+        let runnable_since = self
+            .runnable_since
+            .swap(core::u64::MAX, Ordering::Relaxed)
+            .max(last_switch);
+        if time != VCpuTime::Running && time != VCpuTime::Steal && runnable_since < now {
+            self.charge_time(time, runnable_since - last_switch);
+            self.charge_time(VCpuTime::Steal, now - runnable_since);
+        } else {
+            self.charge_time(time, now.wrapping_sub(last_switch));
+        }
+    }
+
+    /// Adds the given ticks to the given counter, publishing it to the VM's steal-time page if it
+    /// has one.
+    fn charge_time(&self, time: VCpuTime, ticks: u64) {
+        let ticks = self.times.add(time, ticks);
+        if let Some(steal_time) = self.vm().get_steal_time() {
+            steal_time.vcpus[self.index() as usize].set(time, ticks);
+        }
+    }
+
+    /// Records that the vCPU, if it is blocked, has been able to run again since the given
+    /// virtual counter value, unless it already was earlier.
+    pub fn mark_runnable(&self, since: u64) {
+        let mut old = self.runnable_since.load(Ordering::Relaxed);
+        while since < old {
+            match self.runnable_since.compare_exchange_weak(
+                old,
+                since,
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(current) => old = current,
+            }
+        }
+    }
+
+    /// Records that the vCPU is blocked until the given virtual counter value, or until it is
+    /// woken up if there is none, forgetting when it was last able to run.
+    pub fn set_blocked_until(&self, deadline: Option<u64>) {
+        self.runnable_since
+            .store(deadline.unwrap_or(core::u64::MAX), Ordering::Relaxed);
+    }
 }
 
 /// Encapsulates a vCPU whose lock is held.
@@ -360,6 +506,12 @@ impl VCpuExecutionLocked {
     pub fn get_inner_mut(&mut self) -> &mut VCpuInner {
         unsafe { (*self.vcpu).inner.get_mut_unchecked() }
     }
+
+    /// Charges the time since the vCPU was last switched to running.
+    pub fn account_running_time(&mut self) {
+        let vcpu = unsafe { &*self.vcpu };
+        vcpu.account_time(self.get_inner_mut(), true);
+    }
 }
 
 // TODO: Update alignment such that cpus are in different cache lines.
@@ -374,6 +526,12 @@ pub struct Cpu {
 
     /// Determines whether or not the cpu is currently on.
     is_on: SpinLock<bool>,
+
+    /// Deadlines of the vCPUs which blocked on this CPU with their timer armed.
+    pub timer_wheel: SpinLock<TimerWheel>,
+
+    /// Logs written on this CPU which are not yet drained to the serial device.
+    pub dlog_ring: DlogRing,
 }
 
 impl Cpu {
@@ -382,6 +540,8 @@ impl Cpu {
             id,
             stack_bottom: stack_bottom as *mut _,
             is_on: SpinLock::new(is_on),
+            timer_wheel: SpinLock::new(TimerWheel::new()),
+            dlog_ring: DlogRing::new(),
         }
     }
 }
@@ -404,6 +564,9 @@ pub unsafe fn cpu_get_buffer(cpu_id: cpu_id_t) -> &'static mut RawPage {
 pub struct CpuManager {
     /// State of all supported CPUs.
     cpus: ArrayVec<[Cpu; MAX_CPUS]>,
+
+    /// The start of the CPUs' stacks, which are laid out in the order of `cpus`.
+    stacks_begin: usize,
 }
 
 impl CpuManager {
@@ -413,6 +576,7 @@ impl CpuManager {
         stacks: &[[u8; STACK_SIZE]; MAX_CPUS],
     ) -> Self {
         let mut cpus: ArrayVec<[Cpu; MAX_CPUS]> = ArrayVec::new();
+        let stacks_begin = stacks.as_ptr() as usize;
 
         // Initialize boot CPU.
         let boot_stack = stacks[0].as_ptr() as usize;
@@ -436,7 +600,7 @@ impl CpuManager {
             ));
         }
 
-        Self { cpus }
+        Self { cpus, stacks_begin }
     }
 
     pub fn index_of(&self, c: *const Cpu) -> usize {
@@ -462,6 +626,18 @@ impl CpuManager {
         self.cpus.iter().find(|cpu| cpu.id == id)
     }
 
+    /// Returns the CPU whose stack contains the given address. Looking up the address of a local
+    /// variable finds the current CPU. The stacks are contiguous, so this takes no search and is
+    /// cheap enough to do for each logged byte.
+    pub fn lookup_by_stack(&self, addr: usize) -> Option<&Cpu> {
+        self.cpus
+            .get(addr.checked_sub(self.stacks_begin)? / STACK_SIZE)
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &Cpu> {
+        self.cpus.iter()
+    }
+
     // TODO(HfO2): strange name...  boot_cpu itself looks suspicious...
     pub fn get_boot_cpu(&self) -> &Cpu {
         unsafe { self.cpus.get_unchecked(0) }
@@ -487,6 +663,16 @@ pub unsafe extern "C" fn cpu_off(c: *mut Cpu) {
     *(*c).is_on.lock() = false;
 }
 
+/// Returns the earliest deadline of the blocked vCPUs tracked on the given CPU, or u64::MAX if
+/// there is none.
+#[no_mangle]
+pub unsafe extern "C" fn cpu_timer_deadline(c: *const Cpu) -> u64 {
+    (*c).timer_wheel
+        .lock()
+        .next_deadline()
+        .unwrap_or(core::u64::MAX)
+}
+
 /// Searches for a CPU based on its id.
 #[no_mangle]
 pub extern "C" fn cpu_find(id: cpu_id_t) -> *const Cpu {
@@ -598,6 +784,12 @@ pub unsafe extern "C" fn vcpu_secondary_reset_and_start(
         // pCPU it is running on.
         state.regs.reset(false, vm, cpu_id_t::from(vcpu.index()));
         state.on(entry, arg);
+
+        // The primary VM needs to start running it.
+        if let Some(run_state) = hypervisor().vcpu_run_states.get(vm.id, vcpu.index()) {
+            run_state.set_state(VCpuStatus::Ready);
+            run_state.set_needs_wake(true);
+        }
     }
 
     vcpu_was_off
@@ -617,7 +809,40 @@ pub unsafe extern "C" fn vcpu_handle_page_fault(
     let vm = &*current.vm;
     let f = &*f;
     let mask = f.mode | Mode::INVALID;
-    let vm_inner = vm.inner.lock();
+    let mut vm_inner = vm.inner.lock();
+    let mode = vm_inner.ptable.get_raw_mode(f.ipaddr, ipa_add(f.ipaddr, 1));
+
+    if let Ok(mode) = mode {
+        // The first access to memory whose access flag was cleared is logged
+        // by setting the flag again. Access flags are kept for whole blocks, so
+        // the block isn't split.
+        if mode.contains(Mode::ACCESS_LOG) {
+            let page = pa_from_ipa(ipa_init(round_down(ipa_addr(f.ipaddr), PAGE_SIZE)));
+            vm_inner.ptable.update_modes(
+                page,
+                pa_add(page, PAGE_SIZE),
+                |_, _, mode| mode - Mode::ACCESS_LOG,
+                &hypervisor().mpool,
+            );
+            return true;
+        }
+
+        // Writes to memory write-protected for dirty logging are logged by
+        // making the page writable again, so that it is found to be dirty.
+        if f.mode == Mode::W && mode.contains(Mode::DIRTY_LOG) {
+            let page = pa_from_ipa(ipa_init(round_down(ipa_addr(f.ipaddr), PAGE_SIZE)));
+            return vm_inner
+                .ptable
+                .identity_map(
+                    page,
+                    pa_add(page, PAGE_SIZE),
+                    mode - Mode::DIRTY_LOG,
+                    &hypervisor().mpool,
+                )
+                .map_err(|_| dlog_warn!("Failed to log write to {:#x}\n", pa_addr(page)))
+                .is_ok();
+        }
+    }
 
     // Check if this is a legitimate fault, i.e., if the page table doesn't
     // allow the access attemped by the VM.
@@ -627,14 +852,10 @@ pub unsafe extern "C" fn vcpu_handle_page_fault(
     // invalidations while holding the VM lock, so we don't need to do
     // anything else to recover from it. (Acquiring/releasing the lock
     // ensured that the invalidations have completed.)
-    let resume = vm_inner
-        .ptable
-        .get_mode(f.ipaddr, ipa_add(f.ipaddr, 1))
-        .map(|mode| mode & mask == f.mode)
-        .unwrap_or(false);
+    let resume = mode.map(|mode| mode & mask == f.mode).unwrap_or(false);
 
     if !resume {
-        dlog!(
+        dlog_warn!(
             "Stage-2 page fault: pc=0x{}, vmid={}, vcpu={}, vaddr=0x{}, ipaddr=0x{}, mode=0x{}\n",
             f.pc,
             vm.id,
@@ -647,3 +868,35 @@ pub unsafe extern "C" fn vcpu_handle_page_fault(
 
     resume
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    /// Expired deadlines are reported once per VM and the rest are kept.
+    #[test]
+    fn timer_wheel_fetch_expired() {
+        let mut wheel = TimerWheel::new();
+        assert_eq!(wheel.next_deadline(), None);
+
+        wheel.insert(HF_PRIMARY_VM_ID + 1, 0, 300);
+        wheel.insert(HF_PRIMARY_VM_ID + 1, 2, 100);
+        wheel.insert(HF_PRIMARY_VM_ID + 2, 1, 200);
+        assert_eq!(wheel.next_deadline(), Some(100));
+
+        assert_eq!(wheel.fetch_expired(50), None);
+        assert_eq!(
+            wheel.fetch_expired(200),
+            Some((HF_PRIMARY_VM_ID + 1, 0b100))
+        );
+        assert_eq!(
+            wheel.fetch_expired(200),
+            Some((HF_PRIMARY_VM_ID + 2, 0b010))
+        );
+        assert_eq!(wheel.fetch_expired(200), None);
+        assert_eq!(wheel.next_deadline(), Some(300));
+
+        wheel.remove(HF_PRIMARY_VM_ID + 1, 0);
+        assert_eq!(wheel.next_deadline(), None);
+    }
+}
@@ -14,10 +14,14 @@
  * limitations under the License.
  */
 
+use core::cell::UnsafeCell;
 use core::fmt;
 use core::mem;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
 
+use crate::init::*;
 use crate::spinlock::*;
+use crate::types::*;
 
 extern "C" {
     fn plat_console_putchar(c: u8);
@@ -35,27 +39,294 @@ impl fmt::Write for Writer {
     fn write_str(&mut self, s: &str) -> fmt::Result {
         for byte in s.bytes() {
             unsafe {
-                dlog_putchar(byte);
+                console_putchar(byte);
             }
         }
         Ok(())
     }
 }
 
+/// Writes to the log ring of the current CPU.
+struct RingWriter {
+    ring: &'static DlogRing,
+    cpu_index: usize,
+}
+
+impl fmt::Write for RingWriter {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        for byte in s.bytes() {
+            ring_putchar(self.ring, self.cpu_index, byte);
+        }
+        Ok(())
+    }
+}
+
 static WRITER: SpinLock<Writer> = SpinLock::new(Writer::new());
 static mut DLOG_LOCK_ENABLED: bool = false;
 
+/// Whether logs are written to the per-CPU rings rather than directly to the serial device.
+static DLOG_BUFFERED: AtomicBool = AtomicBool::new(false);
+
+/// Serialises draining the per-CPU rings to the serial device and the log buffer.
+static DLOG_DRAIN_LOCK: SpinLock<()> = SpinLock::new(());
+
+const DLOG_RING_SIZE: usize = 2048;
+
+/// The longest prefix of a line in a log ring, "[<CPU index>] ".
+const DLOG_PREFIX_MAX: usize = 8;
+
+const_assert!(MAX_CPUS < 10_000);
+
+/// The log ring of a CPU. Only the CPU itself writes to it, and only the CPU holding
+/// `DLOG_DRAIN_LOCK` reads from it, so logging doesn't need a global lock.
+pub struct DlogRing {
+    buffer: UnsafeCell<[u8; DLOG_RING_SIZE]>,
+
+    /// The number of bytes ever written. Only updated by the owning CPU.
+    head: AtomicUsize,
+
+    /// The number of bytes ever drained. Only updated with `DLOG_DRAIN_LOCK` held.
+    tail: AtomicUsize,
+
+    /// Whether the next byte written starts a line. Only accessed by the owning CPU.
+    line_start: UnsafeCell<bool>,
+}
+
+unsafe impl Sync for DlogRing {}
+
+impl DlogRing {
+    pub const fn new() -> Self {
+        Self {
+            buffer: UnsafeCell::new([0; DLOG_RING_SIZE]),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            line_start: UnsafeCell::new(true),
+        }
+    }
+
+    /// Appends the given bytes to the ring, and returns the number of bytes in it. Fails, without
+    /// appending any, if they don't fit. Must only be called by the owning CPU.
+    fn push(&self, bytes: &[u8]) -> Result<usize, ()> {
+        let head = self.head.load(Ordering::Relaxed);
+        let tail = self.tail.load(Ordering::Acquire);
+        if DLOG_RING_SIZE - head.wrapping_sub(tail) < bytes.len() {
+            return Err(());
+        }
+
+        let buffer = unsafe { &mut *self.buffer.get() };
+        for (i, &c) in bytes.iter().enumerate() {
+            buffer[head.wrapping_add(i) % DLOG_RING_SIZE] = c;
+        }
+        let head = head.wrapping_add(bytes.len());
+        self.head.store(head, Ordering::Release);
+        Ok(head.wrapping_sub(tail))
+    }
+
+    /// Appends a byte to the ring, preceded by the given CPU index if it starts a line, so that
+    /// lines of different CPUs can be told apart once drained. Returns the number of bytes in the
+    /// ring, or fails if they don't fit. Must only be called by the owning CPU.
+    fn write(&self, cpu_index: usize, c: u8) -> Result<usize, ()> {
+        let line_start = unsafe { &mut *self.line_start.get() };
+        let mut bytes = [0; DLOG_PREFIX_MAX + 1];
+        let mut len = 0;
+
+        if *line_start {
+            bytes[0] = b'[';
+            len = 1;
+            let digits = (1..).take_while(|&i| cpu_index >= 10usize.pow(i)).count() + 1;
+            for i in 0..digits {
+                bytes[len + digits - 1 - i] = b'0' + (cpu_index / 10usize.pow(i as u32) % 10) as u8;
+            }
+            len += digits;
+            bytes[len] = b']';
+            bytes[len + 1] = b' ';
+            len += 2;
+        }
+        bytes[len] = c;
+
+        let ret = self.push(&bytes[..=len])?;
+        *line_start = c == b'\n';
+        Ok(ret)
+    }
+
+    /// Writes the complete lines in the ring to the serial device and the log buffer. An
+    /// incomplete line is also written if `all` or the ring is full.
+    ///
+    /// # Safety
+    ///
+    /// `DLOG_DRAIN_LOCK` must be held, unless no other CPU can drain any more.
+    unsafe fn drain(&self, all: bool) {
+        let head = self.head.load(Ordering::Acquire);
+        let tail = self.tail.load(Ordering::Relaxed);
+        let buffer = &*self.buffer.get();
+
+        // Stop after the last complete line, so lines of different CPUs don't interleave.
+        let end = if all || head.wrapping_sub(tail) == DLOG_RING_SIZE {
+            head
+        } else {
+            let mut end = head;
+            while end != tail && buffer[end.wrapping_sub(1) % DLOG_RING_SIZE] != b'\n' {
+                end = end.wrapping_sub(1);
+            }
+            end
+        };
+
+        let mut i = tail;
+        while i != end {
+            console_putchar(buffer[i % DLOG_RING_SIZE]);
+            i = i.wrapping_add(1);
+        }
+
+        self.tail.store(end, Ordering::Release);
+    }
+}
+
+/// Returns the index and log ring of the current CPU, found by the stack it is running on.
+fn current_ring() -> Option<(usize, &'static DlogRing)> {
+    let marker = 0u8;
+    let cpu_manager = &hypervisor().cpu_manager;
+    let cpu = cpu_manager.lookup_by_stack(&marker as *const _ as usize)?;
+    Some((cpu_manager.index_of(cpu), &cpu.dlog_ring))
+}
+
+/// Drains every CPU's log ring.
+///
+/// # Safety
+///
+/// `DLOG_DRAIN_LOCK` must be held, unless no other CPU can drain any more.
+unsafe fn drain_all(all: bool) {
+    for cpu in hypervisor().cpu_manager.iter() {
+        cpu.dlog_ring.drain(all);
+    }
+}
+
+/// Writes a byte to the given log ring of the current CPU, opportunistically draining the rings
+/// once a line is complete and the ring is half full. Drops the byte if the ring is full and
+/// another CPU is draining.
+fn ring_putchar(ring: &DlogRing, cpu_index: usize, c: u8) {
+    let len = ring.write(cpu_index, c).or_else(|_| {
+        let _guard = DLOG_DRAIN_LOCK.try_lock()?;
+        unsafe { drain_all(false) };
+        ring.write(cpu_index, c)
+    });
+
+    if c == b'\n' && len.map_or(false, |len| len >= DLOG_RING_SIZE / 2) {
+        dlog_drain();
+    }
+}
+
+/// The level of a diagnostic message, from the most to the least important.
+#[derive(Clone, Copy)]
+pub enum LogLevel {
+    Error = 0,
+    Warn = 1,
+    Info = 2,
+    Debug = 3,
+    Trace = 4,
+}
+
+/// The least important level logged. Each `log_level_*` feature enables the more important levels
+/// too, so the most verbose one enabled wins.
+#[cfg(feature = "log_level_trace")]
+pub const LOG_LEVEL: LogLevel = LogLevel::Trace;
+#[cfg(all(feature = "log_level_debug", not(feature = "log_level_trace")))]
+pub const LOG_LEVEL: LogLevel = LogLevel::Debug;
+#[cfg(all(feature = "log_level_info", not(feature = "log_level_debug")))]
+pub const LOG_LEVEL: LogLevel = LogLevel::Info;
+#[cfg(all(feature = "log_level_warn", not(feature = "log_level_info")))]
+pub const LOG_LEVEL: LogLevel = LogLevel::Warn;
+#[cfg(not(feature = "log_level_warn"))]
+pub const LOG_LEVEL: LogLevel = LogLevel::Error;
+
 #[macro_export]
 macro_rules! dlog {
     ($($arg:tt)*) => ($crate::dlog::_print(format_args!($($arg)*)));
 }
 
+/// Logs the message if `$level` is enabled. The condition is a constant, so disabled messages,
+/// arguments included, are compiled out.
+#[macro_export]
+macro_rules! dlog_level {
+    ($level:ident, $($arg:tt)*) => {
+        if $crate::dlog::LogLevel::$level as u8 <= $crate::dlog::LOG_LEVEL as u8 {
+            dlog!($($arg)*);
+        }
+    };
+}
+
+#[macro_export]
+macro_rules! dlog_error {
+    ($($arg:tt)*) => (dlog_level!(Error, $($arg)*));
+}
+
+#[macro_export]
+macro_rules! dlog_warn {
+    ($($arg:tt)*) => (dlog_level!(Warn, $($arg)*));
+}
+
+#[macro_export]
+macro_rules! dlog_info {
+    ($($arg:tt)*) => (dlog_level!(Info, $($arg)*));
+}
+
+#[macro_export]
+macro_rules! dlog_debug {
+    ($($arg:tt)*) => (dlog_level!(Debug, $($arg)*));
+}
+
+#[macro_export]
+macro_rules! dlog_trace {
+    ($($arg:tt)*) => (dlog_level!(Trace, $($arg)*));
+}
+
 #[doc(hidden)]
 pub fn _print(args: fmt::Arguments) {
     use core::fmt::Write;
+
+    // A CPU's ring is only written by itself, so no lock is needed. The ring is looked up once
+    // for the whole message.
+    if DLOG_BUFFERED.load(Ordering::Relaxed) {
+        if let Some((cpu_index, ring)) = current_ring() {
+            RingWriter { ring, cpu_index }.write_fmt(args).unwrap();
+        } else {
+            let _guard = DLOG_DRAIN_LOCK.lock();
+            Writer::new().write_fmt(args).unwrap();
+        }
+        return;
+    }
+
     WRITER.lock().write_fmt(args).unwrap();
 }
 
+/// Makes logs go to per-CPU rings, which are drained to the serial device later. This must be
+/// called after the CPUs are initialised.
+pub fn dlog_enable_buffering() {
+    DLOG_BUFFERED.store(true, Ordering::Release);
+}
+
+/// Writes the complete lines logged so far to the serial device, unless another CPU is already
+/// doing so. This is called from paths that are not latency-sensitive, such as switching back to
+/// the primary VM.
+#[no_mangle]
+pub extern "C" fn dlog_drain() {
+    if !DLOG_BUFFERED.load(Ordering::Acquire) {
+        return;
+    }
+
+    if let Ok(_guard) = DLOG_DRAIN_LOCK.try_lock() {
+        unsafe { drain_all(false) };
+    }
+}
+
+/// Writes everything logged so far to the serial device, and makes logs go directly to it from
+/// now on. Only called on panic, so it doesn't wait for another CPU draining the rings.
+#[no_mangle]
+pub extern "C" fn dlog_flush() {
+    if DLOG_BUFFERED.swap(false, Ordering::Acquire) {
+        unsafe { drain_all(true) };
+    }
+}
+
 /// Enables the lock protecting the serial device.
 #[no_mangle]
 pub unsafe extern "C" fn dlog_enable_lock() {
@@ -64,14 +335,14 @@ pub unsafe extern "C" fn dlog_enable_lock() {
 
 #[no_mangle]
 pub unsafe extern "C" fn dlog_lock() {
-    if DLOG_LOCK_ENABLED {
+    if DLOG_LOCK_ENABLED && !DLOG_BUFFERED.load(Ordering::Relaxed) {
         mem::forget(WRITER.lock());
     }
 }
 
 #[no_mangle]
 pub unsafe extern "C" fn dlog_unlock() {
-    if DLOG_LOCK_ENABLED {
+    if DLOG_LOCK_ENABLED && !DLOG_BUFFERED.load(Ordering::Relaxed) {
         WRITER.unlock_unchecked();
     }
 }
@@ -88,7 +359,54 @@ pub static mut dlog_buffer: [u8; DLOG_BUFFER_SIZE] = [0; DLOG_BUFFER_SIZE];
 
 #[no_mangle]
 pub unsafe extern "C" fn dlog_putchar(c: u8) {
+    if DLOG_BUFFERED.load(Ordering::Relaxed) {
+        // Without a ring, the serial device and the log buffer are shared with the CPUs draining
+        // the rings.
+        match current_ring() {
+            Some((cpu_index, ring)) => ring_putchar(ring, cpu_index, c),
+            None => {
+                let _guard = DLOG_DRAIN_LOCK.lock();
+                console_putchar(c);
+            }
+        }
+        return;
+    }
+
+    console_putchar(c);
+}
+
+unsafe fn console_putchar(c: u8) {
     dlog_buffer[dlog_buffer_offset] = c;
     dlog_buffer_offset = (dlog_buffer_offset + 1) % DLOG_BUFFER_SIZE;
     plat_console_putchar(c);
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn dlog_ring_drains_complete_lines() {
+        let ring = DlogRing::new();
+        for &c in b"ab\ncd" {
+            assert!(ring.write(12, c).is_ok());
+        }
+
+        // Each line is prefixed with the CPU index.
+        let buffer = unsafe { &*ring.buffer.get() };
+        assert_eq!(&buffer[..15], b"[12] ab\n[12] cd");
+
+        // Only the complete line is drained.
+        unsafe { ring.drain(false) };
+        assert_eq!(ring.tail.load(Ordering::Relaxed), 8);
+
+        unsafe { ring.drain(true) };
+        assert_eq!(ring.tail.load(Ordering::Relaxed), 15);
+
+        // Bytes are dropped rather than overwritten when the ring is full.
+        for _ in 0..DLOG_RING_SIZE {
+            assert!(ring.push(b"x").is_ok());
+        }
+        assert!(ring.push(b"x").is_err());
+    }
+}
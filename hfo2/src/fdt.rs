@@ -21,6 +21,7 @@ use core::slice;
 use core::str;
 
 use crate::std::*;
+use crate::utils::*;
 
 use scopeguard::guard;
 
@@ -368,6 +369,217 @@ impl<'a> FdtNode<'a> {
     }
 }
 
+/// Marks a missing parent or a free slot in `FdtIndexEntry`.
+const FDT_INDEX_NONE: u32 = u32::max_value();
+
+/// The maximum depth of nodes `FdtIndex` can index.
+const FDT_INDEX_MAX_DEPTH: usize = 32;
+
+/// A slot of the `FdtIndex` hash table. Offsets are from the beginning of the structure block.
+#[derive(Clone, Copy)]
+pub struct FdtIndexEntry {
+    /// The slot of the parent node, or `FDT_INDEX_NONE` for the root.
+    parent: u32,
+
+    /// The hash of the parent slot and the node name.
+    hash: u32,
+
+    /// The offset of the node name.
+    name: u32,
+
+    /// The offset right after the node name, where `FdtNode::find_child` leaves a node, or
+    /// `FDT_INDEX_NONE` if the slot is free.
+    data: u32,
+}
+
+impl FdtIndexEntry {
+    pub const EMPTY: Self = Self {
+        parent: FDT_INDEX_NONE,
+        hash: 0,
+        name: 0,
+        data: FDT_INDEX_NONE,
+    };
+}
+
+/// An index of the nodes of an FDT, built in a single pass over it. A node is found by its parent
+/// and name in O(1) expected time, instead of `FdtNode::find_child` scanning all the siblings
+/// before it. Nodes are identified by their slot in the table, which is borrowed so it can live in
+/// a boot-time buffer.
+pub struct FdtIndex<'a, 'b> {
+    fdt: FdtNode<'a>,
+    table: &'b mut [FdtIndexEntry],
+    root: usize,
+}
+
+/// Hashes a parent slot and a node name.
+fn fdt_index_hash(parent: u32, name: &[u8]) -> u32 {
+    fnv1a(fnv1a(FNV1A_INIT, &parent.to_le_bytes()), name)
+}
+
+/// Strips the null terminator, if any, from a node name.
+fn fdt_index_name(name: &[u8]) -> &[u8] {
+    match name.split_last() {
+        Some((0, name)) => name,
+        _ => name,
+    }
+}
+
+impl<'a, 'b> FdtIndex<'a, 'b> {
+    /// Returns the number of table entries `new` needs to index the given FDT, as returned by
+    /// `FdtNode::new_root`. The table is kept at most half full.
+    pub fn table_len(fdt: &FdtNode<'a>) -> usize {
+        let mut t = FdtTokenizer::new(fdt.data, fdt.strs);
+        let mut count: usize = 0;
+
+        loop {
+            t.skip_properties();
+            if t.next_subnode().is_some() {
+                count += 1;
+            } else if t.token() != Some(FdtToken::EndNode) {
+                break;
+            }
+        }
+
+        (count * 2).next_power_of_two()
+    }
+
+    /// Indexes all the nodes of the given FDT, as returned by `FdtNode::new_root`. The length of
+    /// `table` must be a power of two, and should be at least `table_len(fdt)`.
+    pub fn new(fdt: &FdtNode<'a>, table: &'b mut [FdtIndexEntry]) -> Option<Self> {
+        if !table.len().is_power_of_two() {
+            return None;
+        }
+
+        for entry in table.iter_mut() {
+            *entry = FdtIndexEntry::EMPTY;
+        }
+
+        let mut index = Self {
+            fdt: fdt.clone(),
+            table,
+            root: 0,
+        };
+        let mut t = FdtTokenizer::new(fdt.data, fdt.strs);
+        let mut parents = [FDT_INDEX_NONE; FDT_INDEX_MAX_DEPTH];
+        let mut depth = 0;
+        let mut count = 0;
+
+        loop {
+            t.skip_properties();
+
+            if let Some(name) = t.next_subnode() {
+                // A parent is needed for the root only.
+                if depth == FDT_INDEX_MAX_DEPTH || (depth == 0 && count != 0) {
+                    return None;
+                }
+
+                // Keep a free slot so lookups terminate.
+                if count + 1 == index.table.len() {
+                    return None;
+                }
+
+                let parent = if depth == 0 {
+                    FDT_INDEX_NONE
+                } else {
+                    parents[depth - 1]
+                };
+                let slot = index.insert(parent, name, t.cur);
+
+                parents[depth] = slot as u32;
+                depth += 1;
+                count += 1;
+                continue;
+            }
+
+            match t.token() {
+                Some(FdtToken::EndNode) if depth > 0 => depth -= 1,
+                Some(FdtToken::End) | None if depth == 0 && count != 0 => break,
+                _ => return None,
+            }
+        }
+
+        Some(index)
+    }
+
+    fn offset(&self, ptr: *const u8) -> u32 {
+        (ptr as usize - self.fdt.data.as_ptr() as usize) as u32
+    }
+
+    fn insert(&mut self, parent: u32, name: &'a [u8], data: &'a [u8]) -> usize {
+        let hash = fdt_index_hash(parent, fdt_index_name(name));
+        let mask = self.table.len() - 1;
+        let mut slot = hash as usize & mask;
+
+        while self.table[slot].data != FDT_INDEX_NONE {
+            slot = (slot + 1) & mask;
+        }
+
+        self.table[slot] = FdtIndexEntry {
+            parent,
+            hash,
+            name: self.offset(name.as_ptr()),
+            data: self.offset(data.as_ptr()),
+        };
+
+        if parent == FDT_INDEX_NONE {
+            self.root = slot;
+        }
+
+        slot
+    }
+
+    /// Returns the slot of the root node.
+    pub fn root(&self) -> usize {
+        self.root
+    }
+
+    /// Returns the slot of the child of the given node with the given name. The name may or may
+    /// not be null-terminated.
+    pub fn find_child(&self, parent: usize, name: &[u8]) -> Option<usize> {
+        let name = fdt_index_name(name);
+        let hash = fdt_index_hash(parent as u32, name);
+        let mask = self.table.len() - 1;
+        let mut slot = hash as usize & mask;
+
+        loop {
+            let entry = &self.table[slot];
+            if entry.data == FDT_INDEX_NONE {
+                return None;
+            }
+
+            if entry.parent == parent as u32 && entry.hash == hash {
+                let entry_name = &self.fdt.data[entry.name as usize..];
+                if entry_name.starts_with(name) && entry_name.get(name.len()) == Some(&0) {
+                    return Some(slot);
+                }
+            }
+
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    /// Returns the slot of the node at the given absolute path, e.g. "/hypervisor/vm1".
+    pub fn find_path(&self, path: &[u8]) -> Option<usize> {
+        let (first, path) = path.split_first()?;
+        if *first != b'/' {
+            return None;
+        }
+
+        path.split(|c| *c == b'/')
+            .filter(|name| !name.is_empty())
+            .try_fold(self.root, |node, name| self.find_child(node, name))
+    }
+
+    /// Returns the node in the given slot, as `FdtNode::find_child` would have left it.
+    pub fn node(&self, slot: usize) -> FdtNode<'a> {
+        FdtNode {
+            hdr: self.fdt.hdr,
+            data: &self.fdt.data[self.table[slot].data as usize..],
+            strs: self.fdt.strs,
+        }
+    }
+}
+
 impl FdtHeader {
     pub fn dump(&self) {
         unsafe fn asciz_to_utf8(ptr: *const u8) -> &'static str {
@@ -378,7 +590,7 @@ impl FdtHeader {
 
         // Traverse the whole thing.
         let node = some_or!(FdtNode::new_root(self), {
-            dlog!("FDT failed validation.\n");
+            dlog_error!("FDT failed validation.\n");
             return;
         });
 
@@ -387,18 +599,18 @@ impl FdtHeader {
 
         loop {
             while let Some(name) = t.next_subnode() {
-                dlog!("{:1$}New node: \"{2}\"\n", "", 2 * depth, unsafe {
+                dlog_debug!("{:1$}New node: \"{2}\"\n", "", 2 * depth, unsafe {
                     str::from_utf8_unchecked(name)
                 });
                 depth += 1;
                 while let Some((name, buf)) = t.next_property() {
-                    dlog!("{:1$}property: \"{2}\" (", "", 2 * depth, unsafe {
+                    dlog_debug!("{:1$}property: \"{2}\" (", "", 2 * depth, unsafe {
                         asciz_to_utf8(name)
                     });
                     for (i, byte) in buf.iter().enumerate() {
-                        dlog!("{}{:02x}", if i == 0 { "" } else { " " }, *byte);
+                        dlog_debug!("{}{:02x}", if i == 0 { "" } else { " " }, *byte);
                     }
-                    dlog!(")\n");
+                    dlog_debug!(")\n");
                 }
             }
 
@@ -413,7 +625,7 @@ impl FdtHeader {
             }
         }
 
-        dlog!(
+        dlog_debug!(
             "fdt: off_mem_rsvmap={}\n",
             u32::from_be(self.off_mem_rsvmap)
         );
@@ -423,7 +635,7 @@ impl FdtHeader {
 
         unsafe {
             while (*entry).address != 0 || (*entry).size != 0 {
-                dlog!(
+                dlog_debug!(
                     "Entry: {:p} ({:#x} bytes)\n",
                     u64::from_be((*entry).address) as *const u8,
                     u64::from_be((*entry).size)
@@ -433,29 +645,62 @@ impl FdtHeader {
         }
     }
 
-    pub unsafe fn add_mem_reservation(&mut self, addr: u64, len: u64) {
-        // TODO: Clean this up.
+    /// Adds the given `(address, size)` memory reservations in front of the existing ones. The
+    /// ranges are sorted, and overlapping or adjacent ones are merged, in place; empty ones are
+    /// dropped. The rest of the FDT is moved only once, so there must be room after it for all the
+    /// ranges. Fails, leaving the FDT unchanged, if a range wraps around the end of the address
+    /// space.
+    pub unsafe fn add_mem_reservations(&mut self, ranges: &mut [(u64, u64)]) -> Result<(), ()> {
+        ranges.sort_unstable_by_key(|(addr, _)| *addr);
+
+        let mut count = 0;
+        for i in 0..ranges.len() {
+            let (addr, size) = ranges[i];
+            if size == 0 {
+                continue;
+            }
+
+            let end = addr.checked_add(size).ok_or(())?;
+            if count > 0 {
+                let (prev_addr, prev_size) = &mut ranges[count - 1];
+                if addr <= *prev_addr + *prev_size {
+                    *prev_size = (*prev_size).max(end - *prev_addr);
+                    continue;
+                }
+            }
+
+            ranges[count] = (addr, size);
+            count += 1;
+        }
+
+        if count == 0 {
+            return Ok(());
+        }
+
         let begin =
             (self as *const _ as usize as *mut u8).add(u32::from_be(self.off_mem_rsvmap) as usize);
         #[allow(clippy::cast_ptr_alignment)]
-        let e = begin as *mut FdtReserveEntry;
+        let entries = begin as *mut FdtReserveEntry;
         let old_size = (u32::from_be(self.totalsize) - u32::from_be(self.off_mem_rsvmap)) as usize;
+        let added = (count * mem::size_of::<FdtReserveEntry>()) as u32;
+
+        self.totalsize = (u32::from_be(self.totalsize) + added).to_be();
+        self.off_dt_struct = (u32::from_be(self.off_dt_struct) + added).to_be();
+        self.off_dt_strings = (u32::from_be(self.off_dt_strings) + added).to_be();
+
+        ptr::copy(begin, begin.add(added as usize), old_size);
+
+        for (i, (addr, size)) in ranges[..count].iter().enumerate() {
+            ptr::write(
+                entries.add(i),
+                FdtReserveEntry {
+                    address: addr.to_be(),
+                    size: size.to_be(),
+                },
+            );
+        }
 
-        self.totalsize =
-            (u32::from_be(self.totalsize) + mem::size_of::<FdtReserveEntry>() as u32).to_be();
-        self.off_dt_struct =
-            (u32::from_be(self.off_dt_struct) + mem::size_of::<FdtReserveEntry>() as u32).to_be();
-        self.off_dt_strings =
-            (u32::from_be(self.off_dt_strings) + mem::size_of::<FdtReserveEntry>() as u32).to_be();
-
-        ptr::copy(
-            begin,
-            begin.add(mem::size_of::<FdtReserveEntry>()),
-            old_size,
-        );
-
-        (*e).address = addr.to_be();
-        (*e).size = len.to_be();
+        Ok(())
     }
 
     pub fn total_size(&self) -> u32 {
@@ -496,6 +741,11 @@ pub unsafe extern "C" fn fdt_read_property(
 
 #[cfg(test)]
 mod test {
+    extern crate std;
+    use std::format;
+    use std::vec;
+    use std::vec::Vec;
+
     use super::*;
 
     static TEST_DTB: [u8; 12 * 27] = [
@@ -531,4 +781,162 @@ mod test {
             mem::size_of_val(&TEST_DTB)
         );
     }
+
+    /// Builds a DTB whose root has `count` nodes, "node@<i>" with a "reg" property of `i` and a
+    /// child "child" with a "reg" property of `count + i`. It is built as words, so it is aligned.
+    fn build_dtb(count: usize) -> Vec<u32> {
+        fn begin_node(s: &mut Vec<u32>, name: &str) {
+            s.push(u32::to_be(FdtToken::BeginNode as u32));
+            let mut bytes = name.as_bytes().to_vec();
+            bytes.resize((bytes.len() + 4) & !3, 0);
+            for word in bytes.chunks(4) {
+                s.push(u32::from_ne_bytes(word.try_into().unwrap()));
+            }
+        }
+
+        fn reg(s: &mut Vec<u32>, value: u32) {
+            // "reg" is at offset 0 of the strings block.
+            s.extend_from_slice(&[FdtToken::Prop as u32, 4, 0, value]);
+            for word in s.iter_mut().rev().take(4) {
+                *word = u32::to_be(*word);
+            }
+        }
+
+        let mut structure = Vec::new();
+        begin_node(&mut structure, "");
+        for i in 0..count {
+            begin_node(&mut structure, &format!("node@{}", i));
+            reg(&mut structure, i as u32);
+            begin_node(&mut structure, "child");
+            reg(&mut structure, (count + i) as u32);
+            structure.push(u32::to_be(FdtToken::EndNode as u32));
+            structure.push(u32::to_be(FdtToken::EndNode as u32));
+        }
+        structure.push(u32::to_be(FdtToken::EndNode as u32));
+        structure.push(u32::to_be(FdtToken::End as u32));
+
+        let strings = u32::from_ne_bytes(*b"reg\0");
+
+        // The header, an empty memory reservation block, the structure and the strings.
+        let off_dt_struct =
+            (mem::size_of::<FdtHeader>() + mem::size_of::<FdtReserveEntry>()) as u32;
+        let size_dt_struct = (structure.len() * 4) as u32;
+        let header = [
+            FDT_MAGIC,
+            off_dt_struct + size_dt_struct + 4,
+            off_dt_struct,
+            off_dt_struct + size_dt_struct,
+            mem::size_of::<FdtHeader>() as u32,
+            FDT_VERSION,
+            16,
+            0,
+            4,
+            size_dt_struct,
+        ];
+
+        let mut dtb: Vec<u32> = header.iter().map(|word| u32::to_be(*word)).collect();
+        dtb.extend_from_slice(&[0; 4]);
+        dtb.extend_from_slice(&structure);
+        dtb.push(strings);
+        dtb
+    }
+
+    #[test]
+    fn index_many_nodes() {
+        const NODES: usize = 500;
+
+        let dtb = build_dtb(NODES);
+        let fdt = FdtNode::new_root(unsafe { &*(dtb.as_ptr() as *const FdtHeader) }).unwrap();
+
+        // The root and two nodes per entry.
+        let mut table = vec![FdtIndexEntry::EMPTY; FdtIndex::table_len(&fdt)];
+        assert_eq!(table.len(), (2 * (1 + 2 * NODES)).next_power_of_two());
+        let index = FdtIndex::new(&fdt, &mut table).unwrap();
+
+        let mut root = fdt.clone();
+        root.find_child("\0".as_ptr()).unwrap();
+        assert_eq!(index.find_path(b"/"), Some(index.root()));
+        assert_eq!(index.node(index.root()).data.as_ptr(), root.data.as_ptr());
+
+        for i in (0..NODES).rev() {
+            let name = format!("node@{}\0", i);
+            let slot = index.find_path(format!("/{}", name).as_bytes()).unwrap();
+            let node = index.node(slot);
+            assert_eq!(
+                node.read_property("reg\0".as_ptr()),
+                Ok(&(i as u32).to_be_bytes()[..])
+            );
+
+            // The index agrees with a linear search.
+            let mut expected = root.clone();
+            expected.find_child(name.as_ptr()).unwrap();
+            assert_eq!(node.data.as_ptr(), expected.data.as_ptr());
+
+            let child = index.node(index.find_child(slot, b"child").unwrap());
+            assert_eq!(
+                child.read_property("reg\0".as_ptr()),
+                Ok(&((NODES + i) as u32).to_be_bytes()[..])
+            );
+        }
+
+        assert_eq!(index.find_path(format!("/node@{}", NODES).as_bytes()), None);
+        assert_eq!(index.find_path(b"/node@1/child/child"), None);
+        assert_eq!(index.find_path(b"/child"), None);
+        assert_eq!(index.find_path(b"/node@"), None);
+        assert_eq!(index.find_path(b"node@1"), None);
+
+        // A table that is too small is rejected.
+        let mut table = vec![FdtIndexEntry::EMPTY; 512];
+        assert!(FdtIndex::new(&fdt, &mut table).is_none());
+    }
+
+    #[test]
+    fn add_mem_reservations() {
+        let mut dtb = build_dtb(4);
+        let size = dtb.len() * 4;
+        dtb.resize(dtb.len() + 16, 0);
+        let hdr = unsafe { &mut *(dtb.as_mut_ptr() as *mut FdtHeader) };
+
+        let mut ranges = [
+            (0x9000, 0x1000),
+            (0x1000, 0x1000),
+            (0x4000, 0),
+            (0x2000, 0x800),
+            (0x2400, 0x1000),
+            (0x8000, 0x1000),
+        ];
+        assert_eq!(unsafe { hdr.add_mem_reservations(&mut ranges) }, Ok(()));
+
+        // Two merged ranges were added in front of the terminating entry.
+        let added = 2 * mem::size_of::<FdtReserveEntry>();
+        assert_eq!(hdr.total_size() as usize, size + added);
+
+        let entries = unsafe {
+            slice::from_raw_parts(
+                (hdr as *const _ as *const u8).add(u32::from_be(hdr.off_mem_rsvmap) as usize)
+                    as *const FdtReserveEntry,
+                3,
+            )
+        };
+        let entries: Vec<_> = entries
+            .iter()
+            .map(|e| (u64::from_be(e.address), u64::from_be(e.size)))
+            .collect();
+        assert_eq!(entries, [(0x1000, 0x2400), (0x8000, 0x2000), (0, 0)]);
+
+        // The rest of the FDT moved along.
+        let fdt = FdtNode::new_root(hdr).unwrap();
+        let mut table = vec![FdtIndexEntry::EMPTY; FdtIndex::table_len(&fdt)];
+        let index = FdtIndex::new(&fdt, &mut table).unwrap();
+        let node = index.node(index.find_path(b"/node@3/child").unwrap());
+        assert_eq!(
+            node.read_property("reg\0".as_ptr()),
+            Ok(&7u32.to_be_bytes()[..])
+        );
+
+        // A range past the end of the address space is rejected without touching the FDT.
+        let mut ranges = [(0x1000, 0x1000), (u64::max_value() - 0xfff, 0x2000)];
+        assert_eq!(unsafe { hdr.add_mem_reservations(&mut ranges) }, Err(()));
+        assert_eq!(hdr.total_size() as usize, size + added);
+    }
 }
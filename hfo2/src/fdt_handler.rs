@@ -28,6 +28,7 @@ use crate::mpool::*;
 use crate::page::*;
 use crate::types::*;
 
+use arrayvec::ArrayVec;
 use scopeguard::{guard, ScopeGuard};
 
 impl<'a> FdtNode<'a> {
@@ -59,17 +60,17 @@ impl<'a> FdtNode<'a> {
     pub fn find_initrd(&self) -> Option<(paddr_t, paddr_t)> {
         let mut node = self.clone();
         if node.find_child("chosen\0".as_ptr()).is_none() {
-            dlog!("Unable to find 'chosen'\n");
+            dlog_error!("Unable to find 'chosen'\n");
             return None;
         }
 
         let initrd_begin = ok_or!(node.read_number("linux,initrd-start\0".as_ptr()), {
-            dlog!("Unable to read linux,initrd-start\n");
+            dlog_error!("Unable to read linux,initrd-start\n");
             return None;
         });
 
         let initrd_end = ok_or!(node.read_number("linux,initrd-end\0".as_ptr()), {
-            dlog!("Unable to read linux,initrd-end\n");
+            dlog_error!("Unable to read linux,initrd-end\n");
             return None;
         });
 
@@ -81,13 +82,20 @@ impl<'a> FdtNode<'a> {
 
     pub fn find_cpus(&self, cpu_ids: &mut [cpu_id_t]) -> Option<usize> {
         let mut node = self.clone();
-        let mut cpu_count = 0;
 
         node.find_child("cpus\0".as_ptr()).or_else(|| {
-            dlog!("Unable to find 'cpus'\n");
+            dlog_error!("Unable to find 'cpus'\n");
             None
         })?;
 
+        node.read_cpus(cpu_ids)
+    }
+
+    /// Reads the IDs of the CPUs listed under this node, which is the "cpus" node.
+    pub fn read_cpus(&self, cpu_ids: &mut [cpu_id_t]) -> Option<usize> {
+        let mut node = self.clone();
+        let mut cpu_count = 0;
+
         let address_size = node
             .read_number("#address-cells\0".as_ptr())
             .map(|size| size as usize * mem::size_of::<u32>())
@@ -121,12 +129,12 @@ impl<'a> FdtNode<'a> {
             // Get all entries for this CPU.
             while data.len() as usize >= address_size {
                 if cpu_count >= MAX_CPUS {
-                    dlog!("Found more than {} CPUs\n", MAX_CPUS);
+                    dlog_warn!("Found more than {} CPUs\n", MAX_CPUS);
                     return None;
                 }
 
                 cpu_ids[cpu_count] = some_or!(fdt_parse_number(&data[..address_size]), {
-                    dlog!("Could not parse CPU id\n");
+                    dlog_error!("Could not parse CPU id\n");
                     return None;
                 }) as cpu_id_t;
                 cpu_count += 1;
@@ -195,7 +203,7 @@ impl<'a> FdtNode<'a> {
 
                     mem_range_index += 1;
                 } else {
-                    dlog!("Found memory range {} in FDT but only {} supported, ignoring additional range of size {}.\n", mem_range_index, MAX_MEM_RANGES, len);
+                    dlog_warn!("Found memory range {} in FDT but only {} supported, ignoring additional range of size {}.\n", mem_range_index, MAX_MEM_RANGES, len);
                 }
 
                 data = &data[entry_size..];
@@ -225,7 +233,7 @@ pub unsafe fn map(
         )
         .is_err()
     {
-        dlog!("Unable to map FDT header.\n");
+        dlog_error!("Unable to map FDT header.\n");
         return None;
     }
 
@@ -240,7 +248,7 @@ pub unsafe fn map(
     let fdt = pa_addr(fdt_addr) as *mut FdtHeader;
 
     let node = some_or!(FdtNode::new_root(&*fdt), {
-        dlog!("FDT failed validation.\n");
+        dlog_error!("FDT failed validation.\n");
         return None;
     });
 
@@ -254,7 +262,7 @@ pub unsafe fn map(
         )
         .is_err()
     {
-        dlog!("Unable to map full FDT.\n");
+        dlog_error!("Unable to map full FDT.\n");
         return None;
     }
 
@@ -292,7 +300,7 @@ pub unsafe fn patch(
         )
         .is_err()
     {
-        dlog!("Unable to map FDT header.\n");
+        dlog_error!("Unable to map FDT header.\n");
         return Err(());
     }
 
@@ -308,7 +316,7 @@ pub unsafe fn patch(
 
     let mut node = FdtNode::new_root(&*fdt)
         .or_else(|| {
-            dlog!("FDT failed validation.\n");
+            dlog_error!("FDT failed validation.\n");
             None
         })
         .ok_or(())?;
@@ -324,7 +332,7 @@ pub unsafe fn patch(
         )
         .is_err()
     {
-        dlog!("Unable to map FDT in r/w mode.\n");
+        dlog_error!("Unable to map FDT in r/w mode.\n");
         return Err(());
     }
 
@@ -337,17 +345,17 @@ pub unsafe fn patch(
             )
             .is_err()
         {
-            dlog!("Unable to unmap writable FDT.\n");
+            dlog_error!("Unable to unmap writable FDT.\n");
         }
     });
 
     if node.find_child("\0".as_ptr()).is_none() {
-        dlog!("Unable to find FDT root node.\n");
+        dlog_error!("Unable to find FDT root node.\n");
         return Err(());
     }
 
     if node.find_child("chosen\0".as_ptr()).is_none() {
-        dlog!("Unable to find 'chosen'\n");
+        dlog_error!("Unable to find 'chosen'\n");
         return Err(());
     }
 
@@ -359,7 +367,7 @@ pub unsafe fn patch(
         )
         .is_err()
     {
-        dlog!("Unable to write linux,initrd-start\n");
+        dlog_error!("Unable to write linux,initrd-start\n");
         return Err(());
     }
 
@@ -367,31 +375,31 @@ pub unsafe fn patch(
         .write_number("linux,initrd-end\0".as_ptr(), pa_addr(p.initrd_end) as u64)
         .is_err()
     {
-        dlog!("Unable to write linux,initrd-end\n");
+        dlog_error!("Unable to write linux,initrd-end\n");
         return Err(());
     }
 
     // Patch FDT to reserve hypervisor memory so the primary VM doesn't try to
-    // use it.
-    (*fdt).add_mem_reservation(
-        pa_addr(layout_text_begin()) as u64,
-        pa_difference(layout_text_begin(), layout_text_end()) as u64,
-    );
-    (*fdt).add_mem_reservation(
-        pa_addr(layout_rodata_begin()) as u64,
-        pa_difference(layout_rodata_begin(), layout_rodata_end()) as u64,
-    );
-    (*fdt).add_mem_reservation(
-        pa_addr(layout_data_begin()) as u64,
-        pa_difference(layout_data_begin(), layout_data_end()) as u64,
-    );
+    // use it, and memory for secondary VMs, all at once.
+    let mut reservations: ArrayVec<[(u64, u64); MAX_MEM_RANGES + 3]> = ArrayVec::new();
+    for (begin, end) in &[
+        (layout_text_begin(), layout_text_end()),
+        (layout_rodata_begin(), layout_rodata_end()),
+        (layout_data_begin(), layout_data_end()),
+    ] {
+        reservations.push((pa_addr(*begin) as u64, pa_difference(*begin, *end) as u64));
+    }
 
-    // Patch FDT to reserve memory for secondary VMs.
-    for i in 0..p.reserved_ranges_count {
-        (*fdt).add_mem_reservation(
-            pa_addr(p.reserved_ranges[i].begin) as u64,
-            pa_addr(p.reserved_ranges[i].end) as u64 - pa_addr(p.reserved_ranges[i].begin) as u64,
-        );
+    for range in &p.reserved_ranges[..p.reserved_ranges_count] {
+        reservations.push((
+            pa_addr(range.begin) as u64,
+            pa_difference(range.begin, range.end) as u64,
+        ));
+    }
+
+    if (*fdt).add_mem_reservations(&mut reservations).is_err() {
+        dlog_error!("Invalid memory reservation.\n");
+        return Err(());
     }
 
     let stage1_ptable = ScopeGuard::into_inner(stage1_ptable);
@@ -403,7 +411,7 @@ pub unsafe fn patch(
         )
         .is_err()
     {
-        dlog!("Unable to unmap writable FDT.\n");
+        dlog_error!("Unable to unmap writable FDT.\n");
         return Err(());
     }
 
@@ -19,17 +19,23 @@ use core::ops::Deref;
 use core::ptr;
 use core::sync::atomic::Ordering;
 
+use arrayvec::ArrayVec;
+
 use crate::abi::*;
 use crate::addr::*;
 use crate::arch::*;
+use crate::boot_time::*;
 use crate::cpu::*;
+use crate::load::*;
 use crate::mm::*;
 use crate::mpool::*;
 use crate::page::*;
+use crate::run_state::*;
 use crate::spci::*;
 use crate::spci_architected_message::*;
 use crate::spinlock::*;
 use crate::std::*;
+use crate::steal_time::*;
 use crate::types::*;
 use crate::utils::*;
 use crate::vm::*;
@@ -39,6 +45,10 @@ pub struct Hypervisor {
     pub memory_manager: MemoryManager,
     pub cpu_manager: CpuManager,
     pub vm_manager: VmManager,
+    pub vcpu_run_states: VCpuRunStates,
+
+    /// The time spent on each phase of boot. It is only written at the end of boot.
+    pub boot_times: BootTimes,
 }
 
 impl Hypervisor {
@@ -54,6 +64,8 @@ impl Hypervisor {
             memory_manager,
             cpu_manager,
             vm_manager,
+            vcpu_run_states: VCpuRunStates::new(),
+            boot_times: BootTimes::new(),
         }
     }
 
@@ -70,15 +82,34 @@ impl Hypervisor {
         let primary = self.vm_manager.get_primary();
         let next = &primary.vcpus[self.cpu_manager.index_of(current.get_inner().cpu)];
 
-        // If the secondary is blocked but has a timer running, sleep until the timer fires rather
-        // than indefinitely.
+        // If the secondary is blocked but has a timer running or a receive timeout, sleep until
+        // the earlier of them rather than indefinitely. The deadline is also tracked on this CPU,
+        // so the hypervisor timer tells the primary when it expires.
+        let mut deadline = None;
         match &mut primary_ret {
             HfVCpuRunReturn::WaitForInterrupt { ns } | HfVCpuRunReturn::WaitForMessage { ns } => {
                 // TODO(HfO2): a module for arch_timer?
-                *ns = if unsafe { arch_timer_enabled_current() } {
-                    unsafe { arch_timer_remaining_ns_current() }
+                let timer_deadline = if unsafe { arch_timer_enabled_current() } {
+                    Some(unsafe { arch_timer_deadline_current() })
                 } else {
-                    HF_SLEEP_INDEFINITE
+                    None
+                };
+                deadline = timer_deadline
+                    .into_iter()
+                    .chain(current.get_inner().recv_deadline)
+                    .min();
+
+                *ns = match deadline {
+                    Some(deadline) => {
+                        let cpu = unsafe { &*current.get_inner().cpu };
+                        cpu.timer_wheel
+                            .lock()
+                            .insert(current.vm().id, current.index(), deadline);
+
+                        let now = unsafe { arch_timer_count() };
+                        unsafe { arch_timer_ticks_to_ns(deadline.saturating_sub(now)) }
+                    }
+                    None => HF_SLEEP_INDEFINITE,
                 };
             }
             _ => {}
@@ -95,9 +126,32 @@ impl Hypervisor {
             .regs
             .set_retval(primary_ret.into_raw());
 
+        trace!(
+            SwitchToPrimary,
+            current.vm().id,
+            current.index(),
+            primary_ret.into_raw()
+        );
+
         // Mark the current vcpu as waiting.
+        current.account_running_time();
         current.get_inner_mut().state = secondary_state;
 
+        // A blocked vCPU can run again once its deadline passes, or once it is woken up, which
+        // may already have happened.
+        if let VCpuStatus::BlockedInterrupt | VCpuStatus::BlockedMailbox = secondary_state {
+            current.set_blocked_until(deadline);
+            if current.interrupts.lock().is_interrupted() {
+                current.mark_runnable(unsafe { arch_timer_count() });
+            }
+        }
+
+        // Let the primary's scheduler see the new state without another hypercall.
+        if let Some(run_state) = self.vcpu_run_states.get(current.vm().id, current.index()) {
+            run_state.set_state(secondary_state);
+            run_state.set_timer_deadline(deadline);
+        }
+
         next
     }
 
@@ -144,6 +198,50 @@ impl Hypervisor {
         Some(self.switch_to_primary(current, HfVCpuRunReturn::Yield, VCpuStatus::Ready))
     }
 
+    /// Returns to the primary VM to allow this CPU to be used by the given target vCPU, which the
+    /// current vCPU is waiting on (e.g. it spins on a lock held by the preempted target). The
+    /// target is reported to the primary's scheduler, and the current vCPU is marked as ready to
+    /// be scheduled again.
+    ///
+    /// Returns:
+    ///  - -1 on failure because the target VM or vCPU doesn't exist or is the calling vCPU.
+    ///  - 0  on success.
+    pub fn vcpu_yield_to(
+        &self,
+        target_vm_id: spci_vm_id_t,
+        target_vcpu_idx: spci_vcpu_index_t,
+        current: &mut VCpuExecutionLocked,
+    ) -> (i64, Option<&VCpu>) {
+        let target_vm = some_or!(self.vm_manager.get(target_vm_id), return (-1, None));
+        let target_vcpu = some_or!(
+            target_vm.vcpus.get(target_vcpu_idx as usize),
+            return (-1, None)
+        );
+
+        // Disallow reflexive yields as this suggests an error in the VM.
+        if current.deref().deref() as *const _ == target_vcpu as *const _ {
+            return (-1, None);
+        }
+
+        if current.vm().id == HF_PRIMARY_VM_ID {
+            // Noop on the primary as it makes the scheduling decisions.
+            return (0, None);
+        }
+
+        // There is no scheduler in the hypervisor, so the switch to the target is left to the
+        // primary VM.
+        let next = self.switch_to_primary(
+            current,
+            HfVCpuRunReturn::DirectedYield {
+                vm_id: target_vm_id,
+                vcpu: target_vcpu_idx,
+            },
+            VCpuStatus::Ready,
+        );
+
+        (0, Some(next))
+    }
+
     /// Switches to the primary so that it can switch to the target, or kick tit if it is already
     /// running on a different physical CPU.
     pub fn wake_up(&self, current: &mut VCpuExecutionLocked, target_vcpu: &VCpu) -> &VCpu {
@@ -159,9 +257,9 @@ impl Hypervisor {
 
     /// Aborts the vCPU and triggers its VM to abort fully.
     pub fn abort(&self, current: &mut VCpuExecutionLocked) -> &VCpu {
-        let vm = current.vm();
+        let vm = unsafe { &*(current.vm() as *const Vm) };
 
-        dlog!("Aborting VM {} vCPU {}\n", vm.id, current.index(),);
+        dlog_warn!("Aborting VM {} vCPU {}\n", vm.id, current.index(),);
 
         if vm.id == HF_PRIMARY_VM_ID {
             // TODO: what to do when the primary aborts?
@@ -170,9 +268,341 @@ impl Hypervisor {
 
         vm.aborting.store(true, Ordering::Relaxed);
 
-        // TODO: free resources once all vCPUs abort.
+        let next = self.switch_to_primary(current, HfVCpuRunReturn::Aborted, VCpuStatus::Aborted);
+
+        // Also abort the VM's other vCPUs which aren't running. Those which are get aborted when
+        // the primary VM next tries to run them.
+        let current_vcpu: &VCpu = current;
+        let mut aborted = 1;
+        for vcpu in vm
+            .vcpus
+            .iter()
+            .filter(|vcpu| *vcpu as *const _ != current_vcpu as *const _)
+        {
+            if let Ok(mut vcpu_inner) = vcpu.inner.try_lock() {
+                aborted += self.vcpu_mark_aborted(vcpu, &mut vcpu_inner) as usize;
+            }
+        }
+        self.vcpus_aborted(vm, aborted, current_vcpu);
+
+        next
+    }
+
+    /// Handles a stage-2 fault the vCPU couldn't recover from. If its VM is demand-paged and the
+    /// faulting page is in the VM's memory ranges but isn't owned by the VM, the fault is reported
+    /// to the primary VM to supply the page with `vm_page_supply`. The faulting instruction is
+    /// retried when the vCPU is next run. Otherwise, the VM is aborted.
+    pub fn page_fault(
+        &self,
+        current: &mut VCpuExecutionLocked,
+        ipa: ipaddr_t,
+        mode: Mode,
+    ) -> &VCpu {
+        let vm = unsafe { &*(current.vm() as *const Vm) };
+        let page = ipa_init(round_down(ipa_addr(ipa), PAGE_SIZE));
+
+        let missing = vm.demand_paged
+            && vm.mem_ranges_contain(page)
+            && vm
+                .inner
+                .lock()
+                .ptable
+                .get_mode(page, ipa_add(page, PAGE_SIZE))
+                .map(|mode| mode.contains(Mode::INVALID | Mode::UNOWNED))
+                .unwrap_or(false);
+        if !missing {
+            return self.abort(current);
+        }
+
+        let access = if mode.contains(Mode::W) {
+            HfPageFaultAccess::Write
+        } else if mode.contains(Mode::X) {
+            HfPageFaultAccess::Execute
+        } else {
+            HfPageFaultAccess::Read
+        };
+
+        self.switch_to_primary(
+            current,
+            HfVCpuRunReturn::PageFault {
+                ipa: ipa_addr(page) as u64,
+                access,
+            },
+            VCpuStatus::Ready,
+        )
+    }
 
-        self.switch_to_primary(current, HfVCpuRunReturn::Aborted, VCpuStatus::Aborted)
+    /// Marks the given vCPU of an aborting VM as aborted, if it isn't already. Returns whether it
+    /// wasn't. `vcpu_inner` must be the vCPU's execution-locked inner state.
+    fn vcpu_mark_aborted(&self, vcpu: &VCpu, vcpu_inner: &mut VCpuInner) -> bool {
+        if vcpu_inner.state == VCpuStatus::Aborted {
+            return false;
+        }
+
+        dlog_warn!("Aborting VM {} vCPU {}\n", vcpu.vm().id, vcpu.index());
+        vcpu_inner.state = VCpuStatus::Aborted;
+        if let Some(run_state) = self.vcpu_run_states.get(vcpu.vm().id, vcpu.index()) {
+            run_state.set_state(VCpuStatus::Aborted);
+        }
+
+        true
+    }
+
+    /// Records that the given number of the VM's vCPUs were marked as aborted. Once all of them
+    /// are, none of them can run again, so the VM's resources are reclaimed.
+    fn vcpus_aborted(&self, vm: &Vm, count: usize, current: &VCpu) {
+        if vm.aborted_vcpus.fetch_add(count, Ordering::AcqRel) + count == vm.vcpus.len() {
+            self.vm_reclaim(vm, current);
+        }
+    }
+
+    /// Reclaims the resources of the given VM, all of whose vCPUs have aborted:
+    ///  - the memory it was lent or shared is returned to its owners;
+    ///  - the memory it lent or shared is taken back, and, with the rest of the memory it owns,
+    ///    cleared and returned to the primary VM;
+    ///  - its stage-2 page table is emptied, freeing the sub-tables;
+    ///  - its mailbox is unconfigured, and the VMs waiting for it to become writable are woken up
+    ///    for them to find that sending to the VM fails.
+    fn vm_reclaim(&self, vm: &Vm, current: &VCpu) {
+        dlog_info!("Reclaiming the resources of VM {}\n", vm.id);
+
+        for other in self.vm_manager.iter().filter(|other| other.id != vm.id) {
+            let (mut vm_inner, mut other_inner) = SpinLock::lock_both(&vm.inner, &other.inner);
+            vm_inner.ptable.for_each_block(|begin, end, mode| {
+                self.unshare_memory(begin, end, mode, &mut other_inner.ptable);
+            });
+            vm_inner.cancel_wait(other.id);
+        }
+
+        let primary = self.vm_manager.get_primary();
+        let (mut vm_inner, mut primary_inner) = SpinLock::lock_both(&vm.inner, &primary.inner);
+
+        // The pages the hypervisor mapped for the VM go back to it, to be returned with the rest.
+        let hypervisor_ptable = &self.memory_manager.hypervisor_ptable;
+        vm_inner.unconfigure(hypervisor_ptable, &self.mpool);
+        if let Some(page) = vm.take_steal_time() {
+            vm_inner.unmap_published_page(page, hypervisor_ptable, &self.mpool);
+        }
+
+        vm_inner.ptable.for_each_block(|begin, end, mode| {
+            if mode.contains(Mode::UNOWNED) {
+                return;
+            }
+
+            let (begin, end) = (pa_init(begin), pa_init(end));
+            if self.clear_memory(begin, end, &self.mpool).is_err()
+                || primary_inner
+                    .ptable
+                    .identity_map(begin, end, Mode::R | Mode::W | Mode::X, &self.mpool)
+                    .is_err()
+            {
+                dlog_warn!(
+                    "Failed to return memory {:#x}-{:#x} of VM {} to the primary VM\n",
+                    pa_addr(begin),
+                    pa_addr(end),
+                    vm.id
+                );
+            }
+        });
+        drop(primary_inner);
+
+        vm_inner.ptable.clear(&self.mpool);
+        vm_inner.dirty_log = false;
+        vm_inner.balloon_request = 0;
+
+        // The waiting VMs are only locked once the VM is unlocked, as in `mailbox_waiter_get`, so
+        // that no two VMs are locked in an arbitrary order. There is at most one entry per VM.
+        let mut waiters: ArrayVec<[*mut WaitEntry; MAX_VMS]> = ArrayVec::new();
+        while let Some(entry) = unsafe { vm_inner.take_waiter().as_mut() } {
+            waiters.push(entry);
+        }
+        drop(vm_inner);
+
+        for entry in waiters {
+            let entry = unsafe { &mut *entry };
+            let waiting_vm = unsafe { &*entry.waiting_vm };
+
+            let mut waiting_vm_inner = waiting_vm.inner.lock();
+            if !entry.is_in_ready_list() {
+                waiting_vm_inner.enqueue_ready_list(entry);
+            }
+            drop(waiting_vm_inner);
+
+            // The primary VM finds the VM in its ready list when the abort is reported to it.
+            if waiting_vm.id == HF_PRIMARY_VM_ID {
+                continue;
+            }
+
+            let waiting_vcpu = &waiting_vm.vcpus[0];
+            if waiting_vcpu
+                .interrupts
+                .lock()
+                .inject(HF_MAILBOX_WRITABLE_INTID)
+                .is_ok()
+            {
+                self.publish_interrupt_pending(waiting_vcpu, current);
+            }
+        }
+    }
+
+    /// Resets the given secondary VM to its state at boot. Its vCPUs are aborted, reclaiming its
+    /// resources, then its memory is taken back from the primary VM, its image is loaded into it
+    /// again and its first vCPU is started. Only primary VMs are allowed to call this, and only for
+    /// VMs whose image was kept at boot.
+    ///
+    /// Fails if one of the VM's vCPUs is running, as it can't be stopped. The VM is aborted, so
+    /// it can be reset once the vCPU stops running.
+    pub fn vm_reset(&self, vm_id: spci_vm_id_t, current: &VCpu) -> Result<(), ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID || vm_id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let vm = self.vm_manager.get(vm_id).ok_or(())?;
+        let image = vm.image.as_ref().ok_or(())?;
+
+        // A VM which hasn't been loaded yet is already as it was at boot.
+        if vm.load_pending.load(Ordering::Acquire) {
+            return Ok(());
+        }
+
+        // Stop the VM's vCPUs, keeping them locked so that none of them is run until the VM is
+        // reset.
+        vm.aborting.store(true, Ordering::Relaxed);
+        let mut vcpu_inners: ArrayVec<[_; MAX_CPUS]> = ArrayVec::new();
+        for vcpu in vm.vcpus.iter() {
+            vcpu_inners.push(vcpu.inner.try_lock().map_err(|_| ())?);
+        }
+
+        let mut aborted = 0;
+        for (vcpu, vcpu_inner) in vm.vcpus.iter().zip(vcpu_inners.iter_mut()) {
+            aborted += self.vcpu_mark_aborted(vcpu, vcpu_inner) as usize;
+        }
+        if aborted != 0 {
+            self.vcpus_aborted(vm, aborted, current);
+        }
+
+        // The VM's memory was returned to the primary VM when it was reclaimed, so take it back.
+        let primary = self.vm_manager.get_primary();
+        let (mut vm_inner, mut primary_inner) = SpinLock::lock_both(&vm.inner, &primary.inner);
+        for mem_range in vm.mem_ranges.iter() {
+            let mode = primary_inner
+                .ptable
+                .get_mode(ipa_from_pa(mem_range.begin), ipa_from_pa(mem_range.end))?;
+            if !mode.valid_owned_exclusive() {
+                return Err(());
+            }
+        }
+
+        for (i, mem_range) in vm.mem_ranges.iter().enumerate() {
+            if primary_inner
+                .ptable
+                .unmap(mem_range.begin, mem_range.end, &self.mpool)
+                .is_err()
+            {
+                for mem_range in vm.mem_ranges[..i].iter() {
+                    primary_inner
+                        .ptable
+                        .identity_map(
+                            mem_range.begin,
+                            mem_range.end,
+                            Mode::R | Mode::W | Mode::X,
+                            &self.mpool,
+                        )
+                        .unwrap();
+                }
+                return Err(());
+            }
+        }
+
+        vm_inner.deferred_load = Some(DeferredLoad::new(image.clone()));
+        drop(primary_inner);
+        drop(vm_inner);
+
+        for (vcpu, vcpu_inner) in vm.vcpus.iter().zip(vcpu_inners.iter_mut()) {
+            self.vcpu_reset(vcpu, vcpu_inner);
+        }
+
+        // The VM stops aborting before its vCPUs are unlocked, so they aren't aborted again.
+        vm.aborted_vcpus.store(0, Ordering::Relaxed);
+        vm.aborting.store(false, Ordering::Relaxed);
+        drop(vcpu_inners);
+
+        dlog_info!("Reset VM {}\n", vm.id);
+        vm.load_pending.store(true, Ordering::Release);
+        unsafe { load_deferred(vm, &self.memory_manager.hypervisor_ptable, &self.mpool) };
+
+        Ok(())
+    }
+
+    /// Turns off the given vCPU of a VM which is being reset, forgetting its pending interrupts
+    /// and deadlines. `vcpu_inner` must be the vCPU's execution-locked inner state.
+    fn vcpu_reset(&self, vcpu: &VCpu, vcpu_inner: &mut VCpuInner) {
+        let vm_id = vcpu.vm().id;
+
+        vcpu_inner.state = VCpuStatus::Off;
+        vcpu_inner.recv_deadline = None;
+        if let Some(cpu) = unsafe { vcpu_inner.cpu.as_ref() } {
+            cpu.timer_wheel.lock().remove(vm_id, vcpu.index());
+        }
+        *vcpu.interrupts.lock() = Interrupts::new();
+
+        if let Some(run_state) = self.vcpu_run_states.get(vm_id, vcpu.index()) {
+            run_state.set_state(VCpuStatus::Off);
+            run_state.set_interrupt_pending(false);
+            run_state.set_timer_deadline(None);
+        }
+    }
+
+    /// Ends the sharing of the given range of an aborted VM's memory, which the VM maps with the
+    /// given mode, with the VM owning the given page table. Memory the other VM lent or shared to
+    /// the aborted VM is returned to it, and memory the aborted VM lent or shared to the other VM
+    /// is unmapped from it.
+    fn unshare_memory(
+        &self,
+        begin: usize,
+        end: usize,
+        mode: Mode,
+        other_ptable: &mut PageTable<Stage2>,
+    ) {
+        let other_mode = match other_ptable.get_mode(ipa_init(begin), ipa_init(end)) {
+            Ok(other_mode) => other_mode,
+            Err(_) => {
+                // The other VM maps parts of the range differently, so look at them separately.
+                if end - begin > PAGE_SIZE {
+                    let mid = begin + round_down((end - begin) / 2, PAGE_SIZE);
+                    self.unshare_memory(begin, mid, mode, other_ptable);
+                    self.unshare_memory(mid, end, mode, other_ptable);
+                }
+                return;
+            }
+        };
+
+        let lent_to_vm = !mode.contains(Mode::INVALID)
+            && mode.contains(Mode::UNOWNED)
+            && !other_mode.contains(Mode::UNOWNED)
+            && other_mode.intersects(Mode::INVALID | Mode::SHARED);
+        let lent_by_vm = !mode.contains(Mode::UNOWNED)
+            && mode.intersects(Mode::INVALID | Mode::SHARED)
+            && other_mode.contains(Mode::UNOWNED)
+            && !other_mode.contains(Mode::INVALID);
+
+        let (pa_begin, pa_end) = (pa_init(begin), pa_init(end));
+        let result = if lent_to_vm {
+            other_ptable.identity_map(pa_begin, pa_end, Mode::R | Mode::W | Mode::X, &self.mpool)
+        } else if lent_by_vm {
+            other_ptable.unmap(pa_begin, pa_end, &self.mpool)
+        } else {
+            Ok(())
+        };
+
+        if result.is_err() {
+            dlog_warn!(
+                "Failed to unshare memory {:#x}-{:#x} of an aborted VM\n",
+                begin,
+                end
+            );
+        }
     }
 
     /// Returns the ID of the VM.
@@ -214,6 +644,14 @@ impl Hypervisor {
         current: &mut VCpuExecutionLocked,
     ) -> (i64, Option<&VCpu>) {
         if target_vcpu.interrupts.lock().inject(intid).is_ok() {
+            trace!(
+                InterruptInject,
+                target_vcpu.vm().id,
+                target_vcpu.index(),
+                intid
+            );
+            self.publish_interrupt_pending(target_vcpu, current.deref().deref());
+
             if current.vm().id == HF_PRIMARY_VM_ID {
                 // If the call came from the primary VM, let it know that it should run or kick the
                 // target vCPU.
@@ -255,9 +693,8 @@ impl Hypervisor {
         let vm = vcpu.vm();
 
         if vm.aborting.load(Ordering::Relaxed) {
-            if vcpu_inner.state != VCpuStatus::Aborted {
-                dlog!("Aborting VM {} vCPU {}\n", vm.id, vcpu.index());
-                vcpu_inner.state = VCpuStatus::Aborted;
+            if self.vcpu_mark_aborted(vcpu, &mut vcpu_inner) {
+                self.vcpus_aborted(vm, 1, current);
             }
             return Err(run_ret);
         }
@@ -274,6 +711,19 @@ impl Hypervisor {
             // run case meaning the sensitive context switch performance is consistent.
             VCpuStatus::BlockedMailbox if vm.inner.lock().try_read().is_ok() => {
                 vcpu_inner.regs.set_retval(SpciReturn::Success as uintreg_t);
+
+                // The vCPU has been able to run since the message arrived. The mailbox can't
+                // receive another message until the vCPU clears it.
+                vcpu.mark_runnable(vm.inner.lock().received_at());
+            }
+
+            // The receive timed out without a message, so let the vCPU know.
+            VCpuStatus::BlockedMailbox
+                if vcpu_inner
+                    .recv_deadline
+                    .map_or(false, |deadline| deadline <= unsafe { arch_timer_count() }) =>
+            {
+                vcpu_inner.regs.set_retval(SpciReturn::Timeout as uintreg_t);
             }
 
             // Allow virtual interrupts to be delivered.
@@ -283,15 +733,21 @@ impl Hypervisor {
             VCpuStatus::BlockedMailbox | VCpuStatus::BlockedInterrupt
                 if !vcpu.interrupts.lock().is_interrupted() && !vcpu_inner.regs.timer_pending() =>
             {
-                let run_ret = if !vcpu_inner.regs.timer_enabled() {
-                    run_ret
+                let timer_ns = if vcpu_inner.regs.timer_enabled() {
+                    Some(vcpu_inner.regs.timer_remaining_ns())
                 } else {
-                    let ns = vcpu_inner.regs.timer_remaining_ns();
-                    if vcpu_inner.state == VCpuStatus::BlockedMailbox {
+                    None
+                };
+                let recv_ns = vcpu_inner.recv_deadline.map(|deadline| unsafe {
+                    arch_timer_ticks_to_ns(deadline.saturating_sub(arch_timer_count()))
+                });
+
+                let run_ret = match timer_ns.into_iter().chain(recv_ns).min() {
+                    None => run_ret,
+                    Some(ns) if vcpu_inner.state == VCpuStatus::BlockedMailbox => {
                         HfVCpuRunReturn::WaitForMessage { ns }
-                    } else {
-                        HfVCpuRunReturn::WaitForInterrupt { ns }
                     }
+                    Some(ns) => HfVCpuRunReturn::WaitForInterrupt { ns },
                 };
                 return Err(run_ret);
             }
@@ -301,8 +757,21 @@ impl Hypervisor {
             }
         }
 
-        // It has been decided that the vCPU should be run.
+        // It has been decided that the vCPU should be run, so its deadline no longer needs to be
+        // tracked on the CPU it blocked on.
+        if let Some(cpu) = unsafe { vcpu_inner.cpu.as_ref() } {
+            cpu.timer_wheel.lock().remove(vm.id, vcpu.index());
+        }
+
+        vcpu.account_time(&mut vcpu_inner, false);
         vcpu_inner.cpu = current.get_inner().cpu;
+        vcpu_inner.recv_deadline = None;
+
+        if let Some(run_state) = self.vcpu_run_states.get(vm.id, vcpu.index()) {
+            run_state.set_state(VCpuStatus::Ready);
+            run_state.set_needs_wake(false);
+            run_state.set_timer_deadline(None);
+        }
 
         // We want to keep the lock of vcpu.state because we're going to run.
         //
@@ -340,6 +809,11 @@ impl Hypervisor {
         // The requested vcpu must exist.
         let vcpu = some_or!(vm.vcpus.get(vcpu_idx as usize), return Err(ret));
 
+        // Load the VM if its loading was deferred until it first runs.
+        if vm.load_pending.load(Ordering::Acquire) {
+            unsafe { load_deferred(vm, &self.memory_manager.hypervisor_ptable, &self.mpool) };
+        }
+
         // Update state if allowed.
         let mut vcpu_locked = self.vcpu_prepare_run(current, vcpu, ret)?;
 
@@ -357,6 +831,8 @@ impl Hypervisor {
             vcpu_locked.get_inner_mut().regs.timer_mask();
         }
 
+        trace!(VCpuRun, vm_id, vcpu_idx);
+
         // Switch to the vcpu.
         Ok(vcpu_locked)
     }
@@ -426,6 +902,78 @@ impl Hypervisor {
         self.waiter_result(vm.id, &vm_inner, current)
     }
 
+    /// Configures the page the hypervisor publishes the run state of every vCPU to, so the
+    /// primary's scheduler can read it instead of probing each vCPU with HF_VCPU_RUN. Only primary
+    /// VMs are allowed to call this, and only once. The page must not be shared, and becomes
+    /// read-only to the primary VM. It should be configured before any secondary vCPU is run.
+    pub fn vcpu_state_configure(&self, page: ipaddr_t, current: &VCpu) -> Result<(), ()> {
+        let vm = current.vm();
+
+        // Only primary VMs are allowed to call this function.
+        if vm.id != HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        // The primary VM's lock serialises concurrent attempts to configure the page.
+        let mut vm_inner = vm.inner.lock();
+        if self.vcpu_run_states.is_configured() {
+            return Err(());
+        }
+
+        let page = vm_inner.map_published_page(
+            page,
+            &self.memory_manager.hypervisor_ptable,
+            &self.mpool,
+        )?;
+        self.vcpu_run_states.configure(page);
+        drop(vm_inner);
+
+        // Publish the current state of each secondary vCPU. States are only published with the
+        // vCPU locked, so holding its lock orders this with any other publication; a vCPU running
+        // on another CPU is waited for until it switches back to the primary VM.
+        for vm in self
+            .vm_manager
+            .iter()
+            .filter(|vm| vm.id != HF_PRIMARY_VM_ID)
+        {
+            for vcpu in vm.vcpus.iter() {
+                let run_state = some_or!(self.vcpu_run_states.get(vm.id, vcpu.index()), continue);
+                let vcpu_inner = vcpu.inner.lock();
+                run_state.set_state(vcpu_inner.state);
+                run_state.set_interrupt_pending(vcpu.interrupts.lock().is_interrupted());
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Configures the page the hypervisor publishes the times of the calling VM's vCPUs to,
+    /// including the time they were ready to run but not run by the primary VM's scheduler. Only
+    /// secondary VMs are allowed to call this, and only once. The page must not be shared, and
+    /// becomes read-only to the VM.
+    pub fn steal_time_configure(&self, page: ipaddr_t, current: &VCpu) -> Result<(), ()> {
+        let vm = current.vm();
+
+        // The primary VM's vCPUs are not accounted.
+        if vm.id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let mut vm_inner = vm.inner.lock();
+        if vm.get_steal_time().is_some() {
+            return Err(());
+        }
+
+        let page = vm_inner.map_published_page(
+            page,
+            &self.memory_manager.hypervisor_ptable,
+            &self.mpool,
+        )?;
+        vm.set_steal_time(page);
+
+        Ok(())
+    }
+
     /// Copies data from the sender's send buffer to the recipient's receive buffer and notifies
     /// the recipient.
     ///
@@ -482,6 +1030,11 @@ impl Hypervisor {
         // scenario.
         let (mut to_inner, mut from_inner) = SpinLock::lock_both(&to.inner, &from.inner);
 
+        // Fail if the target has aborted, rather than waiting for its mailbox.
+        if to.aborting.load(Ordering::Relaxed) {
+            return (SpciReturn::InvalidParameters, None);
+        }
+
         if !to_inner.is_empty() || !to_inner.is_configured() {
             // Fail if the target isn't currently ready to receive data, setting up for
             // notification if requested.
@@ -549,8 +1102,23 @@ impl Hypervisor {
             if ret != SpciReturn::Success {
                 return (ret, None);
             }
+
+            // Pages donated to the primary VM are taken off its request for them.
+            if to.id == HF_PRIMARY_VM_ID
+                && architected_message_replica.r#type == SpciMemoryShare::Donate
+            {
+                #[allow(clippy::cast_ptr_alignment)]
+                let memory_region = unsafe {
+                    &*(architected_message_replica.payload.as_ptr() as *const SpciMemoryRegion)
+                };
+                from_inner.balloon_request = from_inner
+                    .balloon_request
+                    .saturating_sub(unsafe { memory_region.page_count() });
+            }
         }
 
+        trace!(SpciMsgSend, from.id, to.id, from_msg_payload_length);
+
         let primary_ret = HfVCpuRunReturn::Message { vm_id: to.id };
 
         // Messages for the primary VM are delivered directly.
@@ -562,6 +1130,15 @@ impl Hypervisor {
 
         to_inner.set_received();
 
+        // Let the primary's scheduler know which vCPUs are now able to receive the message.
+        for vcpu in to.vcpus.iter() {
+            if let Some(run_state) = self.vcpu_run_states.get(to.id, vcpu.index()) {
+                if run_state.get_state() == VCpuStatus::BlockedMailbox as u8 {
+                    run_state.set_needs_wake(true);
+                }
+            }
+        }
+
         // Return to the primary VM directly or with a switch.
         let next = if from.id != HF_PRIMARY_VM_ID {
             Some(self.switch_to_primary(current, primary_ret, VCpuStatus::Ready))
@@ -573,17 +1150,21 @@ impl Hypervisor {
     }
 
     /// Receives a message from the mailbox. If one isn't available, this function can optionally
-    /// block the caller until one becomes available.
+    /// block the caller until one becomes available, or until `timeout_ns` nanoseconds have passed
+    /// if it is not 0.
     ///
     /// No new messages can be received until the mailbox has been cleared.
     pub fn spci_msg_recv(
         &self,
         attributes: SpciMsgRecvAttributes,
+        timeout_ns: u64,
         current: &mut VCpuExecutionLocked,
     ) -> (SpciReturn, Option<&VCpu>) {
         let vm = unsafe { &*(current.vm() as *const Vm) };
         let block = attributes.contains(SpciMsgRecvAttributes::BLOCK);
 
+        trace!(SpciMsgRecv, vm.id, current.index(), block);
+
         // The primary VM will receive messages as a status code from running vcpus and must not
         // call this function.
         if vm.id == HF_PRIMARY_VM_ID {
@@ -602,12 +1183,19 @@ impl Hypervisor {
             return (SpciReturn::Retry, None);
         }
 
-        // From this point onward this call can only be interrupted or a message received. If a
-        // message is received the return value will be set at that time to SPCI_SUCCESS.
+        // From this point onward this call can only be interrupted, time out or a message
+        // received. If a message is received or it times out the return value will be set at that
+        // time to SPCI_SUCCESS or SPCI_TIMEOUT.
         //
         // Block only if there are enabled and pending interrupts, to match behaviour of
         // wait_for_interrupt.
         let next = if !current.interrupts.lock().is_interrupted() {
+            if timeout_ns != 0 {
+                let now = unsafe { arch_timer_count() };
+                current.get_inner_mut().recv_deadline =
+                    Some(now.saturating_add(unsafe { arch_timer_ns_to_ticks(timeout_ns) }));
+            }
+
             // Switch back to primary vm to block.
             Some(self.switch_to_primary(
                 current,
@@ -623,6 +1211,28 @@ impl Hypervisor {
         (SpciReturn::Interrupted, next)
     }
 
+    /// Returns the time, in virtual counter ticks, the given vCPU has spent on the given activity.
+    /// Only primary VMs are allowed to call this. The time is accounted when the vCPU is switched
+    /// to or from, so the current stint of a running vCPU is not included.
+    pub fn vcpu_time_get(
+        &self,
+        vm_id: spci_vm_id_t,
+        vcpu_idx: spci_vcpu_index_t,
+        time: u32,
+        current: &VCpu,
+    ) -> Option<u64> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID {
+            return None;
+        }
+
+        let vm = self.vm_manager.get(vm_id)?;
+        let vcpu = vm.vcpus.get(vcpu_idx as usize)?;
+        let time = VCpuTime::from_raw(time)?;
+
+        Some(vcpu.times.get(time))
+    }
+
     /// Retrieves the next VM whose mailbox became writable. For a VM to be notified by this
     /// function, the caller must have called api_mailbox_send before with the notify argument set
     /// to true, and this call must have failed because the mailbox was not available.
@@ -657,6 +1267,29 @@ impl Hypervisor {
         Some(waiting_vm.id)
     }
 
+    /// Retrieves the next VM with vCPUs whose virtual timer has expired while they were blocked on
+    /// the calling physical CPU, and stops tracking them. Only primary VMs are allowed to call
+    /// this.
+    ///
+    /// The hypervisor timer is re-armed for the next deadline of the vCPUs still tracked, which
+    /// may already have passed if more have expired.
+    pub fn timer_expired_get(&self, current: &VCpuExecutionLocked) -> Option<(spci_vm_id_t, u32)> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID {
+            return None;
+        }
+
+        let cpu = unsafe { &*current.get_inner().cpu };
+        let mut timer_wheel = cpu.timer_wheel.lock();
+
+        let expired = timer_wheel.fetch_expired(unsafe { arch_timer_count() });
+        unsafe {
+            arch_timer_hyp_set_deadline(timer_wheel.next_deadline().unwrap_or(core::u64::MAX));
+        }
+
+        expired
+    }
+
     /// Clears the caller's mailbox so that a new message can be received. The caller must have
     /// copied out all data they wish to preserve as new messages will overwrite the old and will
     /// arrive asynchronously.
@@ -684,14 +1317,38 @@ impl Hypervisor {
     ///
     /// Fails if the intid is invalid.
     pub fn interrupt_enable(&self, intid: intid_t, enable: bool, current: &VCpu) -> Result<(), ()> {
-        current.interrupts.lock().enable(intid, enable)
+        let mut interrupts = current.interrupts.lock();
+        let ret = interrupts.enable(intid, enable);
+        if let Some(run_state) = self.vcpu_run_states.get(current.vm().id, current.index()) {
+            run_state.set_interrupt_pending(interrupts.is_interrupted());
+        }
+        ret
     }
 
     /// Returns the ID of the next pending interrupt for the calling vCPU, and acknowledges it
     /// (i.e. marks it as no longer pending). Returns HF_INVALID_INTID if there are no pending
     /// interrupts.
     pub fn interrupt_get(&self, current: &VCpu) -> intid_t {
-        current.interrupts.lock().get()
+        let mut interrupts = current.interrupts.lock();
+        let intid = interrupts.get();
+        if let Some(run_state) = self.vcpu_run_states.get(current.vm().id, current.index()) {
+            run_state.set_interrupt_pending(interrupts.is_interrupted());
+        }
+        intid
+    }
+
+    /// Publishes that the given vCPU has a pending interrupt, and that the primary VM needs to
+    /// wake it up unless it is the current vCPU. The vCPU is able to run from now on, if it was
+    /// blocked.
+    fn publish_interrupt_pending(&self, vcpu: &VCpu, current: &VCpu) {
+        vcpu.mark_runnable(unsafe { arch_timer_count() });
+
+        if let Some(run_state) = self.vcpu_run_states.get(vcpu.vm().id, vcpu.index()) {
+            run_state.set_interrupt_pending(true);
+            if vcpu as *const _ != current as *const _ {
+                run_state.set_needs_wake(true);
+            }
+        }
     }
 
     /// Returns whether the current vCPU is allowed to inject an interrupt into the given VM and
@@ -737,7 +1394,7 @@ impl Hypervisor {
             return (-1, None)
         );
 
-        dlog!(
+        dlog_debug!(
             "Injecting IRQ {} for VM {} VCPU {} from VM {} VCPU {}\n",
             intid,
             target_vm_id,
@@ -749,6 +1406,48 @@ impl Hypervisor {
         self.internal_interrupt_inject(target_vcpu, intid, current)
     }
 
+    /// Injects a virtual interrupt of the given ID into every vCPU of the given target VM. Only
+    /// primary VMs are allowed to call this, as a secondary can't be switched away to wake up
+    /// more than one of its vCPUs.
+    ///
+    /// Returns a bitmap, indexed by vCPU index, of the vCPUs the primary VM now needs to wake up
+    /// or kick.
+    pub fn interrupt_inject_all(
+        &self,
+        target_vm_id: spci_vm_id_t,
+        intid: intid_t,
+        current: &VCpu,
+    ) -> Result<u64, ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let target_vm = self.vm_manager.get(target_vm_id).ok_or(())?;
+
+        if intid >= HF_NUM_INTIDS {
+            return Err(());
+        }
+
+        dlog_debug!(
+            "Injecting IRQ {} for all vCPUs of VM {} from VM {} VCPU {}\n",
+            intid,
+            target_vm_id,
+            current.vm().id,
+            unsafe { &*current.inner.get_unchecked().cpu }.id
+        );
+
+        let vcpus = target_vm
+            .vcpus
+            .iter()
+            .enumerate()
+            .filter(|(_, vcpu)| vcpu.interrupts.lock().inject(intid).is_ok())
+            .inspect(|(_, vcpu)| self.publish_interrupt_pending(vcpu, current))
+            .fold(0, |vcpus, (i, _)| vcpus | (1 << i));
+
+        Ok(vcpus)
+    }
+
     /// Clears a region of physical memory by overwriting it with zeros. The data is flushed from
     /// the cache so the memory has been cleared across the system.
     fn clear_memory(&self, begin: paddr_t, end: paddr_t, ppool: &MPool) -> Result<(), ()> {
@@ -829,6 +1528,11 @@ impl Hypervisor {
 
         let (mut from_inner, mut to_inner) = SpinLock::lock_both(&from.inner, &to.inner);
 
+        // Memory can't be shared with a VM which has aborted, as it wouldn't be reclaimed.
+        if to.aborting.load(Ordering::Relaxed) {
+            return Err(());
+        }
+
         // Ensure that the memory range is mapped with the same mode so that changes can be
         // reverted if the process fails.
         // Also ensure the memory range is valid for the sender. If it isn't, the sender has either
@@ -909,4 +1613,323 @@ impl Hypervisor {
         let vm = current.vm();
         vm.debug_log(c);
     }
+
+    /// Logs the first `len` characters packed in `chars`, least significant byte first, as if
+    /// they were sent by `debug_log` one at a time.
+    pub fn debug_log_chunk(&self, len: usize, chars: [u64; 2], current: &VCpu) -> Option<usize> {
+        let mut bytes = [0; mem::size_of::<[u64; 2]>()];
+        bytes[..8].copy_from_slice(&chars[0].to_le_bytes());
+        bytes[8..].copy_from_slice(&chars[1].to_le_bytes());
+
+        let chunk = bytes.get(..len)?;
+        current.vm().debug_log_chunk(chunk);
+        Some(len)
+    }
+
+    /// Returns the time, in virtual counter ticks, spent on the given phase of boot, or on loading
+    /// the given secondary VM for `HF_BOOT_PHASE_LOAD_VM`. Only primary VMs are allowed to call
+    /// this.
+    pub fn boot_time_get(&self, phase: u32, vm_id: spci_vm_id_t, current: &VCpu) -> Option<u64> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID {
+            return None;
+        }
+
+        if phase == HF_BOOT_PHASE_LOAD_VM {
+            if vm_id == HF_PRIMARY_VM_ID {
+                return None;
+            }
+
+            let vm = self.vm_manager.get(vm_id)?;
+            return Some(vm.load_ticks.load(Ordering::Relaxed));
+        }
+
+        Some(self.boot_times.get(BootPhase::from_raw(phase)?))
+    }
+
+    /// Enables or disables dirty logging for the given secondary VM. Enabling it write-protects
+    /// all of the VM's writable memory, so that the first write to each page faults and is logged
+    /// by making the page writable again. Disabling it makes all of the memory writable again.
+    /// Only primary VMs are allowed to call this.
+    pub fn vm_dirty_log_enable(
+        &self,
+        vm_id: spci_vm_id_t,
+        enable: bool,
+        current: &VCpu,
+    ) -> Result<(), ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID || vm_id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let vm = self.vm_manager.get(vm_id).ok_or(())?;
+        let mut vm_inner = vm.inner.lock();
+        vm_inner.dirty_log = enable;
+        vm_inner.ptable.update_all_modes(
+            |_, _, mode| {
+                if !mode.contains(Mode::W) {
+                    mode
+                } else if enable {
+                    mode | Mode::DIRTY_LOG
+                } else {
+                    mode - Mode::DIRTY_LOG
+                }
+            },
+            &self.mpool,
+        );
+
+        // Changing the write protection doesn't invalidate the TLB for each block, so do it once.
+        stage2_invalidate_vm(vm_id, vm_inner.ptable.as_raw());
+
+        Ok(())
+    }
+
+    /// Returns a bitmap of which of the `HF_MEMORY_LOG_PAGES` pages from `begin` the given
+    /// secondary VM has written since dirty logging was enabled or they were last returned, and
+    /// write-protects them again. Memory mapped into the VM while dirty logging is enabled isn't
+    /// write-protected, so it is returned as written. Only primary VMs are allowed to call this.
+    pub fn vm_dirty_log_get(
+        &self,
+        vm_id: spci_vm_id_t,
+        begin: ipaddr_t,
+        current: &VCpu,
+    ) -> Result<u32, ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID || vm_id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        if !is_aligned(ipa_addr(begin), PAGE_SIZE)
+            || ipa_addr(begin)
+                .checked_add(HF_MEMORY_LOG_PAGES * PAGE_SIZE)
+                .is_none()
+        {
+            return Err(());
+        }
+
+        let vm = self.vm_manager.get(vm_id).ok_or(())?;
+        let mut vm_inner = vm.inner.lock();
+        if !vm_inner.dirty_log {
+            return Err(());
+        }
+
+        let mut dirty = 0;
+        for i in 0..HF_MEMORY_LOG_PAGES {
+            let page = ipa_add(begin, i * PAGE_SIZE);
+            let mode = match vm_inner.ptable.get_raw_mode(page, ipa_add(page, PAGE_SIZE)) {
+                Ok(mode) => mode,
+                Err(_) => break,
+            };
+            if !mode.contains(Mode::W) || mode.contains(Mode::DIRTY_LOG) {
+                continue;
+            }
+
+            // If the page can't be write-protected again, it stays writable and so is returned as
+            // written again the next time.
+            let page = pa_from_ipa(page);
+            let _ = vm_inner.ptable.identity_map(
+                page,
+                pa_add(page, PAGE_SIZE),
+                mode | Mode::DIRTY_LOG,
+                &self.mpool,
+            );
+            dirty |= 1 << i;
+        }
+
+        if dirty != 0 {
+            stage2_invalidate_vm(vm_id, vm_inner.ptable.as_raw());
+        }
+
+        Ok(dirty)
+    }
+
+    /// Clears the access flags of all of the given secondary VM's memory, so that the next access
+    /// to each block of it is logged, and returns the number of pages the VM accessed since the
+    /// flags were last cleared. Only primary VMs are allowed to call this.
+    pub fn vm_access_log_reset(&self, vm_id: spci_vm_id_t, current: &VCpu) -> Result<usize, ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID || vm_id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let vm = self.vm_manager.get(vm_id).ok_or(())?;
+        let mut vm_inner = vm.inner.lock();
+        let mut accessed = 0;
+        vm_inner.ptable.update_all_modes(
+            |begin, end, mode| {
+                if mode.contains(Mode::INVALID) {
+                    return mode;
+                }
+
+                if !mode.contains(Mode::ACCESS_LOG) {
+                    accessed += (end - begin) / PAGE_SIZE;
+                }
+                mode | Mode::ACCESS_LOG
+            },
+            &self.mpool,
+        );
+
+        // Clearing the access flags doesn't invalidate the TLB for each block, so do it once.
+        stage2_invalidate_vm(vm_id, vm_inner.ptable.as_raw());
+
+        Ok(accessed)
+    }
+
+    /// Returns a bitmap of which of the `HF_MEMORY_LOG_PAGES` pages from `begin` the given
+    /// secondary VM has accessed since its access flags were last cleared. Access flags are kept
+    /// for whole blocks of memory, so all the pages of a block are accessed together. Only primary
+    /// VMs are allowed to call this.
+    pub fn vm_access_log_get(
+        &self,
+        vm_id: spci_vm_id_t,
+        begin: ipaddr_t,
+        current: &VCpu,
+    ) -> Result<u32, ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID || vm_id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        if !is_aligned(ipa_addr(begin), PAGE_SIZE)
+            || ipa_addr(begin)
+                .checked_add(HF_MEMORY_LOG_PAGES * PAGE_SIZE)
+                .is_none()
+        {
+            return Err(());
+        }
+
+        let vm = self.vm_manager.get(vm_id).ok_or(())?;
+        let vm_inner = vm.inner.lock();
+        let mut accessed = 0;
+        for i in 0..HF_MEMORY_LOG_PAGES {
+            let page = ipa_add(begin, i * PAGE_SIZE);
+            let mode = match vm_inner.ptable.get_raw_mode(page, ipa_add(page, PAGE_SIZE)) {
+                Ok(mode) => mode,
+                Err(_) => break,
+            };
+            if !mode.intersects(Mode::INVALID | Mode::ACCESS_LOG) {
+                accessed |= 1 << i;
+            }
+        }
+
+        Ok(accessed)
+    }
+
+    /// Asks the given secondary VM to return `pages` pages of its memory to the primary VM,
+    /// replacing any previous request, which cancels it if `pages` is 0. The VM is notified with
+    /// the `HF_BALLOON_INTID` interrupt on its first vCPU. It returns the pages by donating them to
+    /// the primary VM, which `spci_msg_send` takes off the request. Only primary VMs are allowed
+    /// to call this.
+    ///
+    /// Returns 1 if the primary VM now needs to wake up or kick the VM's first vCPU, or 0
+    /// otherwise.
+    pub fn vm_balloon_inflate(
+        &self,
+        vm_id: spci_vm_id_t,
+        pages: usize,
+        current: &mut VCpuExecutionLocked,
+    ) -> Result<i64, ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID || vm_id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let vm = self.vm_manager.get(vm_id).ok_or(())?;
+        vm.inner.lock().balloon_request = pages;
+
+        if pages == 0 {
+            return Ok(0);
+        }
+
+        // The caller is the primary VM, so injecting never switches to another vCPU.
+        let (ret, _) = self.internal_interrupt_inject(&vm.vcpus[0], HF_BALLOON_INTID, current);
+        Ok(ret)
+    }
+
+    /// Supplies the page at `ipa` to the given demand-paged secondary VM, after it faulted on it.
+    /// The page moves from the primary VM with its contents, and the VM owns it with full access.
+    /// The page must be in the VM's memory ranges, not owned by the VM, and owned by the primary
+    /// VM with exclusive access, and the VM must not be aborting. Only primary VMs are allowed to
+    /// call this.
+    pub fn vm_page_supply(
+        &self,
+        vm_id: spci_vm_id_t,
+        ipa: ipaddr_t,
+        current: &VCpu,
+    ) -> Result<(), ()> {
+        // Only primary VMs are allowed to call this function.
+        if current.vm().id != HF_PRIMARY_VM_ID || vm_id == HF_PRIMARY_VM_ID {
+            return Err(());
+        }
+
+        let vm = self.vm_manager.get(vm_id).ok_or(())?;
+        if !vm.demand_paged || !is_aligned(ipa_addr(ipa), PAGE_SIZE) || !vm.mem_ranges_contain(ipa)
+        {
+            return Err(());
+        }
+
+        let primary = self.vm_manager.get_primary();
+        let (mut vm_inner, mut primary_inner) = SpinLock::lock_both(&vm.inner, &primary.inner);
+
+        // The page can't be given to a VM which has aborted, as it wouldn't be reclaimed.
+        if vm.aborting.load(Ordering::Relaxed) {
+            return Err(());
+        }
+
+        let end = ipa_add(ipa, PAGE_SIZE);
+        if primary_inner.ptable.get_mode(ipa, end)? != Mode::R | Mode::W | Mode::X
+            || !vm_inner
+                .ptable
+                .get_mode(ipa, end)?
+                .contains(Mode::INVALID | Mode::UNOWNED)
+        {
+            return Err(());
+        }
+
+        // Allocate the page tables needed by both VMs first, so that the page can't be left
+        // mapped in neither or both of them.
+        let local_page_pool = MPool::new_with_fallback(&self.mpool);
+        let (begin, end) = (pa_from_ipa(ipa), pa_from_ipa(end));
+        let primary_mode = Mode::INVALID | Mode::UNOWNED;
+        let vm_mode = Mode::R | Mode::W | Mode::X;
+        if primary_inner
+            .ptable
+            .identity_prepare(begin, end, primary_mode, &local_page_pool)
+            .is_err()
+            || vm_inner
+                .ptable
+                .identity_prepare(begin, end, vm_mode, &local_page_pool)
+                .is_err()
+        {
+            primary_inner.ptable.defrag(&local_page_pool);
+            vm_inner.ptable.defrag(&local_page_pool);
+            return Err(());
+        }
+
+        primary_inner
+            .ptable
+            .identity_commit(begin, end, primary_mode, &local_page_pool);
+        vm_inner
+            .ptable
+            .identity_commit(begin, end, vm_mode, &local_page_pool);
+
+        Ok(())
+    }
+
+    /// Returns the number of pages the primary VM has asked the calling VM to return to it, which
+    /// it hasn't donated yet.
+    pub fn balloon_request_get(&self, current: &VCpu) -> usize {
+        current.vm().inner.lock().balloon_request
+    }
+
+    /// Returns the start, or the end if `end` is set, of the given range of the calling VM's
+    /// memory. The ranges are set when the VM is loaded and don't change, so the VM isn't locked.
+    pub fn vm_mem_range_get(&self, index: u32, end: bool, current: &VCpu) -> Option<ipaddr_t> {
+        let mem_range = current.vm().mem_ranges.get(index as usize)?;
+        Some(ipa_from_pa(if end {
+            mem_range.end
+        } else {
+            mem_range.begin
+        }))
+    }
 }
@@ -14,14 +14,18 @@
  * limitations under the License.
  */
 
-use core::mem::MaybeUninit;
+use core::mem::{self, MaybeUninit};
 use core::ptr;
+use core::slice;
 
 use crate::addr::*;
 use crate::arch::*;
 use crate::boot_flow::*;
 use crate::boot_params::*;
+use crate::boot_time::*;
+use crate::cpio::*;
 use crate::cpu::*;
+use crate::dlog::*;
 use crate::hypervisor::*;
 use crate::load::*;
 use crate::manifest::*;
@@ -30,12 +34,14 @@ use crate::mm::*;
 use crate::mpool::*;
 use crate::page::*;
 use crate::types::*;
+use crate::utils::*;
 use crate::vm::*;
 
 extern "C" {
     fn plat_console_init();
     fn arch_one_time_init();
     fn dlog_enable_lock();
+    fn arch_cpu_stop_boot_worker() -> !;
 
     /// The stack to be used by the CPUs.
     static callstacks: [[u8; STACK_SIZE]; MAX_CPUS];
@@ -82,10 +88,13 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
         return c;
     }
 
+    let mut boot_times = BootTimes::new();
+    boot_times.start();
+
     // Make sure the console is initialised before calling dlog.
     plat_console_init();
 
-    dlog!("Initialising hafnium\n");
+    dlog_info!("Initialising hafnium\n");
 
     arch_one_time_init();
     arch_cpu_module_init();
@@ -99,6 +108,7 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
     let mm = MemoryManager::new(&ppool).expect("mm_init failed");
 
     mm.cpu_init();
+    boot_times.lap(BootPhase::PageTable);
 
     // Enable locks now that mm is initialised.
     dlog_enable_lock();
@@ -114,9 +124,11 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
         &mut mm.hypervisor_ptable.lock(),
         &mut manifest,
         &mut params,
+        &mut boot_times,
         &ppool,
     )
     .expect("Could not parse data from FDT.");
+    boot_times.lap(BootPhase::Fdt);
 
     let cpum = CpuManager::new(
         &params.cpu_ids[..params.cpu_count],
@@ -131,14 +143,14 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
     );
 
     for i in 0..params.mem_ranges_count {
-        dlog!(
+        dlog_info!(
             "Memory range: {:#x} - {:#x}\n",
             pa_addr(params.mem_ranges[i].begin),
             pa_addr(params.mem_ranges[i].end) - 1
         );
     }
 
-    dlog!(
+    dlog_info!(
         "Ramdisk range: {:#x} - {:#x}\n",
         pa_addr(params.initrd_begin),
         pa_addr(params.initrd_end) - 1
@@ -163,6 +175,23 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
         pa_difference(params.initrd_begin, params.initrd_end),
     );
 
+    // Index the files in the initrd in a boot-time buffer, so that looking up each VM's kernel
+    // doesn't parse the archive from the start.
+    let cpio_index_len = CpioIndex::table_len(&cpio);
+    let cpio_index_pages =
+        round_up(cpio_index_len * mem::size_of::<CpioIndexEntry>(), PAGE_SIZE) / PAGE_SIZE;
+    let cpio_index_table = hypervisor()
+        .mpool
+        .alloc_pages(cpio_index_pages, 1)
+        .expect("unable to allocate initrd index")
+        .into_raw();
+    let cpio = CpioIndex::new(
+        &cpio,
+        slice::from_raw_parts_mut(cpio_index_table as *mut CpioIndexEntry, cpio_index_len),
+    )
+    .expect("unable to index initrd");
+    boot_times.lap(BootPhase::Initrd);
+
     // Load all VMs.
     let primary_initrd = load_primary(
         &mut HYPERVISOR.get_mut().vm_manager,
@@ -172,6 +201,7 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
         &hypervisor().mpool,
     )
     .expect("unable to load primary VM");
+    boot_times.lap(BootPhase::LoadPrimary);
 
     // load_secondary will add regions assigned to the secondary VMs from
     // mem_ranges to reserved_ranges.
@@ -183,6 +213,7 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
     load_secondary(
         &mut HYPERVISOR.get_mut().vm_manager,
         &mut hypervisor_ptable,
+        &hypervisor().cpu_manager,
         &mut manifest,
         &cpio,
         &params,
@@ -191,18 +222,32 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
     )
     .expect("unable to load secondary VMs");
 
+    mem::drop(cpio);
+    hypervisor()
+        .mpool
+        .free_pages(Pages::from_raw(cpio_index_table, cpio_index_pages));
+    boot_times.lap(BootPhase::LoadSecondary);
+
     // Prepare to run by updating bootparams as seen by primary VM.
     boot_params_patch_fdt(&mut hypervisor_ptable, &mut update, &hypervisor().mpool)
         .expect("plat_update_boot_params failed");
+    boot_times.lap(BootPhase::PatchFdt);
 
     hypervisor_ptable.defrag(&hypervisor().mpool);
 
     // Enable TLB invalidation for VM page table updates.
     mm_vm_enable_invalidation();
+    boot_times.lap(BootPhase::Defrag);
+
+    boot_times.log(&hypervisor().vm_manager);
+    HYPERVISOR.get_mut().boot_times = boot_times;
 
-    dlog!("Hafnium initialisation completed\n");
+    dlog_info!("Hafnium initialisation completed\n");
     INITED = true;
 
+    // From now on, other pCPUs log concurrently, so each logs to its own ring.
+    dlog_enable_buffering();
+
     hypervisor().cpu_manager.get_boot_cpu()
 
     // From now on, other pCPUs are on in order to run multiple vCPUs. Thus
@@ -210,6 +255,17 @@ unsafe extern "C" fn one_time_init(c: *const Cpu) -> *const Cpu {
     // may not modify the singleton without proper locking.
 }
 
+/// The entry point of CPUs turned on by the boot CPU to help load the secondary VMs. They turn
+/// themselves off again when there is nothing left to load.
+#[no_mangle]
+pub unsafe extern "C" fn boot_worker_main(_c: *const Cpu) -> ! {
+    hypervisor().memory_manager.cpu_init();
+
+    load_secondary_worker(&hypervisor().mpool);
+
+    arch_cpu_stop_boot_worker()
+}
+
 pub fn hypervisor() -> &'static Hypervisor {
     unsafe { HYPERVISOR.get_ref() }
 }
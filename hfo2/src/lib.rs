@@ -44,12 +44,15 @@ mod utils;
 mod dlog;
 #[macro_use]
 mod list;
+#[macro_use]
+mod trace;
 mod abi;
 mod addr;
 mod api;
 mod arch;
 mod boot_flow;
 mod boot_params;
+mod boot_time;
 mod cpu;
 mod fdt;
 mod fdt_handler;
@@ -57,16 +60,19 @@ mod hypervisor;
 mod init;
 mod layout;
 mod load;
+mod lz4;
 mod manifest;
 mod memiter;
 mod mm;
 mod mpool;
 mod page;
 mod panic;
+mod run_state;
 mod slist;
 mod spci;
 mod spci_architected_message;
 mod spinlock;
 mod std;
+mod steal_time;
 mod types;
 mod vm;
@@ -14,9 +14,11 @@
  * limitations under the License.
  */
 
-use core::mem;
+use core::mem::{self, MaybeUninit};
 use core::ptr;
+use core::slice;
 use core::str;
+use core::sync::atomic::{spin_loop_hint, AtomicUsize, Ordering};
 
 use crate::addr::*;
 use crate::arch::*;
@@ -24,17 +26,23 @@ use crate::boot_params::*;
 use crate::cpio::*;
 use crate::cpu::*;
 use crate::layout::*;
+use crate::lz4;
 use crate::manifest::*;
 use crate::memiter::*;
 use crate::mm::*;
 use crate::mpool::*;
 use crate::page::*;
+use crate::spinlock::*;
 use crate::types::*;
 use crate::utils::*;
 use crate::vm::*;
 
 use arrayvec::ArrayVec;
 
+extern "C" {
+    fn arch_cpu_start_boot_worker(c: *const Cpu) -> bool;
+}
+
 /// Copies data to an unmapped location by mapping it for write, copying the
 /// data, then unmapping it.
 ///
@@ -70,40 +78,40 @@ unsafe fn copy_to_unmapped(
 pub unsafe fn load_primary(
     vm_manager: &mut VmManager,
     hypervisor_ptable: &mut PageTable<Stage1>,
-    cpio: &MemIter,
+    cpio: &CpioIndex,
     kernel_arg: uintreg_t,
     ppool: &MPool,
 ) -> Result<MemIter, ()> {
     let primary_begin = layout_primary_begin();
 
-    let it = some_or!(find_file(cpio, "vmlinuz\0".as_ptr()), {
-        dlog!("Unable to find vmlinuz\n");
+    let it = some_or!(cpio.find_file("vmlinuz\0".as_ptr()), {
+        dlog_error!("Unable to find vmlinuz\n");
         return Err(());
     });
 
-    dlog!(
+    dlog_info!(
         "Copying primary to {:p}\n",
         pa_addr(primary_begin) as *const u8
     );
 
     if !copy_to_unmapped(hypervisor_ptable, primary_begin, &it, ppool) {
-        dlog!("Unable to relocate kernel for primary vm.\n");
+        dlog_error!("Unable to relocate kernel for primary vm.\n");
         return Err(());
     }
 
-    let initrd = some_or!(find_file(cpio, "initrd.img\0".as_ptr()), {
-        dlog!("Unable to find initrd.img\n");
+    let initrd = some_or!(cpio.find_file("initrd.img\0".as_ptr()), {
+        dlog_error!("Unable to find initrd.img\n");
         return Err(());
     });
 
     let vm = vm_manager
         .new_vm(MAX_CPUS as spci_vcpu_count_t, ppool)
         .ok_or_else(|| {
-            dlog!("Unable to initialise primary vm\n");
+            dlog_error!("Unable to initialise primary vm\n");
         })?;
 
     if vm.id != HF_PRIMARY_VM_ID {
-        dlog!("Primary vm was not given correct id\n");
+        dlog_error!("Primary vm was not given correct id\n");
         return Err(());
     }
 
@@ -121,12 +129,12 @@ pub unsafe fn load_primary(
         )
         .is_err()
     {
-        dlog!("Unable to initialise memory for primary vm\n");
+        dlog_error!("Unable to initialise memory for primary vm\n");
         return Err(());
     }
 
     if !mm_vm_unmap_hypervisor(&mut (*vm).inner.get_mut_unchecked().ptable, ppool) {
-        dlog!("Unable to unmap hypervisor from primary vm\n");
+        dlog_error!("Unable to unmap hypervisor from primary vm\n");
         return Err(());
     }
 
@@ -138,75 +146,593 @@ pub unsafe fn load_primary(
     Ok(initrd)
 }
 
+/// Removes the pages covering the given range from the given memory ranges, so that no memory is
+/// carved out of them. Splitting a range in two takes another entry; if there are none left, the
+/// smaller part is dropped.
+fn exclude_mem_range(
+    mem_ranges: &mut ArrayVec<[MemRange; MAX_MEM_RANGES]>,
+    begin: paddr_t,
+    end: paddr_t,
+) {
+    let begin = round_down(pa_addr(begin), PAGE_SIZE);
+    let end = round_up(pa_addr(end), PAGE_SIZE);
+
+    let mut i = 0;
+    while i < mem_ranges.len() {
+        let mem_range = &mut mem_ranges[i];
+        let range_begin = pa_addr(mem_range.begin);
+        let range_end = pa_addr(mem_range.end);
+        i += 1;
+
+        if range_end <= begin || end <= range_begin {
+            continue;
+        }
+
+        match (range_begin < begin, end < range_end) {
+            (true, true) => {
+                mem_range.end = pa_init(begin);
+                let above = MemRange::new(pa_init(end), pa_init(range_end));
+                if !mem_ranges.is_full() {
+                    mem_ranges.insert(i, above);
+                    i += 1;
+                } else if range_end - end > begin - range_begin {
+                    mem_ranges[i - 1] = above;
+                }
+            }
+            (true, false) => mem_range.end = pa_init(begin),
+            (false, true) => mem_range.begin = pa_init(end),
+            (false, false) => mem_range.begin = mem_range.end,
+        }
+    }
+}
+
+/// The alignments to try to place a VM's memory at, from the most preferred. Memory aligned to a
+/// block size can be mapped in the VM's stage-2 page table with blocks of that size, which take
+/// fewer TLB entries than pages.
+const CARVE_OUT_ALIGNMENTS: [usize; 3] = [1 << 30, 2 << 20, PAGE_SIZE];
+
 /// Try to find a memory range of the given size within the given ranges, and
-/// remove it from them. Return true on success, or false if no large enough
-/// contiguous range is found.
+/// remove it from them. Return the range on success, or an error if no large
+/// enough contiguous range is found.
+///
+/// The range is aligned to the largest block size, no larger than it, at which
+/// it fits in any of the ranges. It is taken from the smallest of those ranges,
+/// as high in it as possible. Taking it from the middle of a range splits the
+/// range in two, unless there is no room left for another range.
 fn carve_out_mem_range(
-    mem_ranges: &mut [MemRange],
+    mem_ranges: &mut ArrayVec<[MemRange; MAX_MEM_RANGES]>,
     size_to_find: u64,
 ) -> Result<(paddr_t, paddr_t), ()> {
-    // TODO(b/116191358): Consider being cleverer about how we pack VMs
-    // together, with a non-greedy algorithm.
-    for mem_range in mem_ranges.iter_mut() {
-        if size_to_find <= pa_difference(mem_range.begin, mem_range.end) as u64 {
-            // This range is big enough, take some of it from the end and reduce
-            // its size accordingly.
-            let found_end = mem_range.end;
-            let found_begin = pa_init(pa_addr(mem_range.end) - size_to_find as usize);
+    let size = size_to_find as usize;
+    let can_split = !mem_ranges.is_full();
+
+    for &align in CARVE_OUT_ALIGNMENTS
+        .iter()
+        .filter(|&&align| align <= size || align == PAGE_SIZE)
+    {
+        let best = mem_ranges
+            .iter()
+            .enumerate()
+            .filter_map(|(i, mem_range)| {
+                let begin = pa_addr(mem_range.begin);
+                let end = pa_addr(mem_range.end);
+                if end < begin || end - begin < size {
+                    return None;
+                }
+
+                let top = round_down(end - size, align);
+                let found = if top < begin {
+                    return None;
+                } else if can_split || top == begin || top + size == end {
+                    top
+                } else if begin % align == 0 {
+                    begin
+                } else {
+                    return None;
+                };
+
+                Some((i, found, end - begin))
+            })
+            .min_by_key(|&(_, _, range_size)| range_size);
+
+        let (i, found, _) = some_or!(best, continue);
+        let found_begin = pa_init(found);
+        let found_end = pa_add(found_begin, size);
+        let mem_range = &mut mem_ranges[i];
+
+        if pa_addr(found_begin) == pa_addr(mem_range.begin) {
+            mem_range.begin = found_end;
+        } else {
+            let above = MemRange::new(found_end, mem_range.end);
             mem_range.end = found_begin;
-            return Ok((found_begin, found_end));
+            if pa_addr(above.begin) != pa_addr(above.end) {
+                mem_ranges.insert(i + 1, above);
+            }
         }
+
+        return Ok((found_begin, found_end));
     }
 
     Err(())
 }
 
-/// Given arrays of memory ranges before and after memory was removed for
-/// secondary VMs, add the difference to the reserved ranges of the given
-/// update. Return true on success, or false if there would be more than
-/// MAX_MEM_RANGES reserved ranges after adding the new ones.
-/// `before` and `after` must be arrays of exactly `mem_ranges_count` elements.
-fn update_reserved_ranges(
-    update: &mut BootParamsUpdate,
-    before: &[MemRange],
-    after: &[MemRange],
-) -> Result<(), ()> {
-    assert_eq!(before.len(), after.len());
+/// Try to find memory of the given size within the given ranges, made up of at
+/// most MAX_VM_MEM_RANGES ranges of which the first is at least
+/// `first_size_min` bytes, and remove it from them. Return the ranges on
+/// success, or an error, leaving the given ranges unchanged, on failure.
+///
+/// A single range is found as by `carve_out_mem_range` if there is one.
+/// Otherwise the largest of the given ranges are taken whole, largest first,
+/// until the rest fits in one range.
+fn carve_out_mem_ranges(
+    mem_ranges: &mut ArrayVec<[MemRange; MAX_MEM_RANGES]>,
+    size_to_find: u64,
+    first_size_min: u64,
+) -> Result<ArrayVec<[MemRange; MAX_VM_MEM_RANGES]>, ()> {
+    let before = mem_ranges.clone();
+    let mut found: ArrayVec<[MemRange; MAX_VM_MEM_RANGES]> = ArrayVec::new();
+    let mut size_left = size_to_find as usize;
 
-    for (before, after) in before.iter().zip(after.iter()) {
-        if pa_addr(after.begin) > pa_addr(before.begin) {
-            if update.reserved_ranges_count >= MAX_MEM_RANGES {
-                dlog!("Too many reserved ranges after loading secondary VMs.\n");
-                return Err(());
+    while !found.is_full() {
+        if let Ok((begin, end)) = carve_out_mem_range(mem_ranges, size_left as u64) {
+            found.push(MemRange::new(begin, end));
+
+            if pa_difference(found[0].begin, found[0].end) as u64 >= first_size_min {
+                return Ok(found);
             }
+            break;
+        }
+
+        if found.len() + 1 == found.capacity() {
+            break;
+        }
+
+        // Take the largest range whole.
+        let largest = some_or!(
+            mem_ranges.iter_mut().max_by_key(|mem_range| {
+                pa_addr(mem_range.end).saturating_sub(round_up(pa_addr(mem_range.begin), PAGE_SIZE))
+            }),
+            break
+        );
+        let begin = pa_init(round_up(pa_addr(largest.begin), PAGE_SIZE));
+        if pa_addr(begin) >= pa_addr(largest.end) {
+            break;
+        }
+
+        found.push(MemRange::new(begin, largest.end));
+        size_left -= pa_difference(begin, largest.end);
+        largest.begin = largest.end;
+    }
+
+    *mem_ranges = before;
+    Err(())
+}
+
+/// Add the given memory ranges to the given sorted ranges, merging adjacent ones. Return an error,
+/// leaving the sorted ranges unchanged, if there would be more than `max_count` of them.
+fn merge_mem_ranges(
+    merged: &mut ArrayVec<[MemRange; MAX_MEM_RANGES]>,
+    mem_ranges: &[MemRange],
+    max_count: usize,
+) -> Result<(), ()> {
+    // Ranges which are only joined by a later one are counted at the end, so there is room for a
+    // VM's worth of them beyond the limit.
+    let mut result: ArrayVec<[MemRange; MAX_MEM_RANGES + MAX_VM_MEM_RANGES]> =
+        merged.iter().cloned().collect();
 
-            update.reserved_ranges[update.reserved_ranges_count].begin = before.begin;
-            update.reserved_ranges[update.reserved_ranges_count].end = after.begin;
-            update.reserved_ranges_count += 1;
+    for mem_range in mem_ranges {
+        let i = result
+            .iter()
+            .position(|other| pa_addr(other.begin) > pa_addr(mem_range.begin))
+            .unwrap_or(result.len());
+        let joins_below = i > 0 && pa_addr(result[i - 1].end) == pa_addr(mem_range.begin);
+        let joins_above = i < result.len() && pa_addr(result[i].begin) == pa_addr(mem_range.end);
+
+        match (joins_below, joins_above) {
+            (true, true) => {
+                result[i - 1].end = result[i].end;
+                result.remove(i);
+            }
+            (true, false) => result[i - 1].end = mem_range.end,
+            (false, true) => result[i].begin = mem_range.begin,
+            (false, false) => result.try_insert(i, *mem_range).map_err(|_| ())?,
         }
+    }
+
+    if result.len() > max_count || result.len() > merged.capacity() {
+        return Err(());
+    }
+
+    *merged = result.into_iter().collect();
+    Ok(())
+}
 
-        if pa_addr(after.end) < pa_addr(before.end) {
-            if update.reserved_ranges_count >= MAX_MEM_RANGES {
-                dlog!("Too many reserved ranges after loading secondary VMs.\n");
+/// Add the memory carved out for secondary VMs, sorted and merged by `merge_mem_ranges`, to the
+/// reserved ranges of the given update. Return an error if there would be more than
+/// MAX_MEM_RANGES reserved ranges after adding the new ones.
+fn update_reserved_ranges(update: &mut BootParamsUpdate, carved: &[MemRange]) -> Result<(), ()> {
+    for mem_range in carved {
+        ok_or!(
+            add_reserved_range(update, mem_range.begin, mem_range.end),
+            {
+                dlog_error!("Too many reserved ranges after loading secondary VMs.\n");
                 return Err(());
             }
+        );
+    }
+
+    Ok(())
+}
+
+/// Writes the kernel to the start of the first of the given memory ranges, decompressing it if it
+/// is LZ4 compressed, and zeroes the rest of them. The memory must be mapped for write.
+unsafe fn write_kernel(mem_ranges: &[MemRange], kernel: &MemIter) -> Result<(), ()> {
+    let kernel = kernel.as_slice();
+
+    for (i, mem_range) in mem_ranges.iter().enumerate() {
+        let size = pa_difference(mem_range.begin, mem_range.end);
+        let mem = slice::from_raw_parts_mut(pa_addr(mem_range.begin) as *mut u8, size);
 
-            update.reserved_ranges[update.reserved_ranges_count].begin = after.end;
-            update.reserved_ranges[update.reserved_ranges_count].end = before.end;
-            update.reserved_ranges_count += 1;
+        let kernel_size = if i != 0 {
+            0
+        } else if lz4::is_lz4(kernel) {
+            lz4::decompress(kernel, mem)?
+        } else {
+            mem[..kernel.len()].copy_from_slice(kernel);
+            kernel.len()
+        };
+
+        ptr::write_bytes(mem[kernel_size..].as_mut_ptr(), 0, size - kernel_size);
+        arch_mm_flush_dcache(pa_addr(mem_range.begin), size);
+    }
+
+    Ok(())
+}
+
+/// Identity maps all the given memory ranges in the given page table with the given mode, or
+/// none of them.
+fn map_mem_ranges<S: Stage>(
+    ptable: &mut PageTable<S>,
+    mem_ranges: &[MemRange],
+    mode: Mode,
+    ppool: &MPool,
+) -> Result<(), ()> {
+    for (i, mem_range) in mem_ranges.iter().enumerate() {
+        if ptable
+            .identity_map(mem_range.begin, mem_range.end, mode, ppool)
+            .is_err()
+        {
+            unmap_mem_ranges(ptable, &mem_ranges[..i], ppool);
+            return Err(());
         }
     }
 
     Ok(())
 }
 
+/// Unmaps all the given memory ranges from the given page table.
+fn unmap_mem_ranges<S: Stage>(ptable: &mut PageTable<S>, mem_ranges: &[MemRange], ppool: &MPool) {
+    for mem_range in mem_ranges {
+        ptable.unmap(mem_range.begin, mem_range.end, ppool).unwrap();
+    }
+}
+
+/// Returns the pages holding the given file in the initrd.
+fn image_range(kernel: &MemIter) -> (paddr_t, paddr_t) {
+    let begin = pa_from_va(va_init(kernel.get_next() as usize));
+    let end = pa_from_va(va_init(kernel.get_limit() as usize));
+
+    (
+        pa_init(round_down(pa_addr(begin), PAGE_SIZE)),
+        pa_init(round_up(pa_addr(end), PAGE_SIZE)),
+    )
+}
+
+/// Returns whether the image of the given VM can be kept intact after boot, for the VM to be
+/// loaded from it when it first runs or when it is reset. Its image must not share pages with the
+/// primary VM's initrd, as they are taken from the primary VM, and there must be room to reserve
+/// them along with the given number of reserved ranges still to be added for the carved out memory.
+/// Its image must also lie within the initrd, which no VM's memory is carved out of, so that loading
+/// the VMs doesn't overwrite it. Otherwise the VM is loaded at boot.
+fn can_keep_image(
+    vm_id: spci_vm_id_t,
+    kernel: &MemIter,
+    params: &BootParams,
+    update: &BootParamsUpdate,
+    carved_count: usize,
+) -> bool {
+    let (image_begin, image_end) = image_range(kernel);
+
+    if pa_addr(image_begin) < round_down(pa_addr(params.initrd_begin), PAGE_SIZE)
+        || round_up(pa_addr(params.initrd_end), PAGE_SIZE) < pa_addr(image_end)
+    {
+        dlog_info!(
+            "Image of VM{} is outside the initrd, not keeping it\n",
+            vm_id
+        );
+        return false;
+    }
+
+    if pa_addr(image_begin) < pa_addr(update.initrd_end)
+        && pa_addr(update.initrd_begin) < pa_addr(image_end)
+    {
+        dlog_info!(
+            "Image of VM{} shares pages with the primary initrd, not keeping it\n",
+            vm_id
+        );
+        return false;
+    }
+
+    if update.reserved_ranges_count + carved_count >= MAX_MEM_RANGES {
+        dlog_info!(
+            "Too many reserved ranges to keep the image of VM{}, loading it now\n",
+            vm_id
+        );
+        return false;
+    }
+
+    true
+}
+
+/// Adds a range to the reserved ranges of the given update, or returns an error if there are
+/// already MAX_MEM_RANGES of them.
+fn add_reserved_range(
+    update: &mut BootParamsUpdate,
+    begin: paddr_t,
+    end: paddr_t,
+) -> Result<(), ()> {
+    if update.reserved_ranges_count >= MAX_MEM_RANGES {
+        return Err(());
+    }
+
+    update.reserved_ranges[update.reserved_ranges_count].begin = begin;
+    update.reserved_ranges[update.reserved_ranges_count].end = end;
+    update.reserved_ranges_count += 1;
+
+    Ok(())
+}
+
+/// The part of loading a secondary VM which only touches the VM's own memory and page table, so
+/// that it can run on any CPU.
+struct LoadJob {
+    vm: *mut Vm,
+    kernel: MemIter,
+
+    /// Pages to seed the memory pool the VM's page table is built from, so that jobs running on
+    /// different CPUs don't contend on the hypervisor's memory pool. Null if none could be spared.
+    pool_pages: *mut RawPage,
+    pool_page_count: usize,
+}
+
+impl LoadJob {
+    /// Writes the kernel to the VM's memory, maps it into the VM's page table and starts the VM's
+    /// first vCPU. The memory must be mapped for write.
+    unsafe fn run(&self, ppool: &MPool) {
+        let started = arch_timer_count();
+
+        // Dropping the local pool returns the pages it didn't use to `ppool`.
+        let local_page_pool = MPool::new_with_fallback(ppool);
+        if !self.pool_pages.is_null() {
+            local_page_pool.free_pages(Pages::from_raw(self.pool_pages, self.pool_page_count));
+        }
+
+        let vm = &mut *self.vm;
+
+        ok_or!(write_kernel(&vm.mem_ranges, &self.kernel), {
+            dlog_error!("Unable to decompress kernel for VM{}\n", vm.id);
+            return;
+        });
+
+        // Grant the VM access to the memory.
+        if map_mem_ranges(
+            &mut vm.inner.get_mut().ptable,
+            &vm.mem_ranges,
+            Mode::R | Mode::W | Mode::X,
+            &local_page_pool,
+        )
+        .is_err()
+        {
+            dlog_error!("Unable to initialise memory for VM{}\n", vm.id);
+            return;
+        }
+
+        start_secondary(vm, started);
+    }
+}
+
+/// Starts the first vCPU of a loaded secondary VM at the start of its first memory range, passing
+/// it the size of that range. Loading it took since the given counter value.
+unsafe fn start_secondary(vm: &Vm, started: u64) {
+    let mem_range = &vm.mem_ranges[0];
+
+    vm.load_ticks.store(
+        arch_timer_count().wrapping_sub(started).max(1),
+        Ordering::Relaxed,
+    );
+
+    dlog_info!(
+        "Loaded VM{} with {} vcpus, entry at 0x{:x}\n",
+        vm.id,
+        vm.vcpus.len(),
+        pa_addr(mem_range.begin)
+    );
+
+    vcpu_secondary_reset_and_start(
+        &vm.vcpus[0] as *const _ as *mut _,
+        ipa_from_pa(mem_range.begin),
+        pa_difference(mem_range.begin, mem_range.end) as uintreg_t,
+    );
+}
+
+/// Where to load a VM from whose loading was deferred until it first runs. Its memory has been
+/// carved out and its image is left in the initrd, which stays mapped in the hypervisor.
+pub struct DeferredLoad {
+    kernel: MemIter,
+}
+
+impl DeferredLoad {
+    /// Defers loading a VM from the given image, which must be kept intact, until it runs.
+    pub fn new(kernel: MemIter) -> Self {
+        Self { kernel }
+    }
+
+    /// Writes the kernel to the VM's memory and maps it into the VM's page table. The VM is only
+    /// locked to map the memory, not while it is written.
+    unsafe fn load(
+        &self,
+        vm: &Vm,
+        hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
+        ppool: &MPool,
+    ) -> Result<(), ()> {
+        if map_mem_ranges(
+            &mut hypervisor_ptable.lock(),
+            &vm.mem_ranges,
+            Mode::W,
+            ppool,
+        )
+        .is_err()
+        {
+            dlog_error!("Unable to copy kernel for VM{}\n", vm.id);
+            return Err(());
+        }
+
+        let written = write_kernel(&vm.mem_ranges, &self.kernel);
+        unmap_mem_ranges(&mut hypervisor_ptable.lock(), &vm.mem_ranges, ppool);
+
+        if written.is_err() {
+            dlog_error!("Unable to decompress kernel for VM{}\n", vm.id);
+            return Err(());
+        }
+
+        // Grant the VM access to the memory.
+        if map_mem_ranges(
+            &mut vm.inner.lock().ptable,
+            &vm.mem_ranges,
+            Mode::R | Mode::W | Mode::X,
+            ppool,
+        )
+        .is_err()
+        {
+            dlog_error!("Unable to initialise memory for VM{}\n", vm.id);
+            return Err(());
+        }
+
+        Ok(())
+    }
+}
+
+/// Loads a VM whose loading was deferred and starts its first vCPU, or waits for another CPU
+/// which is already loading it. If loading fails, the VM's vCPUs are left off.
+pub unsafe fn load_deferred(
+    vm: &Vm,
+    hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
+    ppool: &MPool,
+) {
+    let started = arch_timer_count();
+    let mut vm_inner = vm.inner.lock();
+    let deferred = some_or!(vm_inner.deferred_load.take(), {
+        mem::drop(vm_inner);
+        while vm.load_pending.load(Ordering::Acquire) {
+            spin_loop_hint();
+        }
+        return;
+    });
+
+    // Other CPUs may lock the VM, e.g. to send it a message, while its memory is written.
+    // `load_pending` keeps its vCPUs from running until it is loaded.
+    mem::drop(vm_inner);
+    let loaded = deferred.load(vm, hypervisor_ptable, ppool);
+
+    if loaded.is_ok() {
+        start_secondary(vm, started);
+    }
+
+    vm.load_pending.store(false, Ordering::Release);
+}
+
+/// The secondary VMs waiting to be loaded, shared by the CPUs loading them.
+struct LoadQueue {
+    jobs: ArrayVec<[LoadJob; MAX_VMS]>,
+
+    /// The index of the next job to be claimed.
+    next: AtomicUsize,
+
+    /// The number of CPUs started to help which have not finished yet.
+    workers: AtomicUsize,
+}
+
+impl LoadQueue {
+    /// Claims and runs jobs until there are none left.
+    unsafe fn run(&self, ppool: &MPool) {
+        loop {
+            let i = self.next.fetch_add(1, Ordering::AcqRel);
+            if i >= self.jobs.len() {
+                break;
+            }
+
+            self.jobs[i].run(ppool);
+        }
+    }
+}
+
+/// Undoes the hypervisor's mappings of the memory of the given VM and of the VMs already queued,
+/// made for the jobs to write to, when loading is abandoned before the jobs are run.
+unsafe fn abandon_load(
+    queue: &LoadQueue,
+    hypervisor_ptable: &mut PageTable<Stage1>,
+    mem_ranges: &[MemRange],
+    ppool: &MPool,
+) {
+    unmap_mem_ranges(hypervisor_ptable, mem_ranges, ppool);
+
+    for job in queue.jobs.iter() {
+        unmap_mem_ranges(hypervisor_ptable, &(*job.vm).mem_ranges, ppool);
+        if !job.pool_pages.is_null() {
+            ppool.free_pages(Pages::from_raw(job.pool_pages, job.pool_page_count));
+        }
+    }
+}
+
+/// Note(HfO2): this is static rather than local so that the CPUs started to help can find it.
+static mut LOAD_QUEUE: MaybeUninit<LoadQueue> = MaybeUninit::uninit();
+
+/// Returns a generous number of pages for the tables below the root of a stage-2 page table
+/// mapping the given ranges: at each level, the tables covering each range and one more at each
+/// end.
+fn ptable_pages_estimate(mem_ranges: &[MemRange]) -> usize {
+    mem_ranges
+        .iter()
+        .map(|mem_range| {
+            let size = pa_difference(mem_range.begin, mem_range.end);
+            (1..=Stage2::max_level() as usize)
+                .map(|level| size / (PAGE_SIZE << (level * PAGE_LEVEL_BITS)) + 2)
+                .sum::<usize>()
+        })
+        .sum()
+}
+
+/// Loads secondary VMs queued by `load_secondary` on a CPU started to help with it.
+pub unsafe fn load_secondary_worker(ppool: &MPool) {
+    let queue = LOAD_QUEUE.get_ref();
+
+    queue.run(ppool);
+    queue.workers.fetch_sub(1, Ordering::Release);
+}
+
 /// Loads all secondary VMs into the memory ranges from the given params.
 /// Memory reserved for the VMs is added to the `reserved_ranges` of `update`.
+/// A VM's memory is assembled from several ranges if no single range is large
+/// enough.
+///
+/// The boot CPU carves out the VMs' memory and creates the VMs. Copying the kernels, zeroing the
+/// rest of the memory and building the VMs' page tables is then shared with the other CPUs, which
+/// are turned on to help and turned off again before returning.
 pub unsafe fn load_secondary(
     vm_manager: &mut VmManager,
     hypervisor_ptable: &mut PageTable<Stage1>,
+    cpu_manager: &CpuManager,
     manifest: &mut Manifest,
-    cpio: &MemIter,
+    cpio: &CpioIndex,
     params: &BootParams,
     update: &mut BootParamsUpdate,
     ppool: &MPool,
@@ -226,13 +752,35 @@ pub unsafe fn load_secondary(
         mem_range.end = pa_init(round_down(pa_addr(mem_range.end), PAGE_SIZE));
     }
 
+    // The VMs' memory is written to by several CPUs at once, so it must not overlap the initrd
+    // which the images, including the primary's, are read from.
+    exclude_mem_range(
+        &mut mem_ranges_available,
+        params.initrd_begin,
+        params.initrd_end,
+    );
+
+    // The memory carved out for the VMs, merged so that it takes as few reserved ranges as
+    // possible.
+    let mut carved: ArrayVec<[MemRange; MAX_MEM_RANGES]> = ArrayVec::new();
+
+    ptr::write(
+        LOAD_QUEUE.get_mut(),
+        LoadQueue {
+            jobs: ArrayVec::new(),
+            next: AtomicUsize::new(0),
+            workers: AtomicUsize::new(0),
+        },
+    );
+    let queue = LOAD_QUEUE.get_mut();
+
     for (i, manifest_vm) in manifest.vms.iter_mut().enumerate() {
         let vm_id = HF_VM_ID_OFFSET + i as spci_vm_id_t;
         if vm_id == HF_PRIMARY_VM_ID {
             continue;
         }
 
-        dlog!(
+        dlog_info!(
             "Loading VM{}: {}.\n",
             vm_id,
             str::from_utf8(as_asciz(&manifest_vm.debug_name)).unwrap(),
@@ -243,89 +791,493 @@ pub unsafe fn load_secondary(
             as_asciz(&manifest_vm.kernel_filename).len(),
         );
 
-        let kernel = some_or!(find_file_memiter(cpio, &kernel_filename), {
-            dlog!(
+        let kernel = some_or!(cpio.find_file_memiter(&kernel_filename), {
+            dlog_error!(
                 "Could not find kernel file \"{}\".",
                 str::from_utf8(as_asciz(&manifest_vm.kernel_filename)).unwrap(),
             );
             continue;
         });
 
+        // A compressed kernel must fit in the VM's first memory range once decompressed.
+        let kernel_size = if lz4::is_lz4(kernel.as_slice()) {
+            ok_or!(lz4::decompressed_size(kernel.as_slice()), {
+                dlog_error!("Unable to decompress kernel\n");
+                continue;
+            })
+        } else {
+            kernel.len()
+        };
+
         let mem_size = round_up(manifest_vm.mem_size as usize, PAGE_SIZE) as u64;
-        if mem_size < kernel.len() as u64 {
-            dlog!("Kernel is larger than available memory\n");
+        if mem_size < kernel_size as u64 {
+            dlog_error!("Kernel is larger than available memory\n");
             continue;
         }
 
-        let (secondary_mem_begin, secondary_mem_end) =
-            ok_or!(carve_out_mem_range(&mut mem_ranges_available, mem_size), {
-                dlog!("Not enough memory ({} bytes)\n", mem_size);
+        let mem_ranges_before = mem_ranges_available.clone();
+        let mem_ranges = ok_or!(
+            carve_out_mem_ranges(
+                &mut mem_ranges_available,
+                mem_size,
+                round_up(kernel_size, PAGE_SIZE) as u64
+            ),
+            {
+                dlog_error!("Not enough memory ({} bytes)\n", mem_size);
                 continue;
-            });
+            }
+        );
+
+        // The carved out memory must fit in the reserved ranges along with the images kept. The
+        // image of this VM is only kept if there is room left for it too.
+        let reserved_left = MAX_MEM_RANGES - update.reserved_ranges_count;
+        ok_or!(merge_mem_ranges(&mut carved, &mem_ranges, reserved_left), {
+            dlog_error!("Too many reserved ranges to load VM{}\n", vm_id);
+            mem_ranges_available = mem_ranges_before;
+            continue;
+        });
+
+        let keep_image = (manifest_vm.lazy_load || manifest_vm.restartable)
+            && can_keep_image(vm_id, &kernel, params, update, carved.len());
+        let lazy_load = manifest_vm.lazy_load && keep_image;
 
-        if !copy_to_unmapped(hypervisor_ptable, secondary_mem_begin, &kernel, ppool) {
-            dlog!("Unable to copy kernel\n");
+        if mem_ranges.len() > 1 {
+            dlog_info!("Assembled memory from {} ranges\n", mem_ranges.len());
+        }
+
+        // Map the memory for the job to write the kernel to. It is unmapped once all the jobs are
+        // done.
+        if !lazy_load && map_mem_ranges(hypervisor_ptable, &mem_ranges, Mode::W, ppool).is_err() {
+            dlog_error!("Unable to copy kernel\n");
             continue;
         }
 
         let primary = vm_manager.get_mut(HF_PRIMARY_VM_ID).unwrap();
 
         // Deny the primary VM access to this memory.
-        if primary
-            .inner
-            .get_mut()
-            .ptable
-            .unmap(secondary_mem_begin, secondary_mem_end, ppool)
-            .is_err()
-        {
-            dlog!("Unable to unmap secondary VM from primary VM\n");
-            return Err(());
+        for mem_range in mem_ranges.iter() {
+            if primary
+                .inner
+                .get_mut()
+                .ptable
+                .unmap(mem_range.begin, mem_range.end, ppool)
+                .is_err()
+            {
+                dlog_error!("Unable to unmap secondary VM from primary VM\n");
+                abandon_load(
+                    queue,
+                    hypervisor_ptable,
+                    if lazy_load { &[] } else { &mem_ranges[..] },
+                    ppool,
+                );
+                return Err(());
+            }
+        }
+
+        // The image of a VM loaded when it first runs or when it is reset must stay intact, so
+        // reserve it and deny the primary VM access to it too.
+        if keep_image {
+            let (image_begin, image_end) = image_range(&kernel);
+            add_reserved_range(update, image_begin, image_end).unwrap();
+
+            if primary
+                .inner
+                .get_mut()
+                .ptable
+                .unmap(image_begin, image_end, ppool)
+                .is_err()
+            {
+                dlog_error!("Unable to unmap secondary VM image from primary VM\n");
+                abandon_load(
+                    queue,
+                    hypervisor_ptable,
+                    if lazy_load { &[] } else { &mem_ranges[..] },
+                    ppool,
+                );
+                return Err(());
+            }
         }
 
         let vm = some_or!(vm_manager.new_vm(manifest_vm.vcpu_count, ppool), {
-            dlog!("Unable to initialise VM\n");
+            dlog_error!("Unable to initialise VM\n");
+            if !lazy_load {
+                unmap_mem_ranges(hypervisor_ptable, &mem_ranges, ppool);
+            }
             continue;
         });
+        vm.mem_ranges = mem_ranges;
+        vm.demand_paged = manifest_vm.demand_paged;
+        if manifest_vm.restartable && keep_image {
+            vm.image = Some(kernel.clone());
+        }
 
-        // Grant the VM access to the memory.
-        if vm
-            .inner
-            .get_mut()
-            .ptable
-            .identity_map(
-                secondary_mem_begin,
-                secondary_mem_end,
-                Mode::R | Mode::W | Mode::X,
-                ppool,
-            )
-            .is_err()
-        {
-            dlog!("Unable to initialise memory\n");
+        if lazy_load {
+            vm.inner.get_mut().deferred_load = Some(DeferredLoad { kernel });
+            vm.load_pending.store(true, Ordering::Relaxed);
+            dlog_info!("Deferred loading VM{} until it first runs\n", vm.id);
             continue;
         }
 
-        dlog!(
-            "Loaded with {} vcpus, entry at 0x{:x}\n",
-            manifest_vm.vcpu_count,
-            pa_addr(secondary_mem_begin)
+        let pool_page_count = ptable_pages_estimate(&vm.mem_ranges);
+        let pool_pages = ppool
+            .alloc_pages(pool_page_count, 1)
+            .map(|pages| pages.into_raw())
+            .unwrap_or(ptr::null_mut());
+
+        queue.jobs.push(LoadJob {
+            vm,
+            kernel,
+            pool_pages,
+            pool_page_count,
+        });
+    }
+
+    // The CPUs started to help read the hypervisor's page table root and memory management
+    // configuration before they enable their caches.
+    arch_mm_flush_dcache(
+        hypervisor_ptable as *const _ as usize,
+        mem::size_of::<PageTable<Stage1>>(),
+    );
+    arch_mm_flush_config();
+
+    // Turn on other CPUs to share the jobs with, leaving one job for this CPU.
+    for c in cpu_manager
+        .iter()
+        .skip(1)
+        .take(queue.jobs.len().saturating_sub(1))
+    {
+        queue.workers.fetch_add(1, Ordering::Relaxed);
+        if !arch_cpu_start_boot_worker(c) {
+            queue.workers.fetch_sub(1, Ordering::Relaxed);
+        }
+    }
+
+    queue.run(ppool);
+
+    // Wait for the other CPUs to finish their jobs before the VMs' memory is unmapped.
+    while queue.workers.load(Ordering::Acquire) != 0 {
+        spin_loop_hint();
+    }
+
+    for job in queue.jobs.iter() {
+        unmap_mem_ranges(hypervisor_ptable, &(*job.vm).mem_ranges, ppool);
+    }
+
+    // Add the memory carved out for the VMs to the reserved ranges of update params.
+    update_reserved_ranges(update, &carved)
+}
+
+#[cfg(test)]
+mod test {
+    extern crate std;
+    use std::vec;
+    use std::vec::Vec;
+
+    use super::*;
+
+    const MB: usize = 1 << 20;
+    const GB: usize = 1 << 30;
+
+    fn mem_ranges(ranges: &[(usize, usize)]) -> ArrayVec<[MemRange; MAX_MEM_RANGES]> {
+        ranges
+            .iter()
+            .map(|&(begin, end)| MemRange::new(pa_init(begin), pa_init(end)))
+            .collect()
+    }
+
+    fn as_tuples(ranges: &[MemRange]) -> Vec<(usize, usize)> {
+        ranges
+            .iter()
+            .map(|range| (pa_addr(range.begin), pa_addr(range.end)))
+            .collect()
+    }
+
+    #[test]
+    fn exclude_initrd() {
+        let mut ranges = mem_ranges(&[(0, 4 * MB), (8 * MB, 16 * MB), (20 * MB, 24 * MB)]);
+
+        // The pages covering the range are removed, splitting the range it is in.
+        exclude_mem_range(
+            &mut ranges,
+            pa_init(10 * MB + 0x10),
+            pa_init(12 * MB - 0x10),
+        );
+        assert_eq!(
+            as_tuples(&ranges),
+            [
+                (0, 4 * MB),
+                (8 * MB, 10 * MB),
+                (12 * MB, 16 * MB),
+                (20 * MB, 24 * MB)
+            ]
+        );
+
+        // A range across several ranges trims them, or empties those it covers.
+        exclude_mem_range(&mut ranges, pa_init(2 * MB), pa_init(21 * MB));
+        assert_eq!(
+            as_tuples(&ranges),
+            [
+                (0, 2 * MB),
+                (10 * MB, 10 * MB),
+                (16 * MB, 16 * MB),
+                (21 * MB, 24 * MB)
+            ]
         );
 
-        let secondary_entry = ipa_from_pa(secondary_mem_begin);
-        vcpu_secondary_reset_and_start(
-            &mut vm.vcpus[0],
-            secondary_entry,
-            pa_difference(secondary_mem_begin, secondary_mem_end) as uintreg_t,
+        // Without an entry to spare, the smaller part of a split range is dropped.
+        let layout: Vec<(usize, usize)> = (0..MAX_MEM_RANGES)
+            .map(|i| (i * 8 * MB, i * 8 * MB + 4 * MB))
+            .collect();
+        let mut ranges = mem_ranges(&layout);
+        exclude_mem_range(&mut ranges, pa_init(MB), pa_init(2 * MB));
+        assert_eq!(
+            as_tuples(&ranges[..2]),
+            [(2 * MB, 4 * MB), (8 * MB, 12 * MB)]
         );
+        assert_eq!(ranges.len(), MAX_MEM_RANGES);
     }
 
-    // Add newly reserved areas to update params by looking at the difference
-    // between the available ranges from the original params and the updated
-    // mem_ranges_available. We assume that the number and order of available
-    // ranges is the same, i.e. we don't remove any ranges above only make them
-    // smaller.
-    update_reserved_ranges(
-        update,
-        &params.mem_ranges[0..params.mem_ranges_count],
-        &mem_ranges_available,
-    )
+    fn carve_out(
+        ranges: &mut ArrayVec<[MemRange; MAX_MEM_RANGES]>,
+        size: usize,
+    ) -> Result<(usize, usize), ()> {
+        carve_out_mem_range(ranges, size as u64).map(|(begin, end)| (pa_addr(begin), pa_addr(end)))
+    }
+
+    #[test]
+    fn carve_out_best_fit() {
+        let mut ranges = mem_ranges(&[(0, 64 * MB), (64 * MB, 72 * MB), (80 * MB, 84 * MB)]);
+
+        // Both of the later ranges fit, and the last is the smallest.
+        assert_eq!(carve_out(&mut ranges, 4 * MB), Ok((80 * MB, 84 * MB)));
+        assert_eq!(
+            as_tuples(&ranges),
+            [(0, 64 * MB), (64 * MB, 72 * MB), (84 * MB, 84 * MB)]
+        );
+
+        assert_eq!(carve_out(&mut ranges, 6 * MB), Ok((66 * MB, 72 * MB)));
+        assert_eq!(carve_out(&mut ranges, 2 * MB), Ok((64 * MB, 66 * MB)));
+        assert_eq!(carve_out(&mut ranges, 65 * MB), Err(()));
+        assert_eq!(
+            as_tuples(&ranges),
+            [(0, 64 * MB), (66 * MB, 66 * MB), (84 * MB, 84 * MB)]
+        );
+    }
+
+    #[test]
+    fn carve_out_prefers_aligned() {
+        // The top of the range isn't 2MB aligned, so the memory is taken from the middle of it.
+        let mut ranges = mem_ranges(&[(0x100000, 0x1001000)]);
+        assert_eq!(carve_out(&mut ranges, 4 * MB), Ok((0xc00000, 0x1000000)));
+        assert_eq!(
+            as_tuples(&ranges),
+            [(0x100000, 0xc00000), (0x1000000, 0x1001000)]
+        );
+
+        // Too small for a block, so it is page aligned at the top of the range it fits.
+        assert_eq!(carve_out(&mut ranges, 0x3000), Ok((0xbfd000, 0xc00000)));
+
+        // A range which fits at 2MB alignment is chosen over a smaller one which doesn't.
+        let mut ranges = mem_ranges(&[(0x1000, 0x201000), (0x400000, 0x800000)]);
+        assert_eq!(carve_out(&mut ranges, 2 * MB), Ok((0x600000, 0x800000)));
+
+        // Large VMs are 1GB aligned.
+        let mut ranges = mem_ranges(&[(0, 3 * GB + 4 * MB), (4 * GB, 4 * GB + GB / 2)]);
+        assert_eq!(
+            carve_out(&mut ranges, GB + 2 * MB),
+            Ok((2 * GB, 3 * GB + 2 * MB))
+        );
+        assert_eq!(
+            as_tuples(&ranges),
+            [
+                (0, 2 * GB),
+                (3 * GB + 2 * MB, 3 * GB + 4 * MB),
+                (4 * GB, 4 * GB + GB / 2)
+            ]
+        );
+
+        // If none fits at 1GB alignment, 2MB alignment is next.
+        let mut ranges = mem_ranges(&[(GB + MB, 2 * GB + 8 * MB)]);
+        assert_eq!(
+            carve_out(&mut ranges, GB + 2 * MB),
+            Ok((GB + 6 * MB, 2 * GB + 8 * MB))
+        );
+    }
+
+    #[test]
+    fn carve_out_fragmented() {
+        // Fill all the entries with 3MB ranges starting 1MB past a 2MB boundary.
+        let layout: Vec<(usize, usize)> = (0..MAX_MEM_RANGES)
+            .map(|i| (i * 8 * MB + MB, i * 8 * MB + 4 * MB))
+            .collect();
+        let mut ranges = mem_ranges(&layout);
+        assert!(ranges.is_full());
+
+        // Taking 2MB aligned memory from the middle would need another entry, so it is taken from
+        // the top of the first range instead.
+        assert_eq!(carve_out(&mut ranges, 2 * MB), Ok((2 * MB, 4 * MB)));
+        assert_eq!(ranges.len(), MAX_MEM_RANGES);
+        assert_eq!(as_tuples(&ranges[..2]), [(MB, 2 * MB), (9 * MB, 12 * MB)]);
+
+        // The first range is now the best fit for a page.
+        assert_eq!(
+            carve_out(&mut ranges, PAGE_SIZE),
+            Ok((2 * MB - PAGE_SIZE, 2 * MB))
+        );
+
+        // Nothing is large enough.
+        let before = as_tuples(&ranges);
+        assert_eq!(carve_out(&mut ranges, 3 * MB + PAGE_SIZE), Err(()));
+        assert_eq!(as_tuples(&ranges), before);
+
+        // Use up all the memory.
+        for i in 1..MAX_MEM_RANGES {
+            assert_eq!(
+                carve_out(&mut ranges, 3 * MB),
+                Ok((i * 8 * MB + MB, i * 8 * MB + 4 * MB))
+            );
+        }
+        assert_eq!(
+            carve_out(&mut ranges, MB - PAGE_SIZE),
+            Ok((MB, 2 * MB - PAGE_SIZE))
+        );
+        assert_eq!(carve_out(&mut ranges, PAGE_SIZE), Err(()));
+    }
+
+    #[test]
+    fn carve_out_splits_until_full() {
+        let layout: Vec<(usize, usize)> = (0..MAX_MEM_RANGES - 1)
+            .map(|i| (i * 8 * MB + MB, i * 8 * MB + 7 * MB))
+            .collect();
+        let mut ranges = mem_ranges(&layout);
+
+        // Taking 2MB aligned memory from the middle of a range uses the last entry.
+        assert_eq!(carve_out(&mut ranges, 2 * MB), Ok((4 * MB, 6 * MB)));
+        assert_eq!(
+            as_tuples(&ranges[..3]),
+            [(MB, 4 * MB), (6 * MB, 7 * MB), (9 * MB, 15 * MB)]
+        );
+        assert!(ranges.is_full());
+
+        // Memory is now only taken from the ends of ranges, so it can't be 2MB aligned.
+        assert_eq!(carve_out(&mut ranges, 4 * MB), Ok((11 * MB, 15 * MB)));
+        assert_eq!(
+            as_tuples(&ranges[2..4]),
+            [(9 * MB, 11 * MB), (17 * MB, 23 * MB)]
+        );
+        assert!(ranges.is_full());
+    }
+
+    fn carve_out_several(
+        ranges: &mut ArrayVec<[MemRange; MAX_MEM_RANGES]>,
+        size: usize,
+        first_size_min: usize,
+    ) -> Result<Vec<(usize, usize)>, ()> {
+        carve_out_mem_ranges(ranges, size as u64, first_size_min as u64)
+            .map(|found| as_tuples(&found))
+    }
+
+    #[test]
+    fn carve_out_several_ranges() {
+        // A single range is used if there is one.
+        let mut ranges = mem_ranges(&[(MB, 4 * MB), (8 * MB, 16 * MB)]);
+        assert_eq!(
+            carve_out_several(&mut ranges, 4 * MB, MB),
+            Ok(vec![(12 * MB, 16 * MB)])
+        );
+
+        // Otherwise the largest range is taken whole and the rest placed as usual.
+        let mut ranges = mem_ranges(&[(MB, 4 * MB), (8 * MB, 10 * MB), (16 * MB, 17 * MB)]);
+        assert_eq!(
+            carve_out_several(&mut ranges, 5 * MB, 3 * MB),
+            Ok(vec![(MB, 4 * MB), (8 * MB, 10 * MB)])
+        );
+        assert_eq!(
+            as_tuples(&ranges),
+            [(4 * MB, 4 * MB), (10 * MB, 10 * MB), (16 * MB, 17 * MB)]
+        );
+
+        // The kernel must fit in the first range.
+        let mut ranges = mem_ranges(&[(MB, 4 * MB), (8 * MB, 10 * MB)]);
+        assert_eq!(carve_out_several(&mut ranges, 5 * MB, 4 * MB), Err(()));
+        assert_eq!(as_tuples(&ranges), [(MB, 4 * MB), (8 * MB, 10 * MB)]);
+
+        // There isn't enough memory in total.
+        assert_eq!(carve_out_several(&mut ranges, 6 * MB, MB), Err(()));
+        assert_eq!(as_tuples(&ranges), [(MB, 4 * MB), (8 * MB, 10 * MB)]);
+    }
+
+    #[test]
+    fn carve_out_several_fragmented() {
+        // Fill all the entries with 1MB ranges, the first with a begin which isn't page aligned.
+        let mut layout: Vec<(usize, usize)> = (0..MAX_MEM_RANGES)
+            .map(|i| (i * 4 * MB + MB, i * 4 * MB + 2 * MB))
+            .collect();
+        layout[0].0 -= 0x10;
+        let mut ranges = mem_ranges(&layout);
+
+        // The memory can be made up of at most MAX_VM_MEM_RANGES ranges.
+        let before = as_tuples(&ranges);
+        assert_eq!(
+            carve_out_several(&mut ranges, (MAX_VM_MEM_RANGES + 1) * MB, PAGE_SIZE),
+            Err(())
+        );
+        assert_eq!(as_tuples(&ranges), before);
+
+        let found = carve_out_several(&mut ranges, MAX_VM_MEM_RANGES * MB, PAGE_SIZE).unwrap();
+        assert_eq!(found.len(), MAX_VM_MEM_RANGES);
+        assert!(found
+            .iter()
+            .all(|&(begin, end)| begin % PAGE_SIZE == 0 && end - begin == MB));
+
+        // The rest of the memory can still be found, except for the part of the first range below
+        // its first page.
+        while carve_out_several(&mut ranges, MB, MB).is_ok() {}
+        assert!(ranges
+            .iter()
+            .all(|range| pa_addr(range.end) - pa_addr(range.begin) < MB));
+        assert_eq!(
+            ranges
+                .iter()
+                .filter(|range| pa_addr(range.begin) != pa_addr(range.end))
+                .count(),
+            1
+        );
+    }
+
+    #[test]
+    fn reserved_ranges_merged() {
+        let mut carved = ArrayVec::new();
+        let ranges = mem_ranges(&[
+            (6 * MB, 8 * MB),
+            (2 * MB, 4 * MB),
+            (10 * MB, 12 * MB),
+            (4 * MB, 6 * MB),
+        ]);
+
+        assert_eq!(merge_mem_ranges(&mut carved, &ranges, 2), Ok(()));
+        assert_eq!(as_tuples(&carved), [(2 * MB, 8 * MB), (10 * MB, 12 * MB)]);
+
+        // Filling the gap between two ranges joins them.
+        let gap = mem_ranges(&[(8 * MB, 10 * MB), (14 * MB, 16 * MB)]);
+        assert_eq!(merge_mem_ranges(&mut carved, &gap, 2), Ok(()));
+        assert_eq!(as_tuples(&carved), [(2 * MB, 12 * MB), (14 * MB, 16 * MB)]);
+
+        // Too many ranges leaves them unchanged.
+        let apart = mem_ranges(&[(12 * MB, 13 * MB), (20 * MB, 22 * MB)]);
+        assert_eq!(merge_mem_ranges(&mut carved, &apart, 2), Err(()));
+        assert_eq!(as_tuples(&carved), [(2 * MB, 12 * MB), (14 * MB, 16 * MB)]);
+
+        let mut update = BootParamsUpdate::new(pa_init(0), pa_init(0));
+        assert_eq!(update_reserved_ranges(&mut update, &carved), Ok(()));
+        assert_eq!(
+            as_tuples(&update.reserved_ranges[..update.reserved_ranges_count]),
+            [(2 * MB, 12 * MB), (14 * MB, 16 * MB)]
+        );
+
+        let carved: Vec<MemRange> = (0..MAX_MEM_RANGES)
+            .map(|i| MemRange::new(pa_init(i * 2 * MB), pa_init(i * 2 * MB + MB)))
+            .collect();
+        assert_eq!(update_reserved_ranges(&mut update, &carved), Err(()));
+    }
 }
@@ -0,0 +1,512 @@
+/*
+ * Copyright 2019 Jeehoon Kang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Decompression of LZ4 images, in the frame format written by the `lz4` tool and in the legacy
+//! format used for compressed Linux kernels.
+//!
+//! The optional header, block and content checksums are skipped rather than verified. Every read
+//! and write is bounds-checked, so malformed data is an error rather than a memory safety issue.
+
+/// The magic number starting an LZ4 frame.
+const FRAME_MAGIC: u32 = 0x184D_2204;
+
+/// The magic number starting legacy LZ4 data.
+const LEGACY_MAGIC: u32 = 0x184C_2102;
+
+/// The largest amount of data a block of legacy LZ4 data decompresses to.
+const LEGACY_BLOCK_MAX: usize = 8 << 20;
+
+const FLG_VERSION_MASK: u8 = 0xc0;
+const FLG_VERSION: u8 = 0x40;
+const FLG_BLOCK_CHECKSUM: u8 = 1 << 4;
+const FLG_CONTENT_SIZE: u8 = 1 << 3;
+const FLG_CONTENT_CHECKSUM: u8 = 1 << 2;
+const FLG_DICT_ID: u8 = 1 << 0;
+
+/// The bit of a frame block's size marking the block as stored uncompressed.
+const BLOCK_UNCOMPRESSED: u32 = 1 << 31;
+
+/// The smallest match length, which is not included in the length encoded in a sequence.
+const MIN_MATCH: usize = 4;
+
+/// A cursor over the compressed data.
+struct Input<'a> {
+    data: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> Input<'a> {
+    fn is_empty(&self) -> bool {
+        self.pos == self.data.len()
+    }
+
+    fn read(&mut self, len: usize) -> Result<&'a [u8], ()> {
+        if len > self.data.len() - self.pos {
+            return Err(());
+        }
+
+        let bytes = &self.data[self.pos..self.pos + len];
+        self.pos += len;
+        Ok(bytes)
+    }
+
+    fn read_u8(&mut self) -> Result<u8, ()> {
+        Ok(self.read(1)?[0])
+    }
+
+    fn read_u16(&mut self) -> Result<u16, ()> {
+        let bytes = self.read(2)?;
+        Ok(u16::from(bytes[0]) | u16::from(bytes[1]) << 8)
+    }
+
+    fn read_u32(&mut self) -> Result<u32, ()> {
+        let low = self.read_u16()?;
+        let high = self.read_u16()?;
+        Ok(u32::from(low) | u32::from(high) << 16)
+    }
+
+    fn peek_u32(&self) -> Option<u32> {
+        let mut input = Input {
+            data: self.data,
+            pos: self.pos,
+        };
+        input.read_u32().ok()
+    }
+
+    /// Reads the rest of a length whose first part is 15, in the extension bytes following it.
+    fn read_length(&mut self, base: usize) -> Result<usize, ()> {
+        if base != 15 {
+            return Ok(base);
+        }
+
+        let mut len = base;
+        loop {
+            let byte = self.read_u8()?;
+            len = len.checked_add(byte as usize).ok_or(())?;
+            if byte != 255 {
+                return Ok(len);
+            }
+        }
+    }
+}
+
+/// Returns whether the given data is LZ4 compressed, going by its magic number.
+pub fn is_lz4(data: &[u8]) -> bool {
+    let input = Input { data, pos: 0 };
+
+    match input.peek_u32() {
+        Some(FRAME_MAGIC) | Some(LEGACY_MAGIC) => true,
+        _ => false,
+    }
+}
+
+/// Decompresses a block of LZ4 sequences to `out` at `out_pos`, and returns the position after
+/// the decompressed data. Matches may refer back to the data decompressed before `out_pos`.
+fn decompress_block(block: &[u8], out: &mut [u8], mut out_pos: usize) -> Result<usize, ()> {
+    let mut input = Input {
+        data: block,
+        pos: 0,
+    };
+
+    loop {
+        let token = input.read_u8()?;
+
+        let literals_len = input.read_length((token >> 4) as usize)?;
+        let literals = input.read(literals_len)?;
+        let out_literals = out
+            .get_mut(out_pos..out_pos.checked_add(literals_len).ok_or(())?)
+            .ok_or(())?;
+        out_literals.copy_from_slice(literals);
+        out_pos += literals_len;
+
+        // The last sequence of a block has only literals.
+        if input.is_empty() {
+            return Ok(out_pos);
+        }
+
+        let offset = input.read_u16()? as usize;
+        if offset == 0 || offset > out_pos {
+            return Err(());
+        }
+
+        let match_len = input.read_length((token & 0xf) as usize)? + MIN_MATCH;
+        let match_end = out_pos.checked_add(match_len).ok_or(())?;
+        if match_end > out.len() {
+            return Err(());
+        }
+
+        let match_begin = out_pos - offset;
+        if offset >= match_len {
+            out.copy_within(match_begin..match_begin + match_len, out_pos);
+        } else {
+            // The match overlaps the data it produces, repeating the last `offset` bytes.
+            for i in 0..match_len {
+                out[out_pos + i] = out[match_begin + i];
+            }
+        }
+        out_pos = match_end;
+    }
+}
+
+/// Returns the size of the data a block of LZ4 sequences decompresses to, without checking where
+/// its matches refer back to.
+fn block_size(block: &[u8]) -> Result<usize, ()> {
+    let mut input = Input {
+        data: block,
+        pos: 0,
+    };
+    let mut size: usize = 0;
+
+    loop {
+        let token = input.read_u8()?;
+
+        let literals_len = input.read_length((token >> 4) as usize)?;
+        input.read(literals_len)?;
+        size = size.checked_add(literals_len).ok_or(())?;
+
+        // The last sequence of a block has only literals.
+        if input.is_empty() {
+            return Ok(size);
+        }
+
+        input.read_u16()?;
+        let match_len = input.read_length((token & 0xf) as usize)? + MIN_MATCH;
+        size = size.checked_add(match_len).ok_or(())?;
+    }
+}
+
+/// Calls `f` on each block of an LZ4 frame following its magic number, with whether the block is
+/// stored uncompressed.
+fn frame_blocks<F>(input: &mut Input, mut f: F) -> Result<(), ()>
+where
+    F: FnMut(&[u8], bool) -> Result<(), ()>,
+{
+    let flg = input.read_u8()?;
+    let _bd = input.read_u8()?;
+
+    if flg & FLG_VERSION_MASK != FLG_VERSION || flg & FLG_DICT_ID != 0 {
+        return Err(());
+    }
+
+    if flg & FLG_CONTENT_SIZE != 0 {
+        input.read(8)?;
+    }
+
+    // Skip the header checksum.
+    input.read_u8()?;
+
+    loop {
+        let block_size = input.read_u32()?;
+        if block_size == 0 {
+            break;
+        }
+
+        let block = input.read((block_size & !BLOCK_UNCOMPRESSED) as usize)?;
+        f(block, block_size & BLOCK_UNCOMPRESSED != 0)?;
+
+        if flg & FLG_BLOCK_CHECKSUM != 0 {
+            input.read(4)?;
+        }
+    }
+
+    if flg & FLG_CONTENT_CHECKSUM != 0 {
+        input.read(4)?;
+    }
+
+    Ok(())
+}
+
+/// Calls `f` on each block of legacy LZ4 data following its magic number. It ends at the end of
+/// the input, or at the magic number of data concatenated to it.
+fn legacy_blocks<F>(input: &mut Input, mut f: F) -> Result<(), ()>
+where
+    F: FnMut(&[u8]) -> Result<(), ()>,
+{
+    while !input.is_empty() {
+        match input.peek_u32() {
+            Some(FRAME_MAGIC) | Some(LEGACY_MAGIC) => break,
+            _ => (),
+        }
+
+        let block_size = input.read_u32()? as usize;
+        f(input.read(block_size)?)?;
+    }
+
+    Ok(())
+}
+
+/// Decompresses an LZ4 frame following its magic number.
+fn decompress_frame(input: &mut Input, out: &mut [u8]) -> Result<usize, ()> {
+    let mut out_pos: usize = 0;
+
+    frame_blocks(input, |block, uncompressed| {
+        if uncompressed {
+            let out_block = out
+                .get_mut(out_pos..out_pos.checked_add(block.len()).ok_or(())?)
+                .ok_or(())?;
+            out_block.copy_from_slice(block);
+            out_pos += block.len();
+        } else {
+            out_pos = decompress_block(block, out, out_pos)?;
+        }
+        Ok(())
+    })?;
+
+    Ok(out_pos)
+}
+
+/// Decompresses legacy LZ4 data following its magic number.
+fn decompress_legacy(input: &mut Input, out: &mut [u8]) -> Result<usize, ()> {
+    let mut out_pos: usize = 0;
+
+    legacy_blocks(input, |block| {
+        let block_begin = out_pos;
+        out_pos = decompress_block(block, out, out_pos)?;
+
+        if out_pos - block_begin > LEGACY_BLOCK_MAX {
+            return Err(());
+        }
+        Ok(())
+    })?;
+
+    Ok(out_pos)
+}
+
+/// Returns the size of the data the given LZ4 data decompresses to, without decompressing it.
+/// Fails if the data is malformed, though `decompress` may still find errors this doesn't.
+pub fn decompressed_size(data: &[u8]) -> Result<usize, ()> {
+    let mut input = Input { data, pos: 0 };
+    let mut size: usize = 0;
+    let mut add = |len: usize| -> Result<(), ()> {
+        size = size.checked_add(len).ok_or(())?;
+        Ok(())
+    };
+
+    match input.read_u32()? {
+        FRAME_MAGIC => frame_blocks(&mut input, |block, uncompressed| {
+            add(if uncompressed {
+                block.len()
+            } else {
+                block_size(block)?
+            })
+        })?,
+        LEGACY_MAGIC => legacy_blocks(&mut input, |block| add(block_size(block)?))?,
+        _ => return Err(()),
+    }
+
+    Ok(size)
+}
+
+/// Decompresses the given LZ4 data to the start of `out`, and returns the size of the
+/// decompressed data. Fails if the data is malformed or decompresses to more than fits in `out`.
+pub fn decompress(data: &[u8], out: &mut [u8]) -> Result<usize, ()> {
+    let mut input = Input { data, pos: 0 };
+
+    match input.read_u32()? {
+        FRAME_MAGIC => decompress_frame(&mut input, out),
+        LEGACY_MAGIC => decompress_legacy(&mut input, out),
+        _ => Err(()),
+    }
+}
+
+#[cfg(test)]
+mod test {
+    extern crate std;
+    use std::vec;
+    use std::vec::Vec;
+
+    use super::*;
+
+    fn push_u32(data: &mut Vec<u8>, value: u32) {
+        data.extend_from_slice(&value.to_le_bytes());
+    }
+
+    /// Appends a length to a sequence, given the token holding its first part.
+    fn push_length(data: &mut Vec<u8>, mut len: usize) {
+        if len < 15 {
+            return;
+        }
+
+        len -= 15;
+        while len >= 255 {
+            data.push(255);
+            len -= 255;
+        }
+        data.push(len as u8);
+    }
+
+    /// Appends a sequence of literals followed by a match, if there is one.
+    fn push_sequence(block: &mut Vec<u8>, literals: &[u8], matched: Option<(u16, usize)>) {
+        let match_len = matched.map_or(0, |(_, len)| len - MIN_MATCH);
+        block.push((literals.len().min(15) << 4 | match_len.min(15)) as u8);
+        push_length(block, literals.len());
+        block.extend_from_slice(literals);
+
+        if let Some((offset, _)) = matched {
+            block.extend_from_slice(&offset.to_le_bytes());
+            push_length(block, match_len);
+        }
+    }
+
+    /// Returns a block of "abc" followed by a match repeating it `count` times, and the data it
+    /// decompresses to.
+    fn repeating_block(count: usize) -> (Vec<u8>, Vec<u8>) {
+        let mut block = Vec::new();
+        push_sequence(&mut block, b"abc", Some((3, 3 * count)));
+        push_sequence(&mut block, b"xyz", None);
+
+        let mut expected = b"abc".repeat(count + 1);
+        expected.extend_from_slice(b"xyz");
+        (block, expected)
+    }
+
+    fn frame(flg: u8, blocks: &[(&[u8], bool)]) -> Vec<u8> {
+        let mut data = Vec::new();
+        push_u32(&mut data, FRAME_MAGIC);
+        data.push(flg);
+        data.push(0x70);
+        if flg & FLG_CONTENT_SIZE != 0 {
+            data.extend_from_slice(&[0; 8]);
+        }
+        data.push(0);
+
+        for (block, compressed) in blocks {
+            let size = block.len() as u32;
+            push_u32(
+                &mut data,
+                if *compressed {
+                    size
+                } else {
+                    size | BLOCK_UNCOMPRESSED
+                },
+            );
+            data.extend_from_slice(block);
+            if flg & FLG_BLOCK_CHECKSUM != 0 {
+                push_u32(&mut data, 0);
+            }
+        }
+
+        push_u32(&mut data, 0);
+        if flg & FLG_CONTENT_CHECKSUM != 0 {
+            push_u32(&mut data, 0);
+        }
+        data
+    }
+
+    fn check(data: &[u8], expected: &[u8]) {
+        assert!(is_lz4(data));
+        assert_eq!(decompressed_size(data), Ok(expected.len()));
+
+        let mut out = vec![0; expected.len()];
+        assert_eq!(decompress(data, &mut out), Ok(expected.len()));
+        assert_eq!(out, expected);
+
+        // It doesn't write past the end of the output.
+        if !expected.is_empty() {
+            let mut out = vec![0; expected.len() - 1];
+            assert_eq!(decompress(data, &mut out), Err(()));
+        }
+    }
+
+    #[test]
+    fn lz4_frame() {
+        let (block, expected) = repeating_block(1000);
+        check(&frame(FLG_VERSION, &[(&block, true)]), &expected);
+
+        // With the optional fields, and an uncompressed block after it.
+        let flg = FLG_VERSION | FLG_CONTENT_SIZE | FLG_BLOCK_CHECKSUM | FLG_CONTENT_CHECKSUM;
+        let mut expected2 = expected.clone();
+        expected2.extend_from_slice(b"stored");
+        check(
+            &frame(flg, &[(&block, true), (b"stored", false)]),
+            &expected2,
+        );
+
+        // A block can refer back to the previous one.
+        let mut linked = Vec::new();
+        push_sequence(&mut linked, b"", Some((6, 6)));
+        push_sequence(&mut linked, b"!", None);
+        let mut expected3 = expected.clone();
+        expected3.extend_from_slice(b"abcxyz!");
+        check(
+            &frame(FLG_VERSION, &[(&block, true), (&linked, true)]),
+            &expected3,
+        );
+
+        check(&frame(FLG_VERSION, &[]), &[]);
+    }
+
+    #[test]
+    fn lz4_legacy() {
+        let (block, expected) = repeating_block(100);
+        let mut data = Vec::new();
+        push_u32(&mut data, LEGACY_MAGIC);
+        for _ in 0..2 {
+            push_u32(&mut data, block.len() as u32);
+            data.extend_from_slice(&block);
+        }
+        check(&data, &expected.repeat(2));
+
+        // It stops at data concatenated to it.
+        push_u32(&mut data, LEGACY_MAGIC);
+        push_u32(&mut data, block.len() as u32);
+        data.extend_from_slice(&block);
+        check(&data, &expected.repeat(2));
+    }
+
+    #[test]
+    fn lz4_malformed() {
+        assert!(!is_lz4(b"\x7fELF"));
+        assert!(!is_lz4(b"\x04\x22"));
+        assert_eq!(decompress(b"\x7fELF", &mut [0; 16]), Err(()));
+        assert_eq!(decompressed_size(b"\x7fELF"), Err(()));
+
+        // A match before the start of the output.
+        let mut block = Vec::new();
+        push_sequence(&mut block, b"ab", Some((3, 4)));
+        push_sequence(&mut block, b"", None);
+        assert_eq!(
+            decompress(&frame(FLG_VERSION, &[(&block, true)]), &mut [0; 64]),
+            Err(())
+        );
+
+        // A match with offset zero.
+        let mut block = Vec::new();
+        push_sequence(&mut block, b"ab", Some((0, 4)));
+        push_sequence(&mut block, b"", None);
+        assert_eq!(
+            decompress(&frame(FLG_VERSION, &[(&block, true)]), &mut [0; 64]),
+            Err(())
+        );
+
+        // An unsupported version, or a dictionary.
+        let (block, expected) = repeating_block(10);
+        let mut out = vec![0; expected.len()];
+        for flg in &[0, FLG_VERSION | FLG_DICT_ID] {
+            assert_eq!(
+                decompress(&frame(*flg, &[(&block, true)]), &mut out),
+                Err(())
+            );
+        }
+
+        // Truncated anywhere.
+        let data = frame(FLG_VERSION, &[(&block, true)]);
+        for len in 0..data.len() {
+            assert_eq!(decompress(&data[..len], &mut out), Err(()), "{}", len);
+            assert_eq!(decompressed_size(&data[..len]), Err(()), "{}", len);
+        }
+    }
+}
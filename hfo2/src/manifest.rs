@@ -75,6 +75,16 @@ pub struct ManifestVm {
     pub kernel_filename: [u8; MANIFEST_MAX_STRING_LENGTH],
     pub mem_size: u64,
     pub vcpu_count: spci_vcpu_count_t,
+
+    /// Whether to defer loading the VM until it first runs, rather than loading it at boot.
+    pub lazy_load: bool,
+
+    /// Whether to keep the VM's image so that the primary VM can reset the VM.
+    pub restartable: bool,
+
+    /// Whether to report stage-2 faults on the VM's memory it doesn't own to the primary VM,
+    /// rather than aborting the VM.
+    pub demand_paged: bool,
 }
 
 /// Hafnium manifest parsed from FDT.
@@ -143,6 +153,11 @@ impl<'a> FdtNode<'a> {
         fdt_parse_number(data).ok_or(Error::MalformedInteger)
     }
 
+    #[inline(never)]
+    fn read_bool(&self, property: *const u8) -> bool {
+        self.read_property(property).is_ok()
+    }
+
     #[inline(never)]
     fn read_u16(&self, property: *const u8) -> Result<u16, Error> {
         let value = self.read_u64(property)?;
@@ -222,28 +237,35 @@ impl ManifestVm {
 
         let mut kernel_filename: [u8; MANIFEST_MAX_STRING_LENGTH] = Default::default();
 
-        let (mem_size, vcpu_count) = if vm_id != HF_PRIMARY_VM_ID {
-            node.read_string("kernel_filename\0".as_ptr(), &mut kernel_filename)?;
-            (
-                node.read_u64("mem_size\0".as_ptr())?,
-                node.read_u16("vcpu_count\0".as_ptr())?,
-            )
-        } else {
-            (0, 0)
-        };
+        let (mem_size, vcpu_count, lazy_load, restartable, demand_paged) =
+            if vm_id != HF_PRIMARY_VM_ID {
+                node.read_string("kernel_filename\0".as_ptr(), &mut kernel_filename)?;
+                (
+                    node.read_u64("mem_size\0".as_ptr())?,
+                    node.read_u16("vcpu_count\0".as_ptr())?,
+                    node.read_bool("lazy_load\0".as_ptr()),
+                    node.read_bool("restartable\0".as_ptr()),
+                    node.read_bool("demand_paged\0".as_ptr()),
+                )
+            } else {
+                (0, 0, false, false, false)
+            };
 
         Ok(Self {
             debug_name,
             kernel_filename,
             mem_size,
             vcpu_count,
+            lazy_load,
+            restartable,
+            demand_paged,
         })
     }
 }
 
 impl Manifest {
     /// Parse manifest from FDT.
-    pub fn init<'a>(&mut self, fdt: &FdtNode<'a>) -> Result<(), Error> {
+    pub fn init<'a>(&mut self, fdt: &FdtIndex<'a, '_>) -> Result<(), Error> {
         let mut vm_name_buf = Default::default();
         let mut found_primary_vm = false;
         unsafe {
@@ -251,10 +273,10 @@ impl Manifest {
         }
 
         // Find hypervisor node.
-        let mut hyp_node = fdt.clone();
-        hyp_node
-            .find_child("hypervisor\0".as_ptr())
+        let hyp_slot = fdt
+            .find_child(fdt.root(), b"hypervisor")
             .ok_or(Error::NoHypervisorFdtNode)?;
+        let hyp_node = fdt.node(hyp_slot);
 
         // Check "compatible" property.
         let compatible_list = StringList::read_from(&hyp_node, "compatible\0".as_ptr())?;
@@ -264,10 +286,9 @@ impl Manifest {
 
         // Iterate over reserved VM IDs and check no such nodes exist.
         for vm_id in 0..HF_VM_ID_OFFSET {
-            let mut vm_node = hyp_node.clone();
             let vm_name = generate_vm_node_name(&mut vm_name_buf, vm_id);
 
-            if vm_node.find_child(vm_name.as_ptr()).is_some() {
+            if fdt.find_child(hyp_slot, vm_name).is_some() {
                 return Err(Error::ReservedVmId);
             }
         }
@@ -275,12 +296,9 @@ impl Manifest {
         // Iterate over VM nodes until we find one that does not exist.
         for i in 0..=MAX_VMS as spci_vm_id_t {
             let vm_id = HF_VM_ID_OFFSET + i;
-            let mut vm_node = hyp_node.clone();
             let vm_name = generate_vm_node_name(&mut vm_name_buf, vm_id);
-
-            if vm_node.find_child(vm_name.as_ptr()).is_none() {
-                break;
-            }
+            let vm_node = some_or!(fdt.find_child(hyp_slot, vm_name), break);
+            let vm_node = fdt.node(vm_node);
 
             if i == MAX_VMS as spci_vm_id_t {
                 return Err(Error::TooManyVms);
@@ -396,6 +414,23 @@ mod test {
             self.integer_property("mem_size", value)
         }
 
+        fn lazy_load(&mut self) -> &mut Self {
+            self.empty_property("lazy_load")
+        }
+
+        fn restartable(&mut self) -> &mut Self {
+            self.empty_property("restartable")
+        }
+
+        fn demand_paged(&mut self) -> &mut Self {
+            self.empty_property("demand_paged")
+        }
+
+        fn empty_property(&mut self, name: &str) -> &mut Self {
+            write!(self.dts, "{};\n", name).unwrap();
+            self
+        }
+
         fn string_property(&mut self, name: &str, value: &str) -> &mut Self {
             write!(self.dts, "{} = \"{}\";\n", name, value).unwrap();
             self
@@ -414,21 +449,24 @@ mod test {
         }
     }
 
-    fn get_fdt_root<'a>(dtb: &'a [u8]) -> Option<FdtNode<'a>> {
+    fn get_fdt_index<'a, 'b>(
+        dtb: &'a [u8],
+        table: &'b mut [FdtIndexEntry],
+    ) -> Option<FdtIndex<'a, 'b>> {
         let fdt_header = unsafe { &*(dtb.as_ptr() as *const FdtHeader) };
 
-        let mut node = FdtNode::new_root(fdt_header)?;
-        node.find_child("\0".as_ptr());
-        Some(node)
+        let node = FdtNode::new_root(fdt_header)?;
+        FdtIndex::new(&node, table)
     }
 
     #[test]
     fn no_hypervisor_node() {
         let dtb = ManifestDtBuilder::new().build();
 
-        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::NoHypervisorFdtNode);
+        assert_eq!(m.init(&fdt).unwrap_err(), Error::NoHypervisorFdtNode);
     }
 
     #[test]
@@ -438,9 +476,10 @@ mod test {
             .end_child()
             .build();
 
-        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::PropertyNotFound);
+        assert_eq!(m.init(&fdt).unwrap_err(), Error::PropertyNotFound);
     }
 
     #[test]
@@ -451,9 +490,10 @@ mod test {
             .end_child()
             .build();
 
-        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::NotCompatible);
+        assert_eq!(m.init(&fdt).unwrap_err(), Error::NotCompatible);
     }
 
     #[test]
@@ -467,9 +507,10 @@ mod test {
             .end_child()
             .build();
 
-        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        m.init(&fdt_root).unwrap();
+        m.init(&fdt).unwrap();
     }
 
     #[test]
@@ -480,9 +521,10 @@ mod test {
             .end_child()
             .build();
 
-        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::NoPrimaryVm);
+        assert_eq!(m.init(&fdt).unwrap_err(), Error::NoPrimaryVm);
     }
 
     #[test]
@@ -506,12 +548,14 @@ mod test {
         let dtb_last_valid = gen_long_string_dtb(true);
         let dtb_first_invalid = gen_long_string_dtb(false);
 
-        let fdt_root = get_fdt_root(&dtb_last_valid).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb_last_valid, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        m.init(&fdt_root).unwrap();
+        m.init(&fdt).unwrap();
 
-        let fdt_root = get_fdt_root(&dtb_first_invalid).unwrap();
-        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::StringTooLong);
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb_first_invalid, &mut table).unwrap();
+        assert_eq!(m.init(&fdt).unwrap_err(), Error::StringTooLong);
     }
 
     #[test]
@@ -531,9 +575,10 @@ mod test {
             .end_child()
             .build();
 
-        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::ReservedVmId);
+        assert_eq!(m.init(&fdt).unwrap_err(), Error::ReservedVmId);
     }
 
     #[test]
@@ -558,14 +603,16 @@ mod test {
         let dtb_last_valid = gen_vcpu_count_limit_dtb(u16::max_value() as u64);
         let dtb_first_invalid = gen_vcpu_count_limit_dtb(u16::max_value() as u64 + 1);
 
-        let fdt_root = get_fdt_root(&dtb_last_valid).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb_last_valid, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        m.init(&fdt_root).unwrap();
+        m.init(&fdt).unwrap();
         assert_eq!(m.vms.len(), 2);
         assert_eq!(m.vms[1].vcpu_count, u16::max_value());
 
-        let fdt_root = get_fdt_root(&dtb_first_invalid).unwrap();
-        assert_eq!(m.init(&fdt_root).unwrap_err(), Error::IntegerOverflow);
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb_first_invalid, &mut table).unwrap();
+        assert_eq!(m.init(&fdt).unwrap_err(), Error::IntegerOverflow);
     }
 
     #[test]
@@ -581,6 +628,9 @@ mod test {
             .vcpu_count(43)
             .mem_size(0x12345)
             .kernel_filename("second_kernel")
+            .lazy_load()
+            .restartable()
+            .demand_paged()
             .end_child()
             .start_child("vm2")
             .debug_name("first_secondary_vm")
@@ -591,9 +641,10 @@ mod test {
             .end_child()
             .build();
 
-        let fdt_root = get_fdt_root(&dtb).unwrap();
+        let mut table = [FdtIndexEntry::EMPTY; 64];
+        let fdt = get_fdt_index(&dtb, &mut table).unwrap();
         let mut m: Manifest = unsafe { MaybeUninit::uninit().assume_init() };
-        m.init(&fdt_root).unwrap();
+        m.init(&fdt).unwrap();
         assert_eq!(m.vms.len(), 3);
 
         let vm = &m.vms[0];
@@ -604,11 +655,17 @@ mod test {
         assert_eq!(vm.vcpu_count, 42);
         assert_eq!(vm.mem_size, 12345);
         assert_eq!(as_asciz(&vm.kernel_filename), b"first_kernel");
+        assert!(!vm.lazy_load);
+        assert!(!vm.restartable);
+        assert!(!vm.demand_paged);
 
         let vm = &m.vms[2];
         assert_eq!(as_asciz(&vm.debug_name), b"second_secondary_vm");
         assert_eq!(vm.vcpu_count, 43);
         assert_eq!(vm.mem_size, 0x12345);
         assert_eq!(as_asciz(&vm.kernel_filename), b"second_kernel");
+        assert!(vm.lazy_load);
+        assert!(vm.restartable);
+        assert!(vm.demand_paged);
     }
 }
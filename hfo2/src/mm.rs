@@ -62,6 +62,7 @@ extern "C" {
 
     fn arch_mm_invalidate_stage1_range(begin: vaddr_t, end: vaddr_t);
     fn arch_mm_invalidate_stage2_range(begin: ipaddr_t, end: ipaddr_t);
+    fn arch_mm_invalidate_stage2_vm(vm_id: u16, table: paddr_t);
 
     fn arch_mm_mode_to_stage1_attrs(mode: c_int) -> u64;
     fn arch_mm_mode_to_stage2_attrs(mode: c_int) -> u64;
@@ -79,6 +80,7 @@ extern "C" {
     fn arch_mm_init() -> bool;
 
     fn arch_mm_enable(table: paddr_t);
+    pub fn arch_mm_flush_config();
 
     fn arch_mm_combine_table_entry_attrs(table_attrs: u64, block_attrs: u64) -> u64;
 
@@ -136,10 +138,23 @@ bitflags! {
 
         /// Shared
         const SHARED  = 0b0100_0000;
+
+        /// Write-protected for dirty logging. Writable stage-2 memory keeps `W` in its mode, but
+        /// writes to it fault so that they can be logged.
+        const DIRTY_LOG = 0b1000_0000;
+
+        /// Not accessed since its access flag was cleared, which was done so that the first access
+        /// to the memory is logged. The hardware may set the flag itself.
+        const ACCESS_LOG = 0b1_0000_0000;
     }
 }
 
 impl Mode {
+    /// The bits which log accesses to memory rather than change what may access it.
+    pub const LOG: Mode = Mode {
+        bits: Mode::DIRTY_LOG.bits | Mode::ACCESS_LOG.bits,
+    };
+
     /// Check that the mode indicates memory that is vaid, owned and exclusive.
     #[inline]
     pub fn valid_owned_exclusive(self) -> bool {
@@ -297,6 +312,21 @@ impl Stage for Stage2 {
     }
 }
 
+/// Invalidates the whole TLB of the given VM, after its page table was updated while another VM's
+/// was current. Updates only invalidate the TLB of the current VM by themselves. `table` is the
+/// root of the VM's page table.
+pub fn stage2_invalidate_vm(vm_id: spci_vm_id_t, table: paddr_t) {
+    if hypervisor()
+        .memory_manager
+        .stage2_invalidate
+        .load(Ordering::Relaxed)
+    {
+        unsafe {
+            arch_mm_invalidate_stage2_vm(vm_id, table);
+        }
+    }
+}
+
 /// Page table entry.
 #[repr(C)]
 struct PageTableEntry {
@@ -444,7 +474,7 @@ impl PageTableEntry {
         // Allocate a new table.
         let page = mpool
             .alloc()
-            .map_err(|_| dlog!("Failed to allocate memory for page table\n"))?;
+            .map_err(|_| dlog_error!("Failed to allocate memory for page table\n"))?;
 
         // Initialise entries in the new table.
         let level_below = level - 1;
@@ -669,20 +699,17 @@ impl RawPageTable {
         Ok(())
     }
 
-    /// Gets the attributes applied to the given range of stage-2 addresses at the given level.
-    ///
-    /// The `got_attrs` argument is initially passed as false until `attrs` contains attributes of
-    /// the memory region at which point it is passed as true.
-    ///
-    /// The value returned in `attrs` is only valid if the function returns true.
+    /// Gets the mode applied to the given range of stage-2 addresses at the given level, ignoring
+    /// the `ignored` bits.
     ///
-    /// Returns true if the whole range has the same attributes and false otherwise.
-    pub fn get_attrs_level(
+    /// Returns the mode if the whole range has the same mode, or an error otherwise.
+    fn get_mode_level<S: Stage>(
         &self,
         begin: ptable_addr_t,
         end: ptable_addr_t,
         level: u8,
-    ) -> Result<u64, ()> {
+        ignored: Mode,
+    ) -> Result<Mode, ()> {
         let ptes = self[addr::index(begin, level)..].iter();
         let begins = BlockIter::new(
             begin,
@@ -695,14 +722,80 @@ impl RawPageTable {
         ptes.zip(begins)
             .map(|(pte, begin)| {
                 if let Ok(table) = pte.as_table(level) {
-                    table.get_attrs_level(begin, end, level - 1)
+                    table.get_mode_level::<S>(begin, end, level - 1, ignored)
                 } else {
-                    Ok(pte.attrs(level))
+                    Ok(S::attrs_to_mode(pte.attrs(level)) - ignored)
                 }
             })
             .res_reduce(|l, r| if l == r { Ok(l) } else { Err(()) })
     }
 
+    /// Calls `f` with the range of addresses and the mode of each block present in the table at
+    /// the given level, which maps the addresses from `begin`. It calls itself recursively for
+    /// sub-tables.
+    fn for_each_block<S: Stage, F: FnMut(ptable_addr_t, ptable_addr_t, Mode)>(
+        &self,
+        begin: ptable_addr_t,
+        level: u8,
+        f: &mut F,
+    ) {
+        let entry_size = addr::entry_size(level);
+
+        for (i, pte) in self.iter().enumerate() {
+            let begin = begin + i * entry_size;
+            if let Ok(table) = pte.as_table(level) {
+                table.for_each_block::<S, F>(begin, level - 1, f);
+            } else if pte.is_present(level) {
+                f(
+                    begin,
+                    begin + entry_size,
+                    S::attrs_to_mode(pte.attrs(level)) - Mode::LOG,
+                );
+            }
+        }
+    }
+
+    /// Changes the mode of each block present in the table at the given level, which maps the
+    /// addresses from `begin`, and which overlaps with the given range, to `f` of its range and
+    /// mode. It calls itself recursively for sub-tables.
+    fn update_modes<S: Stage, F: FnMut(ptable_addr_t, ptable_addr_t, Mode) -> Mode>(
+        &mut self,
+        begin: ptable_addr_t,
+        level: u8,
+        range: (ptable_addr_t, ptable_addr_t),
+        f: &mut F,
+        mpool: &MPool,
+    ) {
+        let entry_size = addr::entry_size(level);
+
+        for (i, pte) in self.iter_mut().enumerate() {
+            let begin = begin + i * entry_size;
+            let end = begin + entry_size;
+            if end <= range.0 || range.1 <= begin {
+                continue;
+            }
+
+            if let Ok(table) = pte.as_table_mut(level) {
+                table.update_modes::<S, F>(begin, level - 1, range, f, mpool);
+            } else if pte.is_present(level) {
+                let mode = S::attrs_to_mode(pte.attrs(level));
+                let new_mode = f(begin, end, mode);
+                if new_mode != mode {
+                    let block = unsafe { pte.as_block_unchecked(level) };
+                    let new_pte = PageTableEntry::block(level, block, S::mode_to_attrs(new_mode));
+                    if Mode::LOG.contains(new_mode ^ mode) {
+                        // Changing only the access flag or the dirty-log write protection keeps
+                        // the output address, so it doesn't need break-before-make. The caller
+                        // invalidates the TLB once for the whole update.
+                        unsafe { ptr::write(pte, new_pte) };
+                    } else {
+                        pte.replace::<S>(new_pte, begin, level, mpool);
+                    }
+                }
+            }
+        }
+    }
+
     /// Writes the given table to the debug log, calling itself recursively to write sub-tables.
     fn dump(&self, level: u8, max_level: u8) {
         for (i, pte) in self.iter().enumerate() {
@@ -710,7 +803,7 @@ impl RawPageTable {
                 continue;
             }
 
-            dlog!(
+            dlog_debug!(
                 "%{:width$}{:#x}: {}\n",
                 "",
                 i,
@@ -945,6 +1038,57 @@ impl<S: Stage> PageTable<S> {
         }
     }
 
+    /// Calls `f` with the range of addresses and the mode of each block present in the page
+    /// table, in order of address. Blocks mapped with an invalid mode are present, unlike those
+    /// which are unmapped. As for `get_mode`, the `Mode::LOG` bits are ignored.
+    pub fn for_each_block<F: FnMut(ptable_addr_t, ptable_addr_t, Mode)>(&self, mut f: F) {
+        let max_level = S::max_level();
+        let root_table_size = addr::entry_size(max_level + 1);
+
+        for (i, table) in self.deref().iter().enumerate() {
+            table.for_each_block::<S, F>(i * root_table_size, max_level, &mut f);
+        }
+    }
+
+    /// Changes the mode of each block present in the page table which overlaps with the given
+    /// range to `f` of the block's range and mode, including the `Mode::LOG` bits. The blocks
+    /// themselves are kept, so this never needs to allocate memory. Changes to only the
+    /// `Mode::LOG` bits don't invalidate the TLB, so the caller must invalidate it once it has
+    /// cleared access flags or write-protected memory for dirty logging.
+    pub fn update_modes<F: FnMut(ptable_addr_t, ptable_addr_t, Mode) -> Mode>(
+        &mut self,
+        begin: paddr_t,
+        end: paddr_t,
+        mut f: F,
+        mpool: &MPool,
+    ) {
+        let max_level = S::max_level();
+        let root_table_size = addr::entry_size(max_level + 1);
+        let range = (pa_addr(begin), pa_addr(end));
+
+        for (i, table) in self.deref_mut().iter_mut().enumerate() {
+            table.update_modes::<S, F>(i * root_table_size, max_level, range, &mut f, mpool);
+        }
+    }
+
+    /// Changes the mode of each block present in the page table like `update_modes`, over the
+    /// whole address space.
+    pub fn update_all_modes<F: FnMut(ptable_addr_t, ptable_addr_t, Mode) -> Mode>(
+        &mut self,
+        f: F,
+        mpool: &MPool,
+    ) {
+        self.update_modes(pa_init(0), pa_init(S::ptable_addr_space_end()), f, mpool);
+    }
+
+    /// Unmaps the whole address space, freeing all the sub-tables. The root tables are kept, so
+    /// the page table stays usable.
+    pub fn clear(&mut self, mpool: &MPool) {
+        // Unmapping whole root-level entries doesn't need any memory, so it can't fail.
+        self.unmap(pa_init(0), pa_init(S::ptable_addr_space_end()), mpool)
+            .unwrap();
+    }
+
     /// Defragments the given page table by converting page table references to blocks whenever
     /// possible.
     pub fn defrag(&mut self, mpool: &MPool) {
@@ -969,6 +1113,59 @@ impl<S: Stage> PageTable<S> {
         self.identity_update(begin, end, S::mode_to_attrs(mode), Flags::empty(), mpool)
     }
 
+    /// Allocates the sub-tables needed to map the given physical address range with the given
+    /// mode, without changing the mapping, so that `identity_commit` can then map it without
+    /// failing. This lets several ranges be mapped all together or not at all.
+    pub fn identity_prepare(
+        &mut self,
+        begin: paddr_t,
+        end: paddr_t,
+        mode: Mode,
+        mpool: &MPool,
+    ) -> Result<(), ()> {
+        let root_level = S::max_level() + 1;
+        let end = cmp::min(
+            addr::round_up_to_page(pa_addr(end)),
+            S::ptable_addr_space_end(),
+        );
+        let begin = pa_addr(unsafe { arch_mm_clear_pa(begin) });
+
+        self.map_root(
+            begin,
+            end,
+            S::mode_to_attrs(mode),
+            root_level,
+            Flags::empty(),
+            mpool,
+        )
+    }
+
+    /// Maps the given physical address range with the given mode, which must have been prepared
+    /// with `identity_prepare`. The only changes allowed to the page table in between are commits
+    /// of other prepared ranges, which mustn't overlap with it.
+    pub fn identity_commit(&mut self, begin: paddr_t, end: paddr_t, mode: Mode, mpool: &MPool) {
+        let root_level = S::max_level() + 1;
+        let end = cmp::min(
+            addr::round_up_to_page(pa_addr(end)),
+            S::ptable_addr_space_end(),
+        );
+        let begin = pa_addr(unsafe { arch_mm_clear_pa(begin) });
+
+        // The sub-tables were allocated when the range was prepared, so this can't fail.
+        self.map_root(
+            begin,
+            end,
+            S::mode_to_attrs(mode),
+            root_level,
+            Flags::COMMIT,
+            mpool,
+        )
+        .unwrap();
+
+        // Invalidate the tlb.
+        S::invalidate_tlb(begin, end);
+    }
+
     /// Updates the VM's table such that the given physical address range has no connection to the
     /// VM.
     pub fn unmap(&mut self, begin: paddr_t, end: paddr_t, mpool: &MPool) -> Result<(), ()> {
@@ -981,12 +1178,16 @@ impl<S: Stage> PageTable<S> {
         )
     }
 
-    /// Gets the attributes applies to the given range of addresses in the stage-2 table.
+    /// Gets the mode of the given range of addresses in the stage-2 table, ignoring the `ignored`
+    /// bits.
     ///
-    /// The value returned in `attrs` is only valid if the function returns true.
-    ///
-    /// Returns true if the whole range has the same attributes and false otherwise.
-    pub fn get_attrs(&self, begin: ptable_addr_t, end: ptable_addr_t) -> Result<u64, ()> {
+    /// Returns the mode if the whole range has the same mode, or an error otherwise.
+    fn get_mode_ignoring(
+        &self,
+        begin: ptable_addr_t,
+        end: ptable_addr_t,
+        ignored: Mode,
+    ) -> Result<Mode, ()> {
         let max_level = S::max_level();
         let root_level = max_level + 1;
         let root_table_size = addr::entry_size(root_level);
@@ -1005,17 +1206,23 @@ impl<S: Stage> PageTable<S> {
 
         tables
             .zip(begins)
-            .map(|(table, begin)| table.get_attrs_level(begin, end, max_level))
+            .map(|(table, begin)| table.get_mode_level::<S>(begin, end, max_level, ignored))
             .res_reduce(|l, r| if l == r { Ok(l) } else { Err(()) })
     }
 
     /// Gets the mode of the give range of intermediate physical addresses if they are mapped with
-    /// the same mode.
+    /// the same mode. The `Mode::LOG` bits are ignored, as they don't change what the VM may
+    /// access.
     ///
     /// Returns true if the range is mapped with the same mode and false otherwise.}
     pub fn get_mode(&self, begin: ipaddr_t, end: ipaddr_t) -> Result<Mode, ()> {
-        let attrs = self.get_attrs(ipa_addr(begin), ipa_addr(end))?;
-        Ok(S::attrs_to_mode(attrs))
+        self.get_mode_ignoring(ipa_addr(begin), ipa_addr(end), Mode::LOG)
+    }
+
+    /// Gets the mode of the given range of intermediate physical addresses like `get_mode`, but
+    /// including the `Mode::LOG` bits.
+    pub fn get_raw_mode(&self, begin: ipaddr_t, end: ipaddr_t) -> Result<Mode, ()> {
+        self.get_mode_ignoring(ipa_addr(begin), ipa_addr(end), Mode::empty())
     }
 }
 
@@ -1089,24 +1296,24 @@ pub struct MemoryManager {
 
 impl MemoryManager {
     pub fn new(mpool: &MPool) -> Option<Self> {
-        dlog!(
+        dlog_info!(
             "text: {:#x} - {:#x}\n",
             pa_addr(unsafe { layout_text_begin() }),
             pa_addr(unsafe { layout_text_end() })
         );
-        dlog!(
+        dlog_info!(
             "rodata: {:#x} - {:#x}\n",
             pa_addr(unsafe { layout_rodata_begin() }),
             pa_addr(unsafe { layout_rodata_end() })
         );
-        dlog!(
+        dlog_info!(
             "data: {:#x} - {:#x}\n",
             pa_addr(unsafe { layout_data_begin() }),
             pa_addr(unsafe { layout_data_end() })
         );
 
         let page_table = PageTable::new(mpool)
-            .map_err(|_| dlog!("Unable to allocate memory for page table.\n"))
+            .map_err(|_| dlog_error!("Unable to allocate memory for page table.\n"))
             .ok()?;
 
         // A fake lock.
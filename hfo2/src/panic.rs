@@ -37,6 +37,7 @@ pub extern "C" fn abort() -> ! {
 #[cfg(not(test))]
 #[panic_handler]
 fn panic(info: &core::panic::PanicInfo) -> ! {
+    crate::dlog::dlog_flush();
     dlog!("Panic: {:?}\n", info);
     abort_impl()
 }
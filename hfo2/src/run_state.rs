@@ -0,0 +1,149 @@
+/*
+ * Copyright 2019 Jeehoon Kang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+use core::mem;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, AtomicU8, Ordering};
+
+use crate::cpu::*;
+use crate::page::*;
+use crate::types::*;
+
+/// The number of VMs covered by the vCPU run-state page.
+pub const HF_VCPU_RUN_STATE_VMS: usize = 16;
+
+/// The number of vCPUs of each VM covered by the vCPU run-state page.
+pub const HF_VCPU_RUN_STATE_VCPUS_PER_VM: usize = 16;
+
+const_assert!(MAX_VMS <= HF_VCPU_RUN_STATE_VMS);
+const_assert!(MAX_CPUS <= HF_VCPU_RUN_STATE_VCPUS_PER_VM);
+
+/// The run state of a vCPU, as published to the primary VM. Mirrors `struct hf_vcpu_run_state` in
+/// inc/vmapi/hf/abi.h.
+///
+/// The primary VM only has read access to it, and the fields are updated with relaxed atomic
+/// stores, i.e. plain stores, by whoever changes the corresponding vCPU state.
+#[repr(C)]
+pub struct VCpuRunState {
+    state: AtomicU8,
+    interrupt_pending: AtomicBool,
+    needs_wake: AtomicBool,
+    reserved: [u8; 5],
+    timer_deadline: AtomicU64,
+}
+
+impl VCpuRunState {
+    pub fn get_state(&self) -> u8 {
+        self.state.load(Ordering::Relaxed)
+    }
+
+    pub fn set_state(&self, state: VCpuStatus) {
+        self.state.store(state as u8, Ordering::Relaxed);
+    }
+
+    pub fn set_interrupt_pending(&self, interrupt_pending: bool) {
+        self.interrupt_pending
+            .store(interrupt_pending, Ordering::Relaxed);
+    }
+
+    pub fn set_needs_wake(&self, needs_wake: bool) {
+        self.needs_wake.store(needs_wake, Ordering::Relaxed);
+    }
+
+    pub fn set_timer_deadline(&self, timer_deadline: Option<u64>) {
+        self.timer_deadline
+            .store(timer_deadline.unwrap_or(core::u64::MAX), Ordering::Relaxed);
+    }
+}
+
+/// Layout of the vCPU run-state page. Mirrors `struct hf_vcpu_run_state_page` in
+/// inc/vmapi/hf/abi.h.
+#[repr(C)]
+pub struct VCpuRunStatePage {
+    vcpus: [[VCpuRunState; HF_VCPU_RUN_STATE_VCPUS_PER_VM]; HF_VCPU_RUN_STATE_VMS],
+}
+
+const_assert_eq!(mem::size_of::<VCpuRunStatePage>(), PAGE_SIZE);
+
+/// The vCPU run-state page registered by the primary VM, if any.
+pub struct VCpuRunStates {
+    page: AtomicPtr<VCpuRunStatePage>,
+}
+
+impl VCpuRunStates {
+    pub const fn new() -> Self {
+        Self {
+            page: AtomicPtr::new(ptr::null_mut()),
+        }
+    }
+
+    pub fn is_configured(&self) -> bool {
+        !self.page.load(Ordering::Relaxed).is_null()
+    }
+
+    /// Clears the given page and publishes run states to it from now on. The page must be mapped
+    /// as writable in the hypervisor address space.
+    pub fn configure(&self, page: *mut RawPage) {
+        let page = page as *mut VCpuRunStatePage;
+
+        unsafe {
+            ptr::write_bytes(page, 0, 1);
+            for run_state in (*page).vcpus.iter().flatten() {
+                run_state.set_timer_deadline(None);
+            }
+        }
+
+        self.page.store(page, Ordering::Release);
+    }
+
+    /// Returns the published run state of the given vCPU, or None if the primary VM has not
+    /// registered a vCPU run-state page.
+    pub fn get(&self, vm_id: spci_vm_id_t, vcpu_idx: spci_vcpu_index_t) -> Option<&VCpuRunState> {
+        let page = unsafe { self.page.load(Ordering::Acquire).as_ref()? };
+        Some(&page.vcpus[(vm_id - HF_VM_ID_OFFSET) as usize][vcpu_idx as usize])
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn vcpu_run_states_configure() {
+        let mut page = RawPage::new();
+        let run_states = VCpuRunStates::new();
+        assert!(run_states.get(HF_PRIMARY_VM_ID, 0).is_none());
+
+        run_states.configure(&mut page);
+        assert!(run_states.is_configured());
+
+        let run_state = run_states.get(HF_PRIMARY_VM_ID + 1, 1).unwrap();
+        assert_eq!(run_state.get_state(), VCpuStatus::Off as u8);
+        assert_eq!(
+            run_state.timer_deadline.load(Ordering::Relaxed),
+            core::u64::MAX
+        );
+
+        run_state.set_state(VCpuStatus::BlockedMailbox);
+        run_state.set_timer_deadline(Some(42));
+
+        // Check the layout matches `struct hf_vcpu_run_state_page`.
+        let bytes = unsafe { &*(&page as *const RawPage as *const [u8; PAGE_SIZE]) };
+        let offset = (HF_VCPU_RUN_STATE_VCPUS_PER_VM + 1) * 16;
+        assert_eq!(bytes[offset], 2);
+        assert_eq!(bytes[offset + 8], 42);
+    }
+}
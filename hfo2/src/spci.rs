@@ -16,6 +16,7 @@
 
 use core::convert::TryFrom;
 use core::mem;
+use core::slice;
 
 use crate::mm::*;
 use crate::types::*;
@@ -37,6 +38,7 @@ pub enum SpciReturn {
     Interrupted = -5,
     Denied = -6,
     Retry = -7,
+    Timeout = -8,
 }
 
 /// Architected memory sharing message IDs.
@@ -164,6 +166,23 @@ pub struct SpciMemoryRegion {
     pub constituents: [SpciMemoryRegionConstituent; 0],
 }
 
+impl SpciMemoryRegion {
+    /// Returns the constituents of the memory region. The caller must have checked that `count`
+    /// constituents follow the region.
+    pub unsafe fn constituents(&self) -> &[SpciMemoryRegionConstituent] {
+        slice::from_raw_parts(self.constituents.as_ptr(), self.count as usize)
+    }
+
+    /// Returns the total number of pages of the constituents of the memory region. The caller must
+    /// have checked that `count` constituents follow the region.
+    pub unsafe fn page_count(&self) -> usize {
+        self.constituents()
+            .iter()
+            .map(|constituent| constituent.page_count as usize)
+            .sum()
+    }
+}
+
 pub struct SpciMemTransitions {
     pub orig_from_mode: Mode,
     pub orig_to_mode: Mode,
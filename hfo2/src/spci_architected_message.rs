@@ -310,7 +310,21 @@ pub fn spci_msg_check_transition(
     Ok((orig_from_mode, from_mode, to_mode))
 }
 
+/// Returns the range of IPAs of the given memory region constituent, or an error if it overflows.
+fn spci_constituent_range(
+    constituent: &SpciMemoryRegionConstituent,
+) -> Result<(ipaddr_t, ipaddr_t), ()> {
+    let begin = constituent.address as usize;
+    let size = (constituent.page_count as usize)
+        .checked_mul(PAGE_SIZE)
+        .ok_or(())?;
+    let end = begin.checked_add(size).ok_or(())?;
+
+    Ok((ipa_init(begin), ipa_init(end)))
+}
+
 /// Shares memory from the calling VM with another. The memory can be shared in different modes.
+/// All of the constituents of the memory region are shared, or none of them are on failure.
 ///
 /// This function requires the calling context to hold the <to> and <from> locks.
 ///
@@ -332,62 +346,108 @@ pub fn spci_share_memory(
         return SpciReturn::InvalidParameters;
     }
 
+    // The number of constituents was checked against the size of the message.
+    let constituents = unsafe { memory_region.constituents() };
+    if constituents.is_empty() {
+        return SpciReturn::InvalidParameters;
+    }
+
+    // Check if the state transition is lawful for both VMs involved in the memory exchange for
+    // each constituent, ensuring that all of its pages are at the same state, before changing any
+    // of them. The constituents mustn't overlap, so that sharing one doesn't change the state of
+    // another.
+    for (i, constituent) in constituents.iter().enumerate() {
+        let (begin, end) = ok_or!(
+            spci_constituent_range(constituent),
+            return SpciReturn::InvalidParameters
+        );
+
+        for other in &constituents[..i] {
+            let (other_begin, other_end) = ok_or!(
+                spci_constituent_range(other),
+                return SpciReturn::InvalidParameters
+            );
+            if ipa_addr(begin) < ipa_addr(other_end) && ipa_addr(other_begin) < ipa_addr(end) {
+                return SpciReturn::InvalidParameters;
+            }
+        }
+
+        if spci_msg_check_transition(
+            to_inner,
+            from_inner,
+            share,
+            begin,
+            end,
+            memory_to_attributes,
+        )
+        .is_err()
+        {
+            return SpciReturn::InvalidParameters;
+        }
+    }
+
     // Create a local pool so any freed memory can't be used by another thread.
     // This is to ensure the original mapping can be restored if any stage of
     // the process fails.
     let local_page_pool: MPool = MPool::new_with_fallback(fallback);
 
-    // Obtain the single contiguous set of pages from the memory_region.
-    // TODO: Add support for multiple constituent regions.
-    let constituent = unsafe { &*memory_region.constituents.as_ptr() };
-    let size = constituent.page_count as usize * PAGE_SIZE;
-    let begin = ipa_init(constituent.address as usize);
-    let end = ipa_add(begin, size as usize);
-
-    // Check if the state transition is lawful for both VMs involved in the
-    // memory exchange, ensure that all constituents of a memory region being
-    // shared are at the same state.
-    let (orig_from_mode, from_mode, to_mode) = ok_or!(
-        spci_msg_check_transition(
+    // Allocate the page tables needed to update the mappings of all of the constituents for both
+    // VMs, so that the updates can't fail halfway through.
+    for constituent in constituents {
+        let (begin, end) = spci_constituent_range(constituent).unwrap();
+        let (_, from_mode, to_mode) = spci_msg_check_transition(
             to_inner,
             from_inner,
             share,
             begin,
             end,
             memory_to_attributes,
-        ),
-        return SpciReturn::InvalidParameters
-    );
-
-    let pa_begin = pa_from_ipa(begin);
-    let pa_end = pa_from_ipa(end);
-
-    // First update the mapping for the sender so there is not overlap with the
-    // recipient.
-    if from_inner
-        .ptable
-        .identity_map(pa_begin, pa_end, from_mode, &local_page_pool)
-        .is_err()
-    {
-        return SpciReturn::NoMemory;
+        )
+        .unwrap();
+
+        let pa_begin = pa_from_ipa(begin);
+        let pa_end = pa_from_ipa(end);
+
+        if from_inner
+            .ptable
+            .identity_prepare(pa_begin, pa_end, from_mode, &local_page_pool)
+            .is_err()
+            || to_inner
+                .ptable
+                .identity_prepare(pa_begin, pa_end, to_mode, &local_page_pool)
+                .is_err()
+        {
+            // Recover any memory consumed by the page tables which were allocated.
+            from_inner.ptable.defrag(&local_page_pool);
+            to_inner.ptable.defrag(&local_page_pool);
+
+            return SpciReturn::NoMemory;
+        }
     }
 
-    // Complete the transfer by mapping the memory into the recipient.
-    if to_inner
-        .ptable
-        .identity_map(pa_begin, pa_end, to_mode, &local_page_pool)
-        .is_err()
-    {
-        // TODO: partial defrag of failed range.
-        // Recover any memory consumed in failed mapping.
-        from_inner.ptable.defrag(&local_page_pool);
+    // Update the mappings, first for the sender so there is no overlap with the recipient. The
+    // constituents don't overlap, so updating one doesn't change the transition of the others.
+    for constituent in constituents {
+        let (begin, end) = spci_constituent_range(constituent).unwrap();
+        let (_, from_mode, to_mode) = spci_msg_check_transition(
+            to_inner,
+            from_inner,
+            share,
+            begin,
+            end,
+            memory_to_attributes,
+        )
+        .unwrap();
+
+        let pa_begin = pa_from_ipa(begin);
+        let pa_end = pa_from_ipa(end);
 
         from_inner
             .ptable
-            .identity_map(pa_begin, pa_end, orig_from_mode, &local_page_pool)
-            .unwrap();
-
-        return SpciReturn::NoMemory;
+            .identity_commit(pa_begin, pa_end, from_mode, &local_page_pool);
+        to_inner
+            .ptable
+            .identity_commit(pa_begin, pa_end, to_mode, &local_page_pool);
     }
 
     SpciReturn::Success
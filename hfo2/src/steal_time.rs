@@ -0,0 +1,140 @@
+/*
+ * Copyright 2019 Jeehoon Kang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+use core::mem;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use crate::cpu::*;
+use crate::page::*;
+use crate::types::*;
+
+/// The number of vCPUs covered by the steal-time page.
+pub const HF_STEAL_TIME_VCPUS: usize = 16;
+
+const_assert!(MAX_CPUS <= HF_STEAL_TIME_VCPUS);
+
+/// What a vCPU spends its time on. Mirrors `enum hf_vcpu_time` in inc/vmapi/hf/abi.h.
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub enum VCpuTime {
+    /// The vCPU is running.
+    Running,
+
+    /// The vCPU is waiting for an interrupt.
+    BlockedInterrupt,
+
+    /// The vCPU is waiting for a message.
+    BlockedMailbox,
+
+    /// The vCPU is ready to be run, but the primary VM's scheduler has not run it.
+    Steal,
+}
+
+/// The number of kinds of time accounted. Mirrors `HF_VCPU_TIME_COUNT`.
+const VCPU_TIME_COUNT: usize = 4;
+
+impl VCpuTime {
+    pub fn from_raw(raw: u32) -> Option<Self> {
+        match raw {
+            0 => Some(VCpuTime::Running),
+            1 => Some(VCpuTime::BlockedInterrupt),
+            2 => Some(VCpuTime::BlockedMailbox),
+            3 => Some(VCpuTime::Steal),
+            _ => None,
+        }
+    }
+
+    /// Returns what a vCPU in the given state, which is not running, spends its time on. Returns
+    /// None for vCPUs that are off or aborted, which are not accounted.
+    pub fn from_state(state: VCpuStatus) -> Option<Self> {
+        match state {
+            VCpuStatus::Ready => Some(VCpuTime::Steal),
+            VCpuStatus::BlockedInterrupt => Some(VCpuTime::BlockedInterrupt),
+            VCpuStatus::BlockedMailbox => Some(VCpuTime::BlockedMailbox),
+            VCpuStatus::Off | VCpuStatus::Aborted => None,
+        }
+    }
+}
+
+/// Time, in virtual counter ticks, a vCPU has spent on each of `VCpuTime`. Mirrors
+/// `struct hf_vcpu_times` in inc/vmapi/hf/abi.h.
+///
+/// The counters are only written by whoever holds the vCPU's execution lock, but may be read at
+/// any time.
+#[repr(C)]
+pub struct VCpuTimes {
+    times: [AtomicU64; VCPU_TIME_COUNT],
+}
+
+impl VCpuTimes {
+    pub const fn new() -> Self {
+        Self {
+            times: [
+                AtomicU64::new(0),
+                AtomicU64::new(0),
+                AtomicU64::new(0),
+                AtomicU64::new(0),
+            ],
+        }
+    }
+
+    pub fn get(&self, time: VCpuTime) -> u64 {
+        self.times[time as usize].load(Ordering::Relaxed)
+    }
+
+    pub fn set(&self, time: VCpuTime, ticks: u64) {
+        self.times[time as usize].store(ticks, Ordering::Relaxed);
+    }
+
+    pub fn copy_from(&self, other: &Self) {
+        for (time, other) in self.times.iter().zip(other.times.iter()) {
+            time.store(other.load(Ordering::Relaxed), Ordering::Relaxed);
+        }
+    }
+
+    /// Adds the given ticks to the given counter, and returns the new value.
+    pub fn add(&self, time: VCpuTime, ticks: u64) -> u64 {
+        let ticks = self.get(time).wrapping_add(ticks);
+        self.set(time, ticks);
+        ticks
+    }
+}
+
+/// Layout of the steal-time page of a VM, indexed by vCPU index. Mirrors
+/// `struct hf_steal_time_page` in inc/vmapi/hf/abi.h.
+#[repr(C)]
+pub struct StealTimePage {
+    pub vcpus: [VCpuTimes; HF_STEAL_TIME_VCPUS],
+}
+
+const_assert!(mem::size_of::<StealTimePage>() <= PAGE_SIZE);
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn vcpu_times_add() {
+        let times = VCpuTimes::new();
+        assert_eq!(times.add(VCpuTime::Steal, 3), 3);
+        assert_eq!(times.add(VCpuTime::Steal, 4), 7);
+        assert_eq!(times.get(VCpuTime::Running), 0);
+        assert_eq!(
+            VCpuTime::from_raw(VCpuTime::BlockedMailbox as u32),
+            Some(VCpuTime::BlockedMailbox)
+        );
+        assert_eq!(VCpuTime::from_raw(VCPU_TIME_COUNT as u32), None);
+    }
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2019 Jeehoon Kang
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Binary tracing for hot paths. Unlike `dlog!`, `trace!` formats nothing: it only records an
+//! event ID, a timestamp and a few integer arguments into a ring, which is cheap enough to leave
+//! on. The format strings never reach the image; build/trace_decode.py takes them from the
+//! `trace_events!` table below to rebuild readable output from a dump of `hf_trace_buffer`.
+
+use core::cell::UnsafeCell;
+use core::ptr;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use crate::arch::*;
+use crate::init::*;
+
+/// The number of records the trace ring holds. Must be a power of two.
+const TRACE_RECORDS: usize = 1024;
+
+const_assert_eq!(TRACE_RECORDS & (TRACE_RECORDS - 1), 0);
+
+/// The number of arguments of a trace record.
+const TRACE_ARGS: usize = 3;
+
+/// Identifies a dump of `hf_trace_buffer`. Reads "HFTRACE1" in a little-endian dump.
+const TRACE_MAGIC: u64 = 0x3145_4341_5254_4648;
+
+/// Stands for an unknown CPU in a trace record.
+const TRACE_CPU_UNKNOWN: u64 = 0xffff;
+
+/// The `seq` of a trace record which is being written.
+const TRACE_SEQ_WRITING: u64 = u64::max_value();
+
+macro_rules! trace_events {
+    ($($event:ident = $id:expr => $format:expr,)*) => {
+        /// Events which can be traced. build/trace_decode.py parses this table, so keep each
+        /// event on a single line.
+        #[derive(Clone, Copy)]
+        #[repr(u16)]
+        pub enum TraceEvent {
+            $($event = $id,)*
+        }
+    };
+}
+
+trace_events! {
+    VCpuRun = 1 => "vcpu_run: VM {} vCPU {}",
+    SwitchToPrimary = 2 => "switch_to_primary: VM {} vCPU {} return {:#x}",
+    SpciMsgSend = 3 => "spci_msg_send: VM {} to VM {} length {}",
+    SpciMsgRecv = 4 => "spci_msg_recv: VM {} vCPU {} block {}",
+    InterruptInject = 5 => "interrupt_inject: VM {} vCPU {} IRQ {}",
+}
+
+/// A trace record, as laid out in a dump.
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct TraceRecord {
+    /// The sequence number of the record plus one, 0 if the slot was never written, or
+    /// `TRACE_SEQ_WRITING` if it is being written. A writer claims the slot by setting it to
+    /// `TRACE_SEQ_WRITING` and publishes the record by setting it last, so a decoder can tell
+    /// complete records apart.
+    seq: u64,
+
+    /// The virtual counter value when the record was written.
+    timestamp: u64,
+
+    /// The event ID in bits [15:0] and the CPU index in bits [31:16].
+    event: u64,
+
+    args: [u64; TRACE_ARGS],
+}
+
+/// The trace ring. Any CPU may write to it at any time, each record to its own slot, so no lock is
+/// needed. Old records are overwritten. A writer which finds its slot being written or already
+/// holding a newer record, because it was lapped by writers on other CPUs, drops its record rather
+/// than tear the other one.
+#[repr(C)]
+pub struct TraceBuffer {
+    magic: u64,
+    capacity: u64,
+
+    /// The number of records ever written.
+    next: AtomicU64,
+
+    records: UnsafeCell<[TraceRecord; TRACE_RECORDS]>,
+}
+
+unsafe impl Sync for TraceBuffer {}
+
+impl TraceBuffer {
+    const fn new() -> Self {
+        Self {
+            magic: TRACE_MAGIC,
+            capacity: TRACE_RECORDS as u64,
+            next: AtomicU64::new(0),
+            records: UnsafeCell::new(
+                [TraceRecord {
+                    seq: 0,
+                    timestamp: 0,
+                    event: 0,
+                    args: [0; TRACE_ARGS],
+                }; TRACE_RECORDS],
+            ),
+        }
+    }
+
+    /// Records the event on the current CPU. The CPU is found from the stack, which unlike
+    /// `tpidr_el2` is also valid at boot and while switching vCPUs.
+    #[inline]
+    pub fn record(&self, event: TraceEvent, args: [u64; TRACE_ARGS]) {
+        let marker = 0u8;
+        let cpu_manager = &hypervisor().cpu_manager;
+        let cpu = cpu_manager
+            .lookup_by_stack(&marker as *const _ as usize)
+            .map_or(TRACE_CPU_UNKNOWN, |cpu| cpu_manager.index_of(cpu) as u64);
+
+        self.record_on(cpu, event, args);
+    }
+
+    fn record_on(&self, cpu: u64, event: TraceEvent, args: [u64; TRACE_ARGS]) {
+        let seq = self.next.fetch_add(1, Ordering::Relaxed);
+        let record = unsafe { &mut (*self.records.get())[seq as usize % TRACE_RECORDS] };
+
+        // # Safety
+        //
+        // `seq` is a naturally aligned u64, so it can be accessed atomically.
+        let published = unsafe { &*(&record.seq as *const u64 as *const AtomicU64) };
+        let mut prev = published.load(Ordering::Relaxed);
+        loop {
+            if prev == TRACE_SEQ_WRITING || prev > seq {
+                return;
+            }
+
+            match published.compare_exchange_weak(
+                prev,
+                TRACE_SEQ_WRITING,
+                Ordering::Acquire,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(seen) => prev = seen,
+            }
+        }
+
+        unsafe {
+            ptr::write_volatile(&mut record.timestamp, arch_timer_count());
+            ptr::write_volatile(&mut record.event, event as u64 | cpu << 16);
+            ptr::write_volatile(&mut record.args, args);
+        }
+
+        published.store(seq + 1, Ordering::Release);
+    }
+}
+
+/// The trace ring, exported so it can be found in a memory dump.
+#[no_mangle]
+pub static hf_trace_buffer: TraceBuffer = TraceBuffer::new();
+
+/// Records a trace event with up to three integer arguments.
+#[macro_export]
+macro_rules! trace {
+    ($event:ident) => {
+        trace!($event, 0, 0, 0)
+    };
+    ($event:ident, $a:expr) => {
+        trace!($event, $a, 0, 0)
+    };
+    ($event:ident, $a:expr, $b:expr) => {
+        trace!($event, $a, $b, 0)
+    };
+    ($event:ident, $a:expr, $b:expr, $c:expr) => {
+        $crate::trace::hf_trace_buffer.record(
+            $crate::trace::TraceEvent::$event,
+            [$a as u64, $b as u64, $c as u64],
+        )
+    };
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn trace_buffer_wraps() {
+        let buffer = TraceBuffer::new();
+
+        for i in 0..TRACE_RECORDS + 2 {
+            buffer.record_on(3, TraceEvent::SpciMsgSend, [i as u64, 2, 3]);
+        }
+
+        let records = unsafe { &*buffer.records.get() };
+        assert_eq!(
+            buffer.next.load(Ordering::Relaxed),
+            TRACE_RECORDS as u64 + 2
+        );
+
+        // The oldest records are overwritten by the newest ones.
+        assert_eq!(records[0].seq, TRACE_RECORDS as u64 + 1);
+        assert_eq!(records[0].args, [TRACE_RECORDS as u64, 2, 3]);
+        assert_eq!(records[2].seq, 3);
+        assert_eq!(records[1].event, TraceEvent::SpciMsgSend as u64 | 3 << 16);
+    }
+
+    #[test]
+    fn trace_buffer_lapped_writer() {
+        let buffer = TraceBuffer::new();
+
+        // A writer lapped by a newer record in its slot drops its own.
+        buffer.next.store(TRACE_RECORDS as u64, Ordering::Relaxed);
+        buffer.record_on(1, TraceEvent::VCpuRun, [1, 0, 0]);
+        buffer.next.store(0, Ordering::Relaxed);
+        buffer.record_on(2, TraceEvent::VCpuRun, [2, 0, 0]);
+
+        let records = unsafe { &mut *buffer.records.get() };
+        assert_eq!(records[0].seq, TRACE_RECORDS as u64 + 1);
+        assert_eq!(records[0].args, [1, 0, 0]);
+
+        // So does one whose slot is still being written.
+        records[1].seq = TRACE_SEQ_WRITING;
+        buffer.record_on(2, TraceEvent::VCpuRun, [2, 0, 0]);
+        assert_eq!(records[1].seq, TRACE_SEQ_WRITING);
+        assert_eq!(records[1].args, [0; TRACE_ARGS]);
+    }
+}
@@ -54,9 +54,15 @@ pub const HF_NUM_INTIDS: intid_t = 64;
 /// Interrupt ID returned when there is no interrupt pending.
 pub const HF_INVALID_INTID: intid_t = 0xffff_ffff;
 
+/// Interrupt ID indicating a mailbox is writable.
+pub const HF_MAILBOX_WRITABLE_INTID: intid_t = 2;
+
 /// The virtual interrupt ID used for the virtual timer.
 pub const HF_VIRTUAL_TIMER_INTID: intid_t = 3;
 
+/// Interrupt ID indicating the primary VM has asked the VM to return memory to it.
+pub const HF_BALLOON_INTID: intid_t = 4;
+
 // TODO(HfO2): These constants are originally from build scripts. (See
 // //project/reference/BUILD.gn.)
 pub const HEAP_PAGES: usize = 60;
@@ -88,3 +94,6 @@ pub const HF_MAILBOX_SIZE: usize = PAGE_SIZE;
 
 /// Sleep value for an indefinite period of time.
 pub const HF_SLEEP_INDEFINITE: u64 = 0xff_ffff_ffff_ffff;
+
+/// The number of pages whose state is returned by `vm_dirty_log_get` and `vm_access_log_get`.
+pub const HF_MEMORY_LOG_PAGES: usize = 32;
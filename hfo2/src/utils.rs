@@ -73,6 +73,17 @@ pub fn round_down(a: usize, b: usize) -> usize {
     div_floor(a, b) * b
 }
 
+/// The initial value of an FNV-1a hash.
+pub const FNV1A_INIT: u32 = 0x811c_9dc5;
+
+/// Folds the given bytes into an FNV-1a hash, starting from `FNV1A_INIT`.
+#[inline]
+pub fn fnv1a(hash: u32, bytes: &[u8]) -> u32 {
+    bytes.iter().fold(hash, |hash, byte| {
+        (hash ^ *byte as u32).wrapping_mul(0x0100_0193)
+    })
+}
+
 pub trait ResReduce<T, E> {
     fn res_reduce<F>(self, f: F) -> Result<T, E>
     where
@@ -17,25 +17,32 @@
 use core::mem::{self, MaybeUninit};
 use core::ptr;
 use core::str;
-use core::sync::atomic::AtomicBool;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, AtomicUsize, Ordering};
 
 use arrayvec::ArrayVec;
 use scopeguard::guard;
 
 use crate::addr::*;
 use crate::arch::*;
+use crate::boot_params::*;
 use crate::cpu::*;
 use crate::list::*;
+use crate::load::*;
+use crate::memiter::*;
 use crate::mm::*;
 use crate::mpool::*;
 use crate::page::*;
 use crate::spci::*;
 use crate::spinlock::*;
 use crate::std::*;
+use crate::steal_time::*;
 use crate::types::*;
 
 const LOG_BUFFER_SIZE: usize = 256;
 
+/// The maximum number of physically contiguous ranges a secondary VM's memory is assembled from.
+pub const MAX_VM_MEM_RANGES: usize = 4;
+
 #[repr(C)]
 #[derive(PartialEq, Debug, Clone, Copy)]
 pub enum MailboxState {
@@ -87,6 +94,9 @@ pub struct Mailbox {
     /// List of wait_entry structs representing VMs whose mailboxes became
     /// writable since the owner of the mailbox registers for notification.
     ready_list: ListEntry,
+
+    /// The virtual counter value when the last message arrived.
+    received_at: u64,
 }
 
 impl Mailbox {
@@ -96,6 +106,7 @@ impl Mailbox {
         self.state = MailboxState::Empty;
         self.recv = ptr::null_mut();
         self.send = ptr::null();
+        self.received_at = 0;
 
         list_init(&mut self.waiter_list);
         list_init(&mut self.ready_list);
@@ -120,6 +131,20 @@ impl Mailbox {
         )
     }
 
+    /// Retrieves the next waiter and removes it from the wait list, whatever the state of the
+    /// mailbox.
+    pub fn take_waiter(&mut self) -> *mut WaitEntry {
+        if unsafe { list_empty(&self.waiter_list) } {
+            return ptr::null_mut();
+        }
+
+        container_of!(
+            unsafe { list_pop_front(&self.waiter_list) },
+            WaitEntry,
+            wait_links
+        )
+    }
+
     /// Checks if any waiters exists.
     pub fn is_waiter_list_empty(&self) -> bool {
         unsafe { list_empty(&self.waiter_list) }
@@ -144,6 +169,7 @@ impl Mailbox {
     /// Set a message is arrived.
     pub fn set_received(&mut self) {
         self.state = MailboxState::Received;
+        self.received_at = unsafe { arch_timer_count() };
     }
 
     /// Configures the hypervisor's stage-1 view of the send and receive pages.
@@ -217,12 +243,24 @@ pub struct VmInner {
     /// Wait entries to be used when waiting on other VM mailboxes.
     wait_entries: [WaitEntry; MAX_VMS],
     arch: ArchVm,
+
+    /// Where to load the VM from when it first runs, if its loading was deferred.
+    pub deferred_load: Option<DeferredLoad>,
+
+    /// Whether the VM's writable memory is write-protected to log which pages it writes.
+    pub dirty_log: bool,
+
+    /// The number of pages the primary VM has asked the VM to return to it by donating them.
+    pub balloon_request: usize,
 }
 
 impl VmInner {
     /// Initializes VmInner.
     pub unsafe fn init(&mut self, vm: *mut Vm, ppool: &MPool) -> Result<(), ()> {
         self.mailbox.init();
+        ptr::write(&mut self.deferred_load, None);
+        self.dirty_log = false;
+        self.balloon_request = 0;
 
         if !mm_vm_init(&mut self.ptable, ppool) {
             return Err(());
@@ -244,6 +282,12 @@ impl VmInner {
         self.mailbox.fetch_waiter()
     }
 
+    /// Retrieves the next waiter and removes it from the wait list, whatever the state of the
+    /// mailbox.
+    pub fn take_waiter(&mut self) -> *mut WaitEntry {
+        self.mailbox.take_waiter()
+    }
+
     /// Checks if any waiters exists.
     pub fn is_waiter_list_empty(&self) -> bool {
         self.mailbox.is_waiter_list_empty()
@@ -265,6 +309,11 @@ impl VmInner {
         self.mailbox.set_received()
     }
 
+    /// Returns the virtual counter value when the last message arrived.
+    pub fn received_at(&self) -> u64 {
+        self.mailbox.received_at
+    }
+
     /// Configures the send and receive pages in the VM stage-2 and hypervisor
     /// stage-1 page tables. Locking of the page tables combined with a local
     /// memory pool ensures there will always be enough memory to recover from
@@ -392,6 +441,94 @@ impl VmInner {
         )
     }
 
+    /// Takes memory ownership of the given page away from the VM, leaving it read-only to the VM,
+    /// and maps it as writable in the hypervisor address space so that the hypervisor can publish
+    /// data to the VM with plain stores. The page must be valid, owned and exclusive to the VM.
+    ///
+    /// Returns the page's address in the hypervisor address space.
+    pub fn map_published_page(
+        &mut self,
+        ipa: ipaddr_t,
+        hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
+        fallback_mpool: &MPool,
+    ) -> Result<*mut RawPage, ()> {
+        // Fail if the address is not page-aligned.
+        if !is_aligned(ipa_addr(ipa), PAGE_SIZE) {
+            return Err(());
+        }
+
+        let orig_mode = self.ptable.get_mode(ipa, ipa_add(ipa, PAGE_SIZE))?;
+        if !(orig_mode.valid_owned_exclusive() && orig_mode.contains(Mode::R)) {
+            return Err(());
+        }
+
+        let pa_begin = pa_from_ipa(ipa);
+        let pa_end = pa_add(pa_begin, PAGE_SIZE);
+
+        // Create a local pool so any freed memory can't be used by another thread. This is to
+        // ensure the original mapping can be restored if any stage of the process fails.
+        let local_page_pool = MPool::new_with_fallback(fallback_mpool);
+
+        self.ptable.identity_map(
+            pa_begin,
+            pa_end,
+            Mode::UNOWNED | Mode::SHARED | Mode::R,
+            &local_page_pool,
+        )?;
+
+        let mut hypervisor_ptable = hypervisor_ptable.lock();
+        if hypervisor_ptable
+            .identity_map(pa_begin, pa_end, Mode::W, &local_page_pool)
+            .is_err()
+        {
+            // TODO: partial defrag of failed range.
+            // Recover any memory consumed in failed mapping.
+            hypervisor_ptable.defrag(&local_page_pool);
+            self.ptable
+                .identity_map(pa_begin, pa_end, orig_mode, &local_page_pool)
+                .unwrap();
+            return Err(());
+        }
+
+        Ok(pa_addr(pa_begin) as *mut RawPage)
+    }
+
+    /// Undoes `map_published_page` for the page at the given physical address, unmapping it from
+    /// the hypervisor address space and giving it back to the VM.
+    pub fn unmap_published_page(
+        &mut self,
+        pa_begin: paddr_t,
+        hypervisor_ptable: &SpinLock<PageTable<Stage1>>,
+        mpool: &MPool,
+    ) {
+        let pa_end = pa_add(pa_begin, PAGE_SIZE);
+
+        hypervisor_ptable
+            .lock()
+            .unmap(pa_begin, pa_end, mpool)
+            .unwrap();
+        self.ptable
+            .identity_map(pa_begin, pa_end, Mode::R | Mode::W, mpool)
+            .unwrap();
+    }
+
+    /// Undoes `configure`, unmapping the send and receive pages from the hypervisor address space
+    /// and giving them back to the VM. Any pending message is dropped, and the VM is no longer
+    /// notified of other VMs' mailboxes becoming writable.
+    pub fn unconfigure(&mut self, hypervisor_ptable: &SpinLock<PageTable<Stage1>>, mpool: &MPool) {
+        if self.is_configured() {
+            let send = pa_init(self.mailbox.send as usize);
+            let recv = pa_init(self.mailbox.recv as usize);
+            self.unmap_published_page(send, hypervisor_ptable, mpool);
+            self.unmap_published_page(recv, hypervisor_ptable, mpool);
+        }
+
+        self.mailbox.state = MailboxState::Empty;
+        self.mailbox.send = ptr::null();
+        self.mailbox.recv = ptr::null_mut();
+        while self.dequeue_ready_list().is_some() {}
+    }
+
     /// Checks whether `configure` is called before.
     pub fn is_configured(&self) -> bool {
         !self.mailbox.send.is_null() && !self.mailbox.recv.is_null()
@@ -448,6 +585,17 @@ impl VmInner {
         Ok(())
     }
 
+    /// Removes `self` from the waiter list of the VM with the given ID, if it is waiting for it.
+    /// That VM must be locked.
+    pub fn cancel_wait(&mut self, target_id: spci_vm_id_t) {
+        let entry = &mut self.wait_entries[target_id as usize];
+
+        // Removing an entry which isn't in a list leaves it as it is.
+        unsafe {
+            list_remove(&mut entry.wait_links);
+        }
+    }
+
     pub fn get_send_ptr(&self) -> *const SpciMessage {
         self.mailbox.get_send_ptr()
     }
@@ -483,9 +631,37 @@ pub struct Vm {
     ///      lock VmInner to acquire VCpuState.
     pub vcpus: ArrayVec<[VCpu; MAX_CPUS]>,
 
+    /// The memory assigned to a secondary VM, identity mapped into its stage-2 page table. The
+    /// VM's kernel is loaded at the start of the first range. It is only set while loading VMs at
+    /// boot.
+    pub mem_ranges: ArrayVec<[MemRange; MAX_VM_MEM_RANGES]>,
+
+    /// The VM's image, kept intact in the initrd if the VM is restartable so it can be loaded
+    /// again when the VM is reset. It is only set while loading VMs at boot.
+    pub image: Option<MemIter>,
+
+    /// Whether stage-2 faults on the VM's memory ranges it doesn't own are reported to the primary
+    /// VM, for it to supply the pages. It is only set while loading VMs at boot.
+    pub demand_paged: bool,
+
     /// See api.c for the partial ordering on locks.
     pub inner: SpinLock<VmInner>,
     pub aborting: AtomicBool,
+
+    /// Whether the VM's loading was deferred and it hasn't finished loading yet. This lets running
+    /// a vCPU check for it without locking `inner`.
+    pub load_pending: AtomicBool,
+
+    /// The time, in virtual counter ticks, it took to load the VM, or 0 if it hasn't been loaded.
+    pub load_ticks: AtomicU64,
+
+    /// The number of vCPUs marked as aborted since the VM started aborting. Once all of them are,
+    /// the VM's resources are reclaimed.
+    pub aborted_vcpus: AtomicUsize,
+
+    /// The page the VM reads its vCPUs' times from, if it configured one. It is only set once,
+    /// with `inner` locked.
+    steal_time: AtomicPtr<StealTimePage>,
 }
 
 impl Vm {
@@ -505,7 +681,16 @@ impl Vm {
             self.vcpus = MaybeUninit::uninit().assume_init();
             self.vcpus.set_len(0);
         }
+        unsafe {
+            ptr::write(&mut self.mem_ranges, ArrayVec::new());
+            ptr::write(&mut self.image, None);
+        }
+        self.demand_paged = false;
         self.aborting = AtomicBool::new(false);
+        self.load_pending = AtomicBool::new(false);
+        self.load_ticks = AtomicU64::new(0);
+        self.aborted_vcpus = AtomicUsize::new(0);
+        self.steal_time = AtomicPtr::new(ptr::null_mut());
         unsafe {
             let self_ptr = self as *mut _;
             self.inner.get_mut().init(self_ptr, ppool)?;
@@ -521,6 +706,14 @@ impl Vm {
         Ok(())
     }
 
+    /// Returns whether the given address is in one of the VM's memory ranges.
+    pub fn mem_ranges_contain(&self, ipa: ipaddr_t) -> bool {
+        let addr = ipa_addr(ipa);
+        self.mem_ranges
+            .iter()
+            .any(|range| pa_addr(range.begin) <= addr && addr < pa_addr(range.end))
+    }
+
     /// Returns the root address of the page table of this VM. It is safe not to
     /// lock `self.inner` because the value of `ptable.as_raw()` doesn't change
     /// after `ptable` is initialized. Of course, actual page table may vary
@@ -533,6 +726,43 @@ impl Vm {
     pub fn debug_log(&self, c: c_char) {
         self.inner.lock().debug_log(self.id, c)
     }
+
+    pub fn debug_log_chunk(&self, chunk: &[c_char]) {
+        let mut inner = self.inner.lock();
+        for c in chunk {
+            inner.debug_log(self.id, *c);
+        }
+    }
+
+    pub fn get_steal_time(&self) -> Option<&StealTimePage> {
+        unsafe { self.steal_time.load(Ordering::Acquire).as_ref() }
+    }
+
+    /// Publishes the times of the VM's vCPUs to the given page from now on. The page must be
+    /// mapped as writable in the hypervisor address space, and `inner` must be locked.
+    pub fn set_steal_time(&self, page: *mut RawPage) {
+        let page = page as *mut StealTimePage;
+
+        unsafe {
+            ptr::write_bytes(page as *mut RawPage, 0, 1);
+            for (vcpu, times) in self.vcpus.iter().zip((*page).vcpus.iter()) {
+                times.copy_from(&vcpu.times);
+            }
+        }
+
+        self.steal_time.store(page, Ordering::Release);
+    }
+
+    /// Stops publishing the times of the VM's vCPUs, returning the page they were published to,
+    /// if any. `inner` must be locked.
+    pub fn take_steal_time(&self) -> Option<paddr_t> {
+        let page = self.steal_time.swap(ptr::null_mut(), Ordering::Relaxed);
+        if page.is_null() {
+            None
+        } else {
+            Some(pa_init(page as usize))
+        }
+    }
 }
 
 pub struct VmManager {
@@ -589,6 +819,10 @@ impl VmManager {
     pub fn len(&self) -> spci_vm_count_t {
         self.vms.len() as _
     }
+
+    pub fn iter(&self) -> impl Iterator<Item = &Vm> {
+        self.vms.iter()
+    }
 }
 
 /// Get the vCPU with the given index from the given VM.
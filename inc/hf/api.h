@@ -33,17 +33,44 @@ uint64_t api_vcpu_run(spci_vm_id_t vm_id,
 				       struct vcpu **next);
 int64_t api_vm_configure(ipaddr_t send, ipaddr_t recv, struct vcpu *current,
 			 struct vcpu **next);
+int64_t api_vcpu_state_configure(ipaddr_t page, const struct vcpu *current);
+int64_t api_steal_time_configure(ipaddr_t page, const struct vcpu *current);
 int64_t api_mailbox_clear(struct vcpu *current, struct vcpu **next);
 int64_t api_mailbox_writable_get(const struct vcpu *current);
 int64_t api_mailbox_waiter_get(spci_vm_id_t vm_id, const struct vcpu *current);
+int64_t api_timer_expired_get(const struct vcpu *current);
+int64_t api_vcpu_time_get(spci_vm_id_t vm_id, spci_vcpu_index_t vcpu_idx,
+			  uint32_t time, const struct vcpu *current);
 int64_t api_share_memory(spci_vm_id_t vm_id, ipaddr_t addr, size_t size,
 			 enum hf_share share, struct vcpu *current);
 int64_t api_debug_log(char c, struct vcpu *current);
+int64_t api_debug_log_chunk(size_t len, uint64_t chars0, uint64_t chars1,
+			    struct vcpu *current);
+int64_t api_vm_mem_range_get(uint32_t index, bool end,
+			     const struct vcpu *current);
+int64_t api_boot_time_get(uint32_t phase, spci_vm_id_t vm_id,
+			  const struct vcpu *current);
+int64_t api_vm_reset(spci_vm_id_t vm_id, const struct vcpu *current);
+int64_t api_vm_dirty_log_enable(spci_vm_id_t vm_id, bool enable,
+				const struct vcpu *current);
+int64_t api_vm_dirty_log_get(spci_vm_id_t vm_id, ipaddr_t begin,
+			     const struct vcpu *current);
+int64_t api_vm_access_log_reset(spci_vm_id_t vm_id,
+				const struct vcpu *current);
+int64_t api_vm_access_log_get(spci_vm_id_t vm_id, ipaddr_t begin,
+			      const struct vcpu *current);
+int64_t api_vm_balloon_inflate(spci_vm_id_t vm_id, uint64_t pages,
+			       const struct vcpu *current);
+int64_t api_balloon_request_get(const struct vcpu *current);
+int64_t api_vm_page_supply(spci_vm_id_t vm_id, ipaddr_t ipa,
+			   const struct vcpu *current);
 
 struct vcpu *api_preempt(struct vcpu *current);
 struct vcpu *api_wait_for_interrupt(struct vcpu *current);
 struct vcpu *api_vcpu_off(struct vcpu *current);
 struct vcpu *api_abort(struct vcpu *current);
+struct vcpu *api_page_fault(struct vcpu *current,
+			    struct vcpu_fault_info *f);
 struct vcpu *api_wake_up(struct vcpu *current, struct vcpu *target_vcpu);
 
 int64_t api_interrupt_enable(uint32_t intid, bool enable, struct vcpu *current);
@@ -51,12 +78,17 @@ uint32_t api_interrupt_get(struct vcpu *current);
 int64_t api_interrupt_inject(spci_vm_id_t target_vm_id,
 			     spci_vcpu_index_t target_vcpu_idx, uint32_t intid,
 			     struct vcpu *current, struct vcpu **next);
+int64_t api_interrupt_inject_all(spci_vm_id_t target_vm_id, uint32_t intid,
+				 const struct vcpu *current);
 
 spci_return_t api_spci_msg_send(uint32_t attributes, struct vcpu *current,
 				struct vcpu **next);
-int32_t api_spci_msg_recv(uint32_t attributes, struct vcpu *current,
-			  struct vcpu **next);
+int32_t api_spci_msg_recv(uint32_t attributes, uint64_t timeout_ns,
+			  struct vcpu *current, struct vcpu **next);
 int32_t api_spci_yield(struct vcpu *current, struct vcpu **next);
+int64_t api_vcpu_yield_to(spci_vm_id_t target_vm_id,
+			  spci_vcpu_index_t target_vcpu_idx,
+			  struct vcpu *current, struct vcpu **next);
 int32_t api_spci_version(void);
 spci_return_t api_spci_share_memory(struct vm_locked to_locked,
 				    struct vm_locked from_locked,
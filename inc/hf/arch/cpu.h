@@ -19,6 +19,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdnoreturn.h>
 
 #include "hf/arch/types.h"
 
@@ -26,6 +27,8 @@
 
 #include "vmapi/hf/spci.h"
 
+struct cpu;
+
 /**
  * Disables interrutps.
  */
@@ -59,3 +62,15 @@ void arch_regs_set_pc_arg(struct arch_regs *r, ipaddr_t pc, uintreg_t arg);
  * by any other physical CPU.
  */
 void arch_regs_set_retval(struct arch_regs *r, uintreg_t v);
+
+/**
+ * Turns on the given physical CPU to help the boot CPU with initialisation. It
+ * enters `boot_worker_main` rather than running a vCPU. Returns false if the
+ * CPU couldn't be turned on, in which case the boot CPU does the work itself.
+ */
+bool arch_cpu_start_boot_worker(struct cpu *c);
+
+/**
+ * Turns off the calling CPU once it has finished helping the boot CPU.
+ */
+noreturn void arch_cpu_stop_boot_worker(void);
@@ -111,6 +111,12 @@ void arch_mm_invalidate_stage1_range(vaddr_t va_begin, vaddr_t va_end);
  */
 void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end);
 
+/**
+ * Invalidates the whole stage-2 TLB of the given VM, with the given root page
+ * table, which need not be the one whose page table is current.
+ */
+void arch_mm_invalidate_stage2_vm(uint16_t vm_id, paddr_t table);
+
 /**
  * Writes back the given range of virtual memory to such a point that all cores
  * and devices will see the updated values. The corresponding cache lines are
@@ -167,3 +173,9 @@ bool arch_mm_init(void);
  * Enables the current CPU with arch specific memory management state.
  */
 void arch_mm_enable(paddr_t table);
+
+/**
+ * Writes back the memory management configuration read by `arch_mm_enable`, so
+ * that CPUs turned on later can read it before they enable their caches.
+ */
+void arch_mm_flush_config(void);
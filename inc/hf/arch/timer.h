@@ -75,3 +75,30 @@ uint64_t arch_timer_remaining_ticks_current(void);
  * the timer is not enabled.
  */
 uint64_t arch_timer_remaining_ns_current(void);
+
+/**
+ * Returns the absolute deadline, in counter ticks, of the virtual timer of the
+ * currently active vCPU. This is undefined if the timer is not enabled.
+ */
+uint64_t arch_timer_deadline_current(void);
+
+/**
+ * Returns the current value of the counter the virtual timer compares against.
+ */
+uint64_t arch_timer_count(void);
+
+/**
+ * Converts a number of counter ticks to the equivalent number of nanoseconds.
+ */
+uint64_t arch_timer_ticks_to_ns(uint64_t ticks);
+
+/**
+ * Converts a number of nanoseconds to the equivalent number of counter ticks.
+ */
+uint64_t arch_timer_ns_to_ticks(uint64_t ns);
+
+/**
+ * Arms the hypervisor timer of the current physical CPU to fire at the given
+ * absolute counter value, or disables it if `ticks` is UINT64_MAX.
+ */
+void arch_timer_hyp_set_deadline(uint64_t ticks);
@@ -101,6 +101,7 @@ size_t cpu_index(struct cpu *c);
 bool cpu_on(struct cpu *c, ipaddr_t entry, uintreg_t arg);
 void cpu_off(struct cpu *c);
 struct cpu *cpu_find(cpu_id_t id);
+uint64_t cpu_timer_deadline(struct cpu *c);
 
 struct vcpu_execution_locked vcpu_lock(struct vcpu *vcpu);
 bool vcpu_try_lock(struct vcpu *vcpu, struct vcpu_execution_locked *locked);
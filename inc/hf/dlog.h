@@ -36,4 +36,57 @@ void vdlog(const char *fmt, va_list args);
 #define vdlog(fmt, args)
 #endif
 
+/*
+ * Levels of hypervisor diagnostics, from the most to the least important. The
+ * build selects the least important level logged through LOG_LEVEL; the
+ * dlog_<level> calls below it are compiled out along with their arguments.
+ */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define dlog_error(...) dlog(__VA_ARGS__)
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define dlog_warn(...) dlog(__VA_ARGS__)
+#else
+#define dlog_warn(...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define dlog_info(...) dlog(__VA_ARGS__)
+#else
+#define dlog_info(...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define dlog_debug(...) dlog(__VA_ARGS__)
+#else
+#define dlog_debug(...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define dlog_trace(...) dlog(__VA_ARGS__)
+#else
+#define dlog_trace(...)
+#endif
+
 void dlog_flush_vm_buffer(spci_vm_id_t id, char buffer[], size_t length);
+
+/**
+ * Writes the complete lines logged so far on all CPUs to the serial device,
+ * unless another CPU is already doing so.
+ */
+void dlog_drain(void);
+
+/**
+ * Writes everything logged so far to the serial device, and logs directly to
+ * it from now on. Only used on panic.
+ */
+void dlog_flush(void);
@@ -70,6 +70,20 @@
 #define MM_MODE_UNOWNED 0x0020
 #define MM_MODE_SHARED  0x0040
 
+/*
+ * Writable stage-2 memory can also be write-protected for dirty logging: the
+ * mode still includes write access, but writes fault to the hypervisor so
+ * that they can be logged.
+ */
+#define MM_MODE_DIRTY_LOG 0x0080
+
+/*
+ * Valid stage-2 memory can also have its access flag cleared, so that the
+ * first access to it is logged, by the hardware if it can set the flag or by a
+ * fault to the hypervisor otherwise.
+ */
+#define MM_MODE_ACCESS_LOG 0x0100
+
 #define MM_FLAG_COMMIT  0x01
 #define MM_FLAG_UNMAP   0x02
 #define MM_FLAG_STAGE1  0x04
@@ -83,6 +83,30 @@ enum hf_vcpu_run_code {
 	 * `HF_VCPU_RUN_WAKE_UP` for all the other vCPUs of the VM.
 	 */
 	HF_VCPU_RUN_ABORTED = 7,
+
+	/**
+	 * The vCPU has voluntarily yielded the CPU in favour of another vCPU,
+	 * specified by `hf_vcpu_run_return.directed_yield`, which it is waiting
+	 * on. The scheduler SHOULD run the target vCPU if it is runnable and
+	 * MUST call `hf_vcpu_run` on the yielding vCPU at a later point.
+	 */
+	HF_VCPU_RUN_DIRECTED_YIELD = 8,
+
+	/**
+	 * The vCPU of a VM declared `demand_paged` has faulted on a page of the
+	 * VM's memory which the VM doesn't own, specified by
+	 * `hf_vcpu_run_return.page_fault`. The scheduler SHOULD supply the page
+	 * with `hf_vm_page_supply`, and MUST call `hf_vcpu_run` on the vCPU at
+	 * a later point, which retries the access.
+	 */
+	HF_VCPU_RUN_PAGE_FAULT = 9,
+};
+
+/** The access which caused a fault reported with HF_VCPU_RUN_PAGE_FAULT. */
+enum hf_page_fault_access {
+	HF_PAGE_FAULT_READ = 0,
+	HF_PAGE_FAULT_WRITE = 1,
+	HF_PAGE_FAULT_EXECUTE = 2,
 };
 
 struct hf_vcpu_run_return {
@@ -92,12 +116,20 @@ struct hf_vcpu_run_return {
 			spci_vm_id_t vm_id;
 			spci_vcpu_index_t vcpu;
 		} wake_up;
+		struct {
+			spci_vm_id_t vm_id;
+			spci_vcpu_index_t vcpu;
+		} directed_yield;
 		struct {
 			spci_vm_id_t vm_id;
 		} message;
 		struct {
 			uint64_t ns;
 		} sleep;
+		struct {
+			hf_ipaddr_t ipa;
+			enum hf_page_fault_access access;
+		} page_fault;
 	};
 };
 
@@ -121,6 +153,139 @@ enum hf_share {
 	HF_MEMORY_SHARE,
 };
 
+/** The number of VMs covered by the vCPU run-state page. */
+#define HF_VCPU_RUN_STATE_VMS 16
+
+/** The number of vCPUs of each VM covered by the vCPU run-state page. */
+#define HF_VCPU_RUN_STATE_VCPUS_PER_VM 16
+
+/** The state of a vCPU as published in the vCPU run-state page. */
+enum hf_vcpu_state {
+	/** The vCPU is switched off. */
+	HF_VCPU_STATE_OFF = 0,
+
+	/** The vCPU is ready to be run, or is running. */
+	HF_VCPU_STATE_READY = 1,
+
+	/** The vCPU is waiting for a message. */
+	HF_VCPU_STATE_BLOCKED_MAILBOX = 2,
+
+	/** The vCPU is waiting for an interrupt. */
+	HF_VCPU_STATE_BLOCKED_INTERRUPT = 3,
+
+	/** The vCPU has aborted. */
+	HF_VCPU_STATE_ABORTED = 4,
+};
+
+/**
+ * The run state of a vCPU, as published by Hafnium to the primary VM in the
+ * vCPU run-state page. Hafnium updates it with plain stores, so a field may
+ * change between two reads.
+ */
+struct hf_vcpu_run_state {
+	/** One of `enum hf_vcpu_state`. */
+	uint8_t state;
+
+	/** Whether the vCPU has interrupts which are both enabled and pending. */
+	uint8_t interrupt_pending;
+
+	/**
+	 * Whether the vCPU has become runnable, e.g. because of an injected
+	 * interrupt or a message, and the scheduler needs to run it. Cleared
+	 * when the vCPU is next run.
+	 */
+	uint8_t needs_wake;
+
+	uint8_t reserved[5];
+
+	/**
+	 * The absolute deadline, in virtual counter ticks, of the timer of a
+	 * blocked vCPU, or UINT64_MAX if it has none.
+	 */
+	uint64_t timer_deadline;
+};
+
+/**
+ * Layout of the vCPU run-state page, indexed by VM index (i.e. the VM ID minus
+ * HF_VM_ID_OFFSET) and vCPU index.
+ */
+struct hf_vcpu_run_state_page {
+	struct hf_vcpu_run_state vcpus[HF_VCPU_RUN_STATE_VMS]
+				      [HF_VCPU_RUN_STATE_VCPUS_PER_VM];
+};
+
+/** The number of vCPUs covered by the steal-time page. */
+#define HF_STEAL_TIME_VCPUS 16
+
+/** What a vCPU spends its time on, as accounted by Hafnium. */
+enum hf_vcpu_time {
+	/** The vCPU is running. */
+	HF_VCPU_TIME_RUNNING = 0,
+
+	/** The vCPU is waiting for an interrupt. */
+	HF_VCPU_TIME_BLOCKED_INTERRUPT = 1,
+
+	/** The vCPU is waiting for a message. */
+	HF_VCPU_TIME_BLOCKED_MAILBOX = 2,
+
+	/**
+	 * The vCPU is ready to be run, but the primary VM's scheduler has not
+	 * run it.
+	 */
+	HF_VCPU_TIME_STEAL = 3,
+
+	/** The number of kinds of time accounted. */
+	HF_VCPU_TIME_COUNT,
+};
+
+/** The phases of boot, as timed by Hafnium. */
+enum hf_boot_phase {
+	/** Building the hypervisor's page table. */
+	HF_BOOT_PHASE_PAGE_TABLE = 0,
+
+	/** Parsing the boot parameters from the FDT. */
+	HF_BOOT_PHASE_FDT = 1,
+
+	/** Parsing the manifest from the FDT. */
+	HF_BOOT_PHASE_MANIFEST = 2,
+
+	/** Mapping and indexing the initrd. */
+	HF_BOOT_PHASE_INITRD = 3,
+
+	/** Loading the primary VM. */
+	HF_BOOT_PHASE_LOAD_PRIMARY = 4,
+
+	/**
+	 * Loading the secondary VMs, except for those whose loading is
+	 * deferred until they first run.
+	 */
+	HF_BOOT_PHASE_LOAD_SECONDARY = 5,
+
+	/** Patching the primary VM's FDT. */
+	HF_BOOT_PHASE_PATCH_FDT = 6,
+
+	/** Defragmenting the hypervisor's page table. */
+	HF_BOOT_PHASE_DEFRAG = 7,
+
+	/** Loading a given secondary VM, whenever it was loaded. */
+	HF_BOOT_PHASE_LOAD_VM = 8,
+};
+
+/**
+ * The time, in virtual counter ticks, a vCPU has spent on each
+ * `enum hf_vcpu_time`. The time is accounted when the vCPU is switched to or
+ * from. Time a blocked vCPU spends able to run again, e.g. after an interrupt
+ * was injected into it, is steal time.
+ */
+struct hf_vcpu_times {
+	uint64_t times[HF_VCPU_TIME_COUNT];
+};
+
+/** Layout of the steal-time page of a VM, indexed by vCPU index. */
+struct hf_steal_time_page {
+	struct hf_vcpu_times vcpus[HF_STEAL_TIME_VCPUS];
+};
+
 /**
  * Decode an hf_vcpu_run_return struct from the 64-bit packing ABI.
  */
@@ -136,6 +301,10 @@ static inline struct hf_vcpu_run_return hf_vcpu_run_return_decode(uint64_t res)
 		ret.wake_up.vm_id = res >> 32;
 		ret.wake_up.vcpu = (res >> 16) & 0xffff;
 		break;
+	case HF_VCPU_RUN_DIRECTED_YIELD:
+		ret.directed_yield.vm_id = res >> 32;
+		ret.directed_yield.vcpu = (res >> 16) & 0xffff;
+		break;
 	case HF_VCPU_RUN_MESSAGE:
 		ret.message.vm_id = res >> 8;
 		break;
@@ -143,6 +312,11 @@ static inline struct hf_vcpu_run_return hf_vcpu_run_return_decode(uint64_t res)
 	case HF_VCPU_RUN_WAIT_FOR_MESSAGE:
 		ret.sleep.ns = res >> 8;
 		break;
+	case HF_VCPU_RUN_PAGE_FAULT:
+		ret.page_fault.ipa = res & ~UINT64_C(0xfff);
+		ret.page_fault.access =
+			(enum hf_page_fault_access)((res >> 8) & 0xf);
+		break;
 	default:
 		break;
 	}
@@ -36,6 +36,23 @@
 #define HF_INTERRUPT_GET        0xff0c
 #define HF_INTERRUPT_INJECT     0xff0d
 #define HF_SHARE_MEMORY         0xff0e
+#define HF_VCPU_YIELD_TO        0xff0f
+#define HF_TIMER_EXPIRED_GET    0xff10
+#define HF_INTERRUPT_INJECT_ALL 0xff11
+#define HF_VCPU_STATE_CONFIGURE 0xff12
+#define HF_VCPU_TIME_GET        0xff13
+#define HF_STEAL_TIME_CONFIGURE 0xff14
+#define HF_DEBUG_LOG_CHUNK      0xff15
+#define HF_VM_MEM_RANGE_GET     0xff16
+#define HF_BOOT_TIME_GET        0xff17
+#define HF_VM_RESET             0xff18
+#define HF_VM_DIRTY_LOG_ENABLE  0xff19
+#define HF_VM_DIRTY_LOG_GET     0xff1a
+#define HF_VM_ACCESS_LOG_RESET  0xff1b
+#define HF_VM_ACCESS_LOG_GET    0xff1c
+#define HF_VM_BALLOON_INFLATE   0xff1d
+#define HF_BALLOON_REQUEST_GET  0xff1e
+#define HF_VM_PAGE_SUPPLY       0xff1f
 
 /* This matches what Trusty and its ATF module currently use. */
 #define HF_DEBUG_LOG            0xbd000000
@@ -72,6 +89,26 @@ static inline spci_vcpu_count_t hf_vcpu_get_count(spci_vm_id_t vm_id)
 	return hf_call(HF_VCPU_GET_COUNT, vm_id, 0, 0);
 }
 
+/**
+ * Returns the start of the given range of the calling VM's memory, counting
+ * from 0, or -1 if there is no such range. A secondary VM's kernel is loaded at
+ * the start of its first range, and is passed that range's size on boot. Its
+ * memory is made up of several ranges if there wasn't enough contiguous memory.
+ */
+static inline int64_t hf_vm_mem_range_begin(uint32_t index)
+{
+	return hf_call(HF_VM_MEM_RANGE_GET, index, 0, 0);
+}
+
+/**
+ * Returns the end of the given range of the calling VM's memory, counting from
+ * 0, or -1 if there is no such range.
+ */
+static inline int64_t hf_vm_mem_range_end(uint32_t index)
+{
+	return hf_call(HF_VM_MEM_RANGE_GET, index, 1, 0);
+}
+
 /**
  * Runs the given vcpu of the given vm.
  *
@@ -93,6 +130,40 @@ static inline int64_t spci_yield(void)
 	return hf_call(SPCI_YIELD_32, 0, 0, 0);
 }
 
+/**
+ * Retrieves the next VM with vCPUs whose virtual timer has expired while they
+ * were blocked on the calling physical CPU. Only primary VMs are allowed to
+ * call this.
+ *
+ * Hafnium arms the EL2 physical timer for these deadlines while the primary
+ * runs, so the primary can call this repeatedly from its handler for that
+ * interrupt instead of keeping a timer for each blocked vCPU. Each call
+ * re-arms the timer for the next deadline of the vCPUs still tracked.
+ *
+ * Returns -1 on failure or if there are no more expired vCPUs; otherwise the
+ * VM id in bits [47:32] and a bitmap of its now runnable vCPUs in bits [31:0].
+ */
+static inline int64_t hf_timer_expired_get(void)
+{
+	return hf_call(HF_TIMER_EXPIRED_GET, 0, 0, 0);
+}
+
+/**
+ * Hints that the vCPU is willing to yield its current use of the physical CPU
+ * in favour of the given target vCPU, e.g. because it is spinning on a lock
+ * held by the target. The target is reported to the primary VM's scheduler.
+ *
+ * Returns:
+ *  - -1 on failure because the target VM or vCPU doesn't exist or is the
+ *    calling vCPU.
+ *  - 0 on success.
+ */
+static inline int64_t hf_vcpu_yield_to(spci_vm_id_t target_vm_id,
+				       spci_vcpu_index_t target_vcpu_idx)
+{
+	return hf_call(HF_VCPU_YIELD_TO, target_vm_id, target_vcpu_idx, 0);
+}
+
 /**
  * Configures the pages to send/receive data through. The pages must not be
  * shared.
@@ -108,6 +179,35 @@ static inline int64_t hf_vm_configure(hf_ipaddr_t send, hf_ipaddr_t recv)
 	return hf_call(HF_VM_CONFIGURE, send, recv, 0);
 }
 
+/**
+ * Configures the page the hypervisor publishes the run state of every vCPU to,
+ * laid out as `struct hf_vcpu_run_state_page`. The scheduler can then read it
+ * to find runnable vCPUs instead of calling hf_vcpu_run on each of them. Only
+ * primary VMs are allowed to call this, and only once, before running any
+ * secondary vCPU. The page must not be shared, and becomes read-only to the
+ * caller.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
+static inline int64_t hf_vcpu_state_configure(hf_ipaddr_t page)
+{
+	return hf_call(HF_VCPU_STATE_CONFIGURE, page, 0, 0);
+}
+
+/**
+ * Configures the page the hypervisor publishes the times of the calling VM's
+ * vCPUs to, laid out as `struct hf_steal_time_page`. This includes the time
+ * they were ready to run but the primary VM's scheduler didn't run them. Only
+ * secondary VMs are allowed to call this, and only once. The page must not be
+ * shared, and becomes read-only to the caller.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
+static inline int64_t hf_steal_time_configure(hf_ipaddr_t page)
+{
+	return hf_call(HF_STEAL_TIME_CONFIGURE, page, 0, 0);
+}
+
 /**
  * Copies data from the sender's send buffer to the recipient's receive buffer.
  *
@@ -148,6 +248,25 @@ static inline int32_t spci_msg_recv(int32_t attributes)
 	return hf_call(SPCI_MSG_RECV_32, attributes, 0, 0);
 }
 
+/**
+ * Like spci_msg_recv, but if it blocks it gives up once `timeout_ns`
+ * nanoseconds have passed without a message. The deadline is reported to the
+ * primary VM's scheduler like that of the virtual timer, so it can run the
+ * vCPU again in time. A `timeout_ns` of 0 means no timeout.
+ *
+ * Returns:
+ *  - SPCI_SUCCESS if a message is successfully received.
+ *  - SPCI_INTERRUPTED if the caller is the primary VM or an interrupt happened
+ *    during the call.
+ *  - SPCI_RETRY if there was no pending message, and `block` was false.
+ *  - SPCI_TIMEOUT if the timeout passed without a message.
+ */
+static inline int32_t spci_msg_recv_timeout(int32_t attributes,
+					    uint64_t timeout_ns)
+{
+	return hf_call(SPCI_MSG_RECV_32, attributes, timeout_ns, 0);
+}
+
 /**
  * Clears the caller's mailbox so a new message can be received.
  *
@@ -163,6 +282,162 @@ static inline int64_t hf_mailbox_clear(void)
 	return hf_call(HF_MAILBOX_CLEAR, 0, 0, 0);
 }
 
+/**
+ * Returns the time, in virtual counter ticks, the given vCPU has spent on the
+ * given activity. The time is accounted when the vCPU is switched to or from,
+ * so the current stint of a running vCPU is not included. Only primary VMs are
+ * allowed to call this.
+ *
+ * Returns -1 on failure because the VM or vCPU doesn't exist, the activity is
+ * invalid, or the caller is not the primary VM.
+ */
+static inline int64_t hf_vcpu_time_get(spci_vm_id_t vm_id,
+				       spci_vcpu_index_t vcpu_idx,
+				       enum hf_vcpu_time time)
+{
+	return hf_call(HF_VCPU_TIME_GET, vm_id, vcpu_idx, time);
+}
+
+/**
+ * Returns the time, in virtual counter ticks, Hafnium spent on the given phase
+ * of boot. For HF_BOOT_PHASE_LOAD_VM, returns the time taken to load the given
+ * secondary VM instead, or 0 if it hasn't been loaded yet. Only primary VMs are
+ * allowed to call this.
+ *
+ * Returns -1 on failure because the phase or VM is invalid, or the caller is
+ * not the primary VM.
+ */
+static inline int64_t hf_boot_time_get(enum hf_boot_phase phase,
+				       spci_vm_id_t vm_id)
+{
+	return hf_call(HF_BOOT_TIME_GET, phase, vm_id, 0);
+}
+
+/**
+ * Resets the given secondary VM to its state at boot: its vCPUs are stopped,
+ * the memory it shared is revoked, its mailbox is cleared, its image is loaded
+ * again into its memory, and vCPU 0 is started as at boot. Only primary VMs
+ * are allowed to call this, and only for VMs declared `restartable` in the
+ * manifest.
+ *
+ * Returns -1 on failure because the VM is not restartable, one of its vCPUs is
+ * running, or its memory is not owned by the primary VM. In the second case
+ * the VM is aborted, and it can be reset once the vCPU has stopped running.
+ * Returns 0 on success.
+ */
+static inline int64_t hf_vm_reset(spci_vm_id_t vm_id)
+{
+	return hf_call(HF_VM_RESET, vm_id, 0, 0);
+}
+
+/**
+ * Enables or disables dirty logging for the given secondary VM. While it is
+ * enabled, the pages the VM writes are logged, to be fetched with
+ * hf_vm_dirty_log_get. Enabling it again forgets the pages logged so far. Only
+ * primary VMs are allowed to call this.
+ *
+ * Returns -1 on failure, or 0 on success.
+ */
+static inline int64_t hf_vm_dirty_log_enable(spci_vm_id_t vm_id, bool enable)
+{
+	return hf_call(HF_VM_DIRTY_LOG_ENABLE, vm_id, enable, 0);
+}
+
+/**
+ * Returns a bitmap of which of the HF_MEMORY_LOG_PAGES pages from the given
+ * page-aligned address the given secondary VM has written since dirty logging
+ * was enabled or they were last returned, and clears it. Bit n is for the page
+ * at begin + n * PAGE_SIZE. Pages mapped into the VM while dirty logging is
+ * enabled are returned as written. Only primary VMs are allowed to call this.
+ *
+ * Writes made by the hypervisor on the VM's behalf, such as delivering
+ * messages to its mailbox, are not logged.
+ *
+ * Returns -1 on failure, for example if dirty logging is not enabled.
+ */
+static inline int64_t hf_vm_dirty_log_get(spci_vm_id_t vm_id,
+					  hf_ipaddr_t begin)
+{
+	return hf_call(HF_VM_DIRTY_LOG_GET, vm_id, begin, 0);
+}
+
+/**
+ * Clears the access flags of all of the given secondary VM's memory, so that
+ * the pages it accesses from then on can be found with hf_vm_access_log_get.
+ * This can be used to estimate the VM's working set. Only primary VMs are
+ * allowed to call this.
+ *
+ * Returns -1 on failure, or the number of pages the VM accessed since the
+ * flags were last cleared. Before they are first cleared, all of the VM's
+ * memory counts as accessed.
+ */
+static inline int64_t hf_vm_access_log_reset(spci_vm_id_t vm_id)
+{
+	return hf_call(HF_VM_ACCESS_LOG_RESET, vm_id, 0, 0);
+}
+
+/**
+ * Returns a bitmap of which of the HF_MEMORY_LOG_PAGES pages from the given
+ * page-aligned address the given secondary VM has accessed since its access
+ * flags were last cleared by hf_vm_access_log_reset. Bit n is for the page at
+ * begin + n * PAGE_SIZE. The flags are kept for whole blocks of memory, so all
+ * the pages of a block are accessed together. Only primary VMs are allowed to
+ * call this.
+ *
+ * Returns -1 on failure.
+ */
+static inline int64_t hf_vm_access_log_get(spci_vm_id_t vm_id,
+					   hf_ipaddr_t begin)
+{
+	return hf_call(HF_VM_ACCESS_LOG_GET, vm_id, begin, 0);
+}
+
+/**
+ * Asks the given secondary VM to return the given number of pages of its
+ * memory to the primary VM, replacing any previous request, or cancels the
+ * request if the number is 0. The VM is notified with the HF_BALLOON_INTID
+ * interrupt, and returns the pages by donating them to the primary VM with
+ * spci_memory_donate, all in one message if it likes, as each donation is taken
+ * off the request. The primary VM can give pages back, deflating the balloon,
+ * by donating them to the VM in the same way. Only primary VMs are allowed to
+ * call this.
+ *
+ * Returns:
+ *  - -1 on failure.
+ *  - 0 on success if no further action is needed.
+ *  - 1 if the VM was notified and the caller now needs to wake up or kick its
+ *    first vCPU, as for hf_interrupt_inject.
+ */
+static inline int64_t hf_vm_balloon_inflate(spci_vm_id_t vm_id, uint64_t pages)
+{
+	return hf_call(HF_VM_BALLOON_INFLATE, vm_id, pages, 0);
+}
+
+/**
+ * Returns the number of pages the primary VM has asked the calling VM to
+ * return to it, with hf_vm_balloon_inflate, which it hasn't donated yet.
+ */
+static inline int64_t hf_balloon_request_get(void)
+{
+	return hf_call(HF_BALLOON_REQUEST_GET, 0, 0, 0);
+}
+
+/**
+ * Supplies the page at the given page-aligned address to the given secondary
+ * VM declared `demand_paged`, after it faulted on the page and the fault was
+ * reported with HF_VCPU_RUN_PAGE_FAULT. The page moves from the calling VM,
+ * which must own it with exclusive access, along with its contents, so the
+ * caller can fill it in first. Running the faulting vCPU then retries the
+ * access. Pages can't be supplied to a VM which has aborted. Only primary VMs
+ * are allowed to call this.
+ *
+ * Returns -1 on failure, or 0 on success.
+ */
+static inline int64_t hf_vm_page_supply(spci_vm_id_t vm_id, hf_ipaddr_t ipa)
+{
+	return hf_call(HF_VM_PAGE_SUPPLY, vm_id, ipa, 0);
+}
+
 /**
  * Retrieves the next VM whose mailbox became writable. For a VM to be notified
  * by this function, the caller must have called api_mailbox_send before with
@@ -232,6 +507,24 @@ static inline int64_t hf_interrupt_inject(spci_vm_id_t target_vm_id,
 		       intid);
 }
 
+/**
+ * Injects a virtual interrupt of the given ID into every vCPU of the given
+ * target VM in one call. Only primary VMs are allowed to call this. As with
+ * hf_interrupt_inject, this doesn't cause the vCPUs to actually be run
+ * immediately.
+ *
+ * Returns:
+ *  - -1 on failure because the target VM doesn't exist, the interrupt ID is
+ *    invalid, or the caller is not the primary VM.
+ *  - otherwise a bitmap, indexed by vCPU index, of the vCPUs the primary VM now
+ *    needs to wake up or kick.
+ */
+static inline int64_t hf_interrupt_inject_all(spci_vm_id_t target_vm_id,
+					      uint32_t intid)
+{
+	return hf_call(HF_INTERRUPT_INJECT_ALL, target_vm_id, intid, 0);
+}
+
 /**
  * Shares a region of memory with another VM.
  *
@@ -257,6 +550,32 @@ static inline int64_t hf_debug_log(char c)
 	return hf_call(HF_DEBUG_LOG, c, 0, 0);
 }
 
+/** The number of characters hf_debug_log_chunk passes in one call. */
+#define HF_DEBUG_LOG_CHUNK_MAX 16
+
+/**
+ * Sends up to HF_DEBUG_LOG_CHUNK_MAX characters of the given string to the
+ * debug log for the VM in a single call. They are passed in registers and
+ * treated as if sent by hf_debug_log one at a time.
+ *
+ * Returns the number of characters sent, or -1 if it failed for some reason.
+ */
+static inline int64_t hf_debug_log_chunk(const char *s, size_t len)
+{
+	uint64_t chars[2] = {0, 0};
+	size_t i;
+
+	if (len > HF_DEBUG_LOG_CHUNK_MAX) {
+		len = HF_DEBUG_LOG_CHUNK_MAX;
+	}
+
+	for (i = 0; i < len; ++i) {
+		chars[i / 8] |= (uint64_t)(uint8_t)s[i] << ((i % 8) * 8);
+	}
+
+	return hf_call(HF_DEBUG_LOG_CHUNK, len, chars[0], chars[1]);
+}
+
 /** Obtains the Hafnium's version of the implemented SPCI specification. */
 static inline int64_t spci_version(void)
 {
@@ -45,6 +45,8 @@
 #define SPCI_DENIED             INT32_C(-6)
 /* TODO: return code currently undefined in SPCI alpha2. */
 #define SPCI_RETRY              INT32_C(-7)
+/* TODO: return code currently undefined in SPCI alpha2. */
+#define SPCI_TIMEOUT            INT32_C(-8)
 
 /* Architected memory sharing message IDs. */
 enum spci_memory_share {
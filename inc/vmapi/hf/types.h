@@ -53,6 +53,12 @@ typedef uintptr_t hf_ipaddr_t;
 /** The amount of data that can be sent to a mailbox. */
 #define HF_MAILBOX_SIZE 4096
 
+/**
+ * The number of pages whose state is returned by hf_vm_dirty_log_get and
+ * hf_vm_access_log_get.
+ */
+#define HF_MEMORY_LOG_PAGES 32
+
 /** The number of virtual interrupt IDs which are supported. */
 #define HF_NUM_INTIDS 64
 
@@ -67,3 +73,9 @@ typedef uintptr_t hf_ipaddr_t;
 
 /** The virtual interrupt ID used for the virtual timer. */
 #define HF_VIRTUAL_TIMER_INTID 3
+
+/**
+ * Interrupt ID indicating the primary VM has asked the VM to return memory to
+ * it, with hf_vm_balloon_inflate.
+ */
+#define HF_BALLOON_INTID 4
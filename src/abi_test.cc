@@ -109,4 +109,28 @@ TEST(abi, hf_vcpu_run_return_decode_aborted)
 	EXPECT_THAT(res.code, Eq(HF_VCPU_RUN_ABORTED));
 }
 
+/**
+ * Decode a directed yield response ignoring the irrelevant bits.
+ */
+TEST(abi, hf_vcpu_run_return_decode_directed_yield)
+{
+	struct hf_vcpu_run_return res =
+		hf_vcpu_run_return_decode(0xbeeff00daf08);
+	EXPECT_THAT(res.code, Eq(HF_VCPU_RUN_DIRECTED_YIELD));
+	EXPECT_THAT(res.directed_yield.vm_id, Eq(0xbeef));
+	EXPECT_THAT(res.directed_yield.vcpu, Eq(0xf00d));
+}
+
+/**
+ * Decode a page fault response.
+ */
+TEST(abi, hf_vcpu_run_return_decode_page_fault)
+{
+	struct hf_vcpu_run_return res =
+		hf_vcpu_run_return_decode(0x8765412109);
+	EXPECT_THAT(res.code, Eq(HF_VCPU_RUN_PAGE_FAULT));
+	EXPECT_THAT(res.page_fault.ipa, Eq(0x8765412000));
+	EXPECT_THAT(res.page_fault.access, Eq(HF_PAGE_FAULT_WRITE));
+}
+
 } /* namespace */
@@ -300,8 +300,8 @@ bool debug_el1_process_access(struct vcpu *vcpu, spci_vm_id_t vm_id,
 #undef X
 		default:
 			value = vcpu_get_regs(vcpu)->r[rt_register];
-			dlog("Unsupported system register read 0x%x\n",
-			     sys_register);
+			dlog_warn("Unsupported system register read 0x%x\n",
+				  sys_register);
 			break;
 		}
 		vcpu_get_regs(vcpu)->r[rt_register] = value;
@@ -316,8 +316,8 @@ bool debug_el1_process_access(struct vcpu *vcpu, spci_vm_id_t vm_id,
 			EL1_DEBUG_REGISTERS_READ_WRITE
 #undef X
 		default:
-			dlog("Unsupported system register write 0x%x\n",
-			     sys_register);
+			dlog_warn("Unsupported system register write 0x%x\n",
+				  sys_register);
 			break;
 		}
 	}
@@ -19,6 +19,7 @@
 #include "hf/arch/barriers.h"
 #include "hf/arch/init.h"
 #include "hf/arch/mm.h"
+#include "hf/arch/timer.h"
 
 #include "hf/api.h"
 #include "hf/check.h"
@@ -74,21 +75,21 @@ void complete_saving_state(struct vcpu *vcpu)
 	api_regs_state_saved(vcpu);
 
 	/*
-	 * If switching away from the primary, copy the current EL0 virtual
-	 * timer registers to the corresponding EL2 physical timer registers.
-	 * This is used to emulate the virtual timer for the primary in case it
-	 * should fire while the secondary is running.
+	 * If switching away from the primary, arm the EL2 physical timer for
+	 * the earlier of the primary's EL0 virtual timer and the deadlines of
+	 * the blocked vCPUs tracked on this CPU. This is used to emulate the
+	 * virtual timer for the primary in case it should fire while the
+	 * secondary is running.
 	 */
 	if (vm_get_id(vcpu_get_vm(vcpu)) == HF_PRIMARY_VM_ID) {
-		/*
-		 * Clear timer control register before copying compare value, to
-		 * avoid a spurious timer interrupt. This could be a problem if
-		 * the interrupt is configured as edge-triggered, as it would
-		 * then be latched in.
-		 */
-		write_msr(cnthp_ctl_el2, 0);
-		write_msr(cnthp_cval_el2, read_msr(cntv_cval_el0));
-		write_msr(cnthp_ctl_el2, read_msr(cntv_ctl_el0));
+		uint64_t deadline = cpu_timer_deadline(vcpu_get_cpu(vcpu));
+
+		if (arch_timer_enabled_current() &&
+		    arch_timer_deadline_current() < deadline) {
+			deadline = arch_timer_deadline_current();
+		}
+
+		arch_timer_hyp_set_deadline(deadline);
 	}
 }
 
@@ -107,13 +108,21 @@ void begin_restoring_state(struct vcpu *vcpu)
 	write_msr(cntv_ctl_el0, vcpu_get_regs(vcpu)->peripherals.cntv_ctl_el0);
 
 	/*
-	 * If we are switching (back) to the primary, disable the EL2 physical
-	 * timer which was being used to emulate the EL0 virtual timer, as the
-	 * virtual timer is now running for the primary again.
+	 * If we are switching (back) to the primary, stop using the EL2
+	 * physical timer to emulate the EL0 virtual timer, as the virtual timer
+	 * is now running for the primary again. Keep it armed for the blocked
+	 * vCPUs tracked on this CPU, so the primary is interrupted when they
+	 * become runnable.
 	 */
 	if (vm_get_id(vcpu_get_vm(vcpu)) == HF_PRIMARY_VM_ID) {
-		write_msr(cnthp_ctl_el2, 0);
-		write_msr(cnthp_cval_el2, 0);
+		arch_timer_hyp_set_deadline(
+			cpu_timer_deadline(vcpu_get_cpu(vcpu)));
+
+		/*
+		 * Returning to the primary's scheduler is not latency-sensitive,
+		 * so write out the logs of all CPUs.
+		 */
+		dlog_drain();
 	}
 }
 
@@ -291,7 +300,6 @@ static bool smc_forwarder(const struct vcpu *vcpu_, smc_res_t *ret)
 static bool spci_handler(uintreg_t func, uintreg_t arg1, uintreg_t arg2,
 			 uintreg_t arg3, uintreg_t *ret, struct vcpu **next)
 {
-	(void)arg2;
 	(void)arg3;
 
 	switch (func & ~SMCCC_CONVENTION_MASK) {
@@ -305,7 +313,7 @@ static bool spci_handler(uintreg_t func, uintreg_t arg1, uintreg_t arg2,
 		*ret = api_spci_msg_send(arg1, current(), next);
 		return true;
 	case SPCI_MSG_RECV_32:
-		*ret = api_spci_msg_recv(arg1, current(), next);
+		*ret = api_spci_msg_recv(arg1, arg2, current(), next);
 		return true;
 	}
 
@@ -336,6 +344,20 @@ static void update_vi(struct vcpu *next)
 	}
 }
 
+/**
+ * Writes out the logs of all CPUs before returning to the primary VM from one
+ * of its calls, including the lines it logged with HF_DEBUG_LOG. The primary
+ * may otherwise idle without switching to another vCPU, leaving them in the
+ * rings.
+ */
+static void drain_primary_logs(struct vcpu *vcpu, struct vcpu *next)
+{
+	if (next == NULL &&
+	    vm_get_id(vcpu_get_vm(vcpu)) == HF_PRIMARY_VM_ID) {
+		dlog_drain();
+	}
+}
+
 /**
  * Processes SMC instruction calls.
  */
@@ -374,6 +396,7 @@ struct hvc_handler_return hvc_handler(uintreg_t arg0, uintreg_t arg1,
 	if (spci_handler(arg0, arg1, arg2, arg3, &ret.user_ret.res0,
 			 &ret.new)) {
 		update_vi(ret.new);
+		drain_primary_logs(current(), ret.new);
 		return ret;
 	}
 
@@ -399,6 +422,16 @@ struct hvc_handler_return hvc_handler(uintreg_t arg0, uintreg_t arg1,
 			ipa_init(arg1), ipa_init(arg2), current(), &ret.new);
 		break;
 
+	case HF_VCPU_STATE_CONFIGURE:
+		ret.user_ret.res0 =
+			api_vcpu_state_configure(ipa_init(arg1), current());
+		break;
+
+	case HF_STEAL_TIME_CONFIGURE:
+		ret.user_ret.res0 =
+			api_steal_time_configure(ipa_init(arg1), current());
+		break;
+
 	case HF_MAILBOX_CLEAR:
 		ret.user_ret.res0 = api_mailbox_clear(current(), &ret.new);
 		break;
@@ -411,6 +444,11 @@ struct hvc_handler_return hvc_handler(uintreg_t arg0, uintreg_t arg1,
 		ret.user_ret.res0 = api_mailbox_waiter_get(arg1, current());
 		break;
 
+	case HF_VCPU_TIME_GET:
+		ret.user_ret.res0 =
+			api_vcpu_time_get(arg1, arg2, arg3, current());
+		break;
+
 	case HF_INTERRUPT_ENABLE:
 		ret.user_ret.res0 = api_interrupt_enable(arg1, arg2, current());
 		break;
@@ -424,6 +462,11 @@ struct hvc_handler_return hvc_handler(uintreg_t arg0, uintreg_t arg1,
 							 current(), &ret.new);
 		break;
 
+	case HF_INTERRUPT_INJECT_ALL:
+		ret.user_ret.res0 =
+			api_interrupt_inject_all(arg1, arg2, current());
+		break;
+
 	case HF_SHARE_MEMORY:
 		ret.user_ret.res0 =
 			api_share_memory(arg1 >> 32, ipa_init(arg2), arg3,
@@ -434,11 +477,70 @@ struct hvc_handler_return hvc_handler(uintreg_t arg0, uintreg_t arg1,
 		ret.user_ret.res0 = api_debug_log(arg1, current());
 		break;
 
+	case HF_DEBUG_LOG_CHUNK:
+		ret.user_ret.res0 =
+			api_debug_log_chunk(arg1, arg2, arg3, current());
+		break;
+
+	case HF_VM_MEM_RANGE_GET:
+		ret.user_ret.res0 = api_vm_mem_range_get(arg1, arg2, current());
+		break;
+
+	case HF_BOOT_TIME_GET:
+		ret.user_ret.res0 = api_boot_time_get(arg1, arg2, current());
+		break;
+
+	case HF_VM_RESET:
+		ret.user_ret.res0 = api_vm_reset(arg1, current());
+		break;
+
+	case HF_VM_DIRTY_LOG_ENABLE:
+		ret.user_ret.res0 =
+			api_vm_dirty_log_enable(arg1, arg2, current());
+		break;
+
+	case HF_VM_DIRTY_LOG_GET:
+		ret.user_ret.res0 =
+			api_vm_dirty_log_get(arg1, ipa_init(arg2), current());
+		break;
+
+	case HF_VM_ACCESS_LOG_RESET:
+		ret.user_ret.res0 = api_vm_access_log_reset(arg1, current());
+		break;
+
+	case HF_VM_ACCESS_LOG_GET:
+		ret.user_ret.res0 =
+			api_vm_access_log_get(arg1, ipa_init(arg2), current());
+		break;
+
+	case HF_VM_BALLOON_INFLATE:
+		ret.user_ret.res0 = api_vm_balloon_inflate(arg1, arg2, current());
+		break;
+
+	case HF_BALLOON_REQUEST_GET:
+		ret.user_ret.res0 = api_balloon_request_get(current());
+		break;
+
+	case HF_VM_PAGE_SUPPLY:
+		ret.user_ret.res0 =
+			api_vm_page_supply(arg1, ipa_init(arg2), current());
+		break;
+
+	case HF_TIMER_EXPIRED_GET:
+		ret.user_ret.res0 = api_timer_expired_get(current());
+		break;
+
+	case HF_VCPU_YIELD_TO:
+		ret.user_ret.res0 =
+			api_vcpu_yield_to(arg1, arg2, current(), &ret.new);
+		break;
+
 	default:
 		ret.user_ret.res0 = -1;
 	}
 
 	update_vi(ret.new);
+	drain_primary_logs(current(), ret.new);
 
 	return ret;
 }
@@ -529,14 +631,14 @@ struct vcpu *sync_lower_exception(uintreg_t esr)
 		if (vcpu_handle_page_fault(vcpu, &info)) {
 			return NULL;
 		}
-		break;
+		return api_page_fault(vcpu, &info);
 
 	case 0x20: /* EC = 100000, Instruction abort. */
 		info = fault_info_init(esr, vcpu, MM_MODE_X);
 		if (vcpu_handle_page_fault(vcpu, &info)) {
 			return NULL;
 		}
-		break;
+		return api_page_fault(vcpu, &info);
 
 	case 0x17: /* EC = 010111, SMC instruction. */ {
 		uintreg_t smc_pc = vcpu_get_regs(vcpu)->pc;
@@ -545,7 +647,8 @@ struct vcpu *sync_lower_exception(uintreg_t esr)
 
 		if (!smc_handler(vcpu, &ret, &next)) {
 			/* TODO(b/132421503): handle SMC forward rejection  */
-			dlog("Unsupported SMC call: %#x\n", vcpu_get_regs(vcpu)->r[0]);
+			dlog_warn("Unsupported SMC call: %#x\n",
+				  vcpu_get_regs(vcpu)->r[0]);
 			ret.res0 = PSCI_ERROR_NOT_SUPPORTED;
 		}
 
@@ -555,6 +658,7 @@ struct vcpu *sync_lower_exception(uintreg_t esr)
 		vcpu_get_regs(vcpu)->r[1] = ret.res1;
 		vcpu_get_regs(vcpu)->r[2] = ret.res2;
 		vcpu_get_regs(vcpu)->r[3] = ret.res3;
+		drain_primary_logs(vcpu, next);
 		return next;
 	}
 
@@ -18,6 +18,8 @@
 
 #include <stdint.h>
 
+#include "hf/arch/cpu.h"
+#include "hf/arch/mm.h"
 #include "hf/arch/types.h"
 
 #include "hf/api.h"
@@ -33,6 +35,7 @@
 static uint32_t el3_psci_version;
 
 void cpu_entry(struct cpu *c);
+void boot_worker_entry(struct cpu *c);
 
 /* Performs arch specific boot time initialisation. */
 void arch_one_time_init(void)
@@ -48,17 +51,40 @@ void arch_one_time_init(void)
 	case PSCI_VERSION_1_0:
 	case PSCI_VERSION_1_1:
 		/* Supported EL3 PSCI version. */
-		dlog("Found PSCI version: %#x\n", el3_psci_version);
+		dlog_info("Found PSCI version: %#x\n", el3_psci_version);
 		break;
 
 	default:
 		/* Unsupported EL3 PSCI version. Log a warning but continue. */
-		dlog("Warning: unknown PSCI version: %#x\n", el3_psci_version);
+		dlog_warn("Warning: unknown PSCI version: %#x\n", el3_psci_version);
 		el3_psci_version = 0;
 		break;
 	}
 }
 
+bool arch_cpu_start_boot_worker(struct cpu *c)
+{
+	smc_res_t smc_res;
+
+	if (el3_psci_version == 0) {
+		return false;
+	}
+
+	/* The CPU reads its stack from `c` before it enables its caches. */
+	arch_mm_flush_dcache(&c->stack_bottom, sizeof(c->stack_bottom));
+
+	smc_res = smc64(PSCI_CPU_ON, c->id, (uintreg_t)&boot_worker_entry,
+			(uintreg_t)c, 0, 0, 0, SMCCC_CALLER_HYPERVISOR);
+
+	return smc_res.res0 == PSCI_RETURN_SUCCESS;
+}
+
+noreturn void arch_cpu_stop_boot_worker(void)
+{
+	smc32(PSCI_CPU_OFF, 0, 0, 0, 0, 0, 0, SMCCC_CALLER_HYPERVISOR);
+	panic("CPU off failed");
+}
+
 /**
  * Handles PSCI requests received via HVC or SMC instructions from the primary
  * VM.
@@ -77,6 +77,7 @@
 /* The following are stage-2 software defined attributes. */
 #define STAGE2_SW_OWNED     (UINT64_C(1) << 55)
 #define STAGE2_SW_EXCLUSIVE (UINT64_C(1) << 56)
+#define STAGE2_SW_DIRTY_LOG (UINT64_C(1) << 57)
 
 /* The following are stage-2 memory attributes for normal memory. */
 #define STAGE2_NONCACHEABLE UINT64_C(1)
@@ -361,6 +362,28 @@ void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end)
 	isb();
 }
 
+/**
+ * Invalidates all stage-1 and stage-2 TLB entries of the given VM. The TLB is
+ * invalidated for the VMID in VTTBR_EL2, so it is switched to the VM's, with
+ * its page table, while invalidating. This doesn't affect the hypervisor's own
+ * translations.
+ */
+void arch_mm_invalidate_stage2_vm(uint16_t vm_id, paddr_t table)
+{
+	uintreg_t vttbr = read_msr(vttbr_el2);
+
+	/* Sync with page table updates. */
+	dsb(ishst);
+
+	write_msr(vttbr_el2, pa_addr(table) | ((uint64_t)vm_id << 48));
+	isb();
+	tlbi(vmalls12e1is);
+	dsb(ish);
+
+	write_msr(vttbr_el2, vttbr);
+	isb();
+}
+
 /**
  * Returns the smallest cache line size of all the caches for this core.
  */
@@ -427,15 +450,28 @@ uint64_t arch_mm_mode_to_stage2_attrs(int mode)
 	 * shareability attribute of stage 1 will determine the actual
 	 * attribute.
 	 */
-	attrs |= STAGE2_AF | STAGE2_SH(NON_SHAREABLE);
+	attrs |= STAGE2_SH(NON_SHAREABLE);
+
+	/* Clear the access flag for the first access to be logged. */
+	if (!(mode & MM_MODE_ACCESS_LOG)) {
+		attrs |= STAGE2_AF;
+	}
 
 	/* Define the read/write bits. */
 	if (mode & MM_MODE_R) {
 		access |= STAGE2_ACCESS_READ;
 	}
 
+	/*
+	 * Write-protect memory for dirty logging, remembering that it is
+	 * writable in a software bit.
+	 */
 	if (mode & MM_MODE_W) {
-		access |= STAGE2_ACCESS_WRITE;
+		if (mode & MM_MODE_DIRTY_LOG) {
+			attrs |= STAGE2_SW_DIRTY_LOG;
+		} else {
+			access |= STAGE2_ACCESS_WRITE;
+		}
 	}
 
 	attrs |= STAGE2_S2AP(access);
@@ -484,6 +520,10 @@ int arch_mm_stage2_attrs_to_mode(uint64_t attrs)
 		mode |= MM_MODE_W;
 	}
 
+	if (attrs & STAGE2_SW_DIRTY_LOG) {
+		mode |= MM_MODE_W | MM_MODE_DIRTY_LOG;
+	}
+
 	if ((attrs & STAGE2_XN(STAGE2_EXECUTE_MASK)) ==
 	    STAGE2_XN(STAGE2_EXECUTE_ALL)) {
 		mode |= MM_MODE_X;
@@ -499,6 +539,8 @@ int arch_mm_stage2_attrs_to_mode(uint64_t attrs)
 
 	if (!(attrs & PTE_VALID)) {
 		mode |= MM_MODE_INVALID;
+	} else if (!(attrs & STAGE2_AF)) {
+		mode |= MM_MODE_ACCESS_LOG;
 	}
 
 	return mode;
@@ -551,7 +593,7 @@ bool arch_mm_init(void)
 		return false;
 	}
 
-	dlog("Supported bits in physical address: %d\n", pa_bits);
+	dlog_info("Supported bits in physical address: %d\n", pa_bits);
 
 	/*
 	 * Determine sl0, starting level of the page table, based on the number
@@ -585,8 +627,9 @@ bool arch_mm_init(void)
 	}
 	mm_s2_root_table_count = 1 << extend_bits;
 
-	dlog("Stage 2 has %d page table levels with %d pages at the root.\n",
-	     mm_s2_max_level + 1, mm_s2_root_table_count);
+	dlog_info(
+		"Stage 2 has %d page table levels with %d pages at the root.\n",
+		mm_s2_max_level + 1, mm_s2_root_table_count);
 
 	mm_vtcr_el2 = (1u << 31) |		 /* RES1. */
 		      ((features & 0xf) << 16) | /* PS, matching features. */
@@ -598,6 +641,15 @@ bool arch_mm_init(void)
 		      ((64 - pa_bits) << 0) | /* T0SZ: dependent on PS. */
 		      0;
 
+	/*
+	 * Let the hardware set the access flag of stage-2 entries if it can,
+	 * rather than faulting to the hypervisor for it to be set.
+	 */
+	if (read_msr(id_aa64mmfr1_el1) & 0xf) {
+		dlog_info("Stage 2 access flags are updated by hardware.\n");
+		mm_vtcr_el2 |= (1u << 21); /* HA. */
+	}
+
 	/*
 	 * 0    -> Device-nGnRnE memory
 	 * 0xff -> Normal memory, Inner/Outer Write-Back Non-transient,
@@ -650,6 +702,14 @@ void arch_mm_enable(paddr_t table)
 	isb();
 }
 
+void arch_mm_flush_config(void)
+{
+	arch_mm_flush_dcache(&mm_vtcr_el2, sizeof(mm_vtcr_el2));
+	arch_mm_flush_dcache(&mm_mair_el2, sizeof(mm_mair_el2));
+	arch_mm_flush_dcache(&mm_tcr_el2, sizeof(mm_tcr_el2));
+	arch_mm_flush_dcache(&mm_sctlr_el2, sizeof(mm_sctlr_el2));
+}
+
 /**
  * Given the attrs from a table at some level and the attrs from all the blocks
  * in that table, returns equivalent attrs to use for a block which will replace
@@ -30,6 +30,8 @@
 #define CNTV_CTL_EL0_IMASK (1u << 1)
 #define CNTV_CTL_EL0_ISTATUS (1u << 2)
 
+#define CNTHP_CTL_EL2_ENABLE (1u << 0)
+
 #define NANOS_PER_UNIT 1000000000
 
 /**
@@ -162,3 +164,63 @@ uint64_t arch_timer_remaining_ns_current(void)
 {
 	return ticks_to_ns(arch_timer_remaining_ticks_current());
 }
+
+/**
+ * Returns the absolute deadline, in counter ticks, of the virtual timer of the
+ * currently active vCPU. This is undefined if the timer is not enabled.
+ */
+uint64_t arch_timer_deadline_current(void)
+{
+	return read_msr(cntv_cval_el0);
+}
+
+/**
+ * Returns the current value of the counter the virtual timer compares against.
+ */
+uint64_t arch_timer_count(void)
+{
+	return read_msr(cntvct_el0);
+}
+
+/**
+ * Converts a number of counter ticks to the equivalent number of nanoseconds.
+ */
+uint64_t arch_timer_ticks_to_ns(uint64_t ticks)
+{
+	return ticks_to_ns(ticks);
+}
+
+/**
+ * Converts a number of nanoseconds to the equivalent number of counter ticks.
+ */
+uint64_t arch_timer_ns_to_ticks(uint64_t ns)
+{
+	uint64_t freq = read_msr(cntfrq_el0);
+
+	/* Split the conversion so it doesn't overflow for long timeouts. */
+	return (ns / NANOS_PER_UNIT) * freq +
+	       ((ns % NANOS_PER_UNIT) * freq) / NANOS_PER_UNIT;
+}
+
+/**
+ * Arms the hypervisor timer of the current physical CPU to fire at the given
+ * absolute counter value, or disables it if `ticks` is UINT64_MAX.
+ */
+void arch_timer_hyp_set_deadline(uint64_t ticks)
+{
+	/*
+	 * Clear timer control register before setting the compare value, to
+	 * avoid a spurious timer interrupt. This could be a problem if the
+	 * interrupt is configured as edge-triggered, as it would then be
+	 * latched in.
+	 */
+	write_msr(cnthp_ctl_el2, 0);
+
+	if (ticks == UINT64_MAX) {
+		write_msr(cnthp_cval_el2, 0);
+		return;
+	}
+
+	write_msr(cnthp_cval_el2, ticks);
+	write_msr(cnthp_ctl_el2, CNTHP_CTL_EL2_ENABLE);
+}
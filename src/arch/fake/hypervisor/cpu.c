@@ -46,3 +46,17 @@ void arch_regs_set_retval(struct arch_regs *r, uintreg_t v)
 {
 	r->r[0] = v;
 }
+
+bool arch_cpu_start_boot_worker(struct cpu *c)
+{
+	/* The boot CPU does all the work itself. */
+	(void)c;
+	return false;
+}
+
+noreturn void arch_cpu_stop_boot_worker(void)
+{
+	/* Boot workers are never started. */
+	for (;;) {
+	}
+}
@@ -121,6 +121,11 @@ void arch_mm_invalidate_stage2_range(ipaddr_t va_begin, ipaddr_t va_end)
 	/* There's no modelling of the stage-2 TLB. */
 }
 
+void arch_mm_invalidate_stage2_vm(uint16_t vm_id, paddr_t table)
+{
+	/* There's no modelling of the stage-2 TLB. */
+}
+
 void arch_mm_flush_dcache(void *base, size_t size)
 {
 	/* There's no modelling of the cache. */
@@ -176,3 +181,8 @@ void arch_mm_enable(paddr_t table)
 	/* There's no modelling of the MMU. */
 	(void)table;
 }
+
+void arch_mm_flush_config(void)
+{
+	/* There's no modelling of the cache. */
+}
@@ -64,3 +64,33 @@ uint64_t arch_timer_remaining_ns_current(void)
 	/* TODO */
 	return 0;
 }
+
+uint64_t arch_timer_deadline_current(void)
+{
+	/* TODO */
+	return 0;
+}
+
+uint64_t arch_timer_count(void)
+{
+	/* TODO */
+	return 0;
+}
+
+uint64_t arch_timer_ticks_to_ns(uint64_t ticks)
+{
+	/* TODO */
+	return ticks;
+}
+
+uint64_t arch_timer_ns_to_ticks(uint64_t ns)
+{
+	/* TODO */
+	return ns;
+}
+
+void arch_timer_hyp_set_deadline(uint64_t ticks)
+{
+	/* TODO */
+	(void)ticks;
+}
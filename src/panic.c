@@ -30,6 +30,7 @@ noreturn void panic(const char *fmt, ...)
 {
 	va_list args;
 
+	dlog_flush();
 	dlog("Panic: ");
 
 	va_start(args, fmt);
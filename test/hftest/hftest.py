@@ -32,6 +32,7 @@ import subprocess
 import sys
 
 HFTEST_LOG_PREFIX = "[hftest] "
+HFTEST_CPU_PREFIX_RE = re.compile(r"^\[\d+\] ")
 HFTEST_LOG_FAILURE_PREFIX = "Failure:"
 HFTEST_LOG_FINISHED = "FINISHED"
 
@@ -387,6 +388,8 @@ class TestRunner:
         of the test platform."""
         lines = []
         for line in raw.splitlines():
+            # Lines logged by the hypervisor are prefixed with the CPU index.
+            line = HFTEST_CPU_PREFIX_RE.sub("", line, count=1)
             if line.startswith("VM "):
                 line = line[len("VM 0: "):]
             if line.startswith(HFTEST_LOG_PREFIX):
@@ -138,6 +138,57 @@ TEST(spci, spci_version)
 	EXPECT_EQ(spci_version(), current_version);
 }
 
+/**
+ * Ensures that the debug log accepts a chunk of characters per call, and
+ * rejects chunks longer than fit in the registers.
+ */
+TEST(hf_debug_log_chunk, chunks)
+{
+	const char msg[] = "Logged by the chunk, sixteen characters at a time.\n";
+	size_t len = sizeof(msg) - 1;
+	size_t sent = 0;
+
+	while (sent < len) {
+		int64_t ret = hf_debug_log_chunk(&msg[sent], len - sent);
+
+		ASSERT_GT(ret, 0);
+		ASSERT_LE(ret, HF_DEBUG_LOG_CHUNK_MAX);
+		sent += ret;
+	}
+
+	EXPECT_EQ(sent, len);
+	EXPECT_EQ(hf_call(HF_DEBUG_LOG_CHUNK, HF_DEBUG_LOG_CHUNK_MAX + 1, 0, 0),
+		  -1);
+}
+
+/**
+ * Ensures that the time spent on each phase of boot has been recorded.
+ */
+TEST(hf_boot_time_get, phases)
+{
+	enum hf_boot_phase phase;
+	int64_t total = 0;
+
+	for (phase = HF_BOOT_PHASE_PAGE_TABLE; phase <= HF_BOOT_PHASE_DEFRAG;
+	     ++phase) {
+		int64_t ticks = hf_boot_time_get(phase, 0);
+
+		EXPECT_GE(ticks, 0);
+		total += ticks;
+	}
+
+	EXPECT_GT(hf_boot_time_get(HF_BOOT_PHASE_PAGE_TABLE, 0), 0);
+	EXPECT_GT(hf_boot_time_get(HF_BOOT_PHASE_LOAD_PRIMARY, 0), 0);
+	EXPECT_GT(total, 0);
+
+	/* There are no secondary VMs and the primary isn't timed on its own. */
+	EXPECT_EQ(hf_boot_time_get(HF_BOOT_PHASE_LOAD_VM, HF_PRIMARY_VM_ID),
+		  -1);
+	EXPECT_EQ(hf_boot_time_get(HF_BOOT_PHASE_LOAD_VM, HF_VM_ID_OFFSET + 1),
+		  -1);
+	EXPECT_EQ(hf_boot_time_get(HF_BOOT_PHASE_LOAD_VM + 1, 0), -1);
+}
+
 /**
  * Test that floating-point operations work in the primary VM.
  */
@@ -14,12 +14,19 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
+
+#include "hf/mm.h"
+#include "hf/std.h"
+
 #include "vmapi/hf/call.h"
 
 #include "hftest.h"
 #include "primary_with_secondary.h"
 #include "util.h"
 
+alignas(PAGE_SIZE) static uint8_t page[PAGE_SIZE];
+
 /**
  * Accessing unmapped memory aborts the VM.
  */
@@ -75,3 +82,68 @@ TEST(abort, straddling_instruction_abort)
 	run_res = hf_vcpu_run(SERVICE_VM0, 0);
 	EXPECT_EQ(run_res.code, HF_VCPU_RUN_ABORTED);
 }
+
+/**
+ * Memory lent to a VM is returned when the VM aborts, and can't be shared with
+ * it anymore.
+ */
+TEST(abort, lent_memory_returned)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	SERVICE_SELECT(SERVICE_VM0, "data_abort", mb.send);
+
+	ASSERT_EQ(hf_share_memory(SERVICE_VM0, (hf_ipaddr_t)&page, PAGE_SIZE,
+				  HF_MEMORY_LEND),
+		  0);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_ABORTED);
+
+	/* The memory is accessible again, and can be shared with other VMs. */
+	memset_s(page, sizeof(page), 'a', PAGE_SIZE);
+	EXPECT_EQ(hf_share_memory(SERVICE_VM0, (hf_ipaddr_t)&page, PAGE_SIZE,
+				  HF_MEMORY_LEND),
+		  -1);
+	EXPECT_EQ(hf_share_memory(SERVICE_VM1, (hf_ipaddr_t)&page, PAGE_SIZE,
+				  HF_MEMORY_LEND),
+		  0);
+}
+
+/**
+ * An aborted VM can be reset to its state at boot, after which it runs and
+ * can be messaged again.
+ */
+TEST(abort, reset)
+{
+	const char message[] = "Echo this back to me!";
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	/* Only restartable secondary VMs can be reset. */
+	EXPECT_EQ(hf_vm_reset(HF_PRIMARY_VM_ID), -1);
+	EXPECT_EQ(hf_vm_reset(SERVICE_VM0), -1);
+
+	SERVICE_SELECT(SERVICE_VM3, "data_abort", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_ABORTED);
+
+	ASSERT_EQ(hf_vm_reset(SERVICE_VM3), 0);
+
+	SERVICE_SELECT(SERVICE_VM3, "echo", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+
+	memcpy_s(mb.send->payload, SPCI_MSG_PAYLOAD_MAX, message,
+		 sizeof(message));
+	spci_message_init(mb.send, sizeof(message), SERVICE_VM3,
+			  HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), 0);
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(memcmp(mb.send->payload, message, sizeof(message)), 0);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+}
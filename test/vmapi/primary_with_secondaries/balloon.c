@@ -0,0 +1,76 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include "hf/mm.h"
+#include "hf/std.h"
+
+#include "vmapi/hf/call.h"
+#include "vmapi/hf/spci.h"
+
+#include "hftest.h"
+#include "primary_with_secondary.h"
+#include "util.h"
+
+/**
+ * Only the primary VM can ask a secondary VM for memory.
+ */
+TEST(balloon, only_primary)
+{
+	EXPECT_EQ(hf_vm_balloon_inflate(HF_PRIMARY_VM_ID, 1), -1);
+	EXPECT_EQ(hf_vm_balloon_inflate(MAX_VMS, 1), -1);
+	EXPECT_EQ(hf_balloon_request_get(), 0);
+}
+
+/**
+ * A secondary VM asked for memory returns it in several ranges at once, and the
+ * memory can be given back to it.
+ */
+TEST(balloon, inflate_and_deflate)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	struct spci_memory_region *memory_region;
+	struct spci_memory_region_constituent constituent;
+
+	SERVICE_SELECT(SERVICE_VM0, "balloon", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+
+	/* Inflate the balloon, which the VM must be woken up for. */
+	EXPECT_EQ(hf_vm_balloon_inflate(SERVICE_VM0, 3), 1);
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+
+	memory_region = spci_get_donated_memory_region(mb.recv);
+	ASSERT_EQ(memory_region->count, 2);
+	EXPECT_EQ(memory_region->constituents[0].page_count, 1);
+	EXPECT_EQ(memory_region->constituents[1].page_count, 2);
+	EXPECT_EQ(memory_region->constituents[1].address,
+		  memory_region->constituents[0].address + 2 * PAGE_SIZE);
+	constituent = memory_region->constituents[0];
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+
+	/* Deflate the balloon by a page, for the VM to use it again. */
+	spci_memory_donate(mb.send, SERVICE_VM0, HF_PRIMARY_VM_ID, &constituent,
+			   1, 0);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+}
@@ -36,6 +36,49 @@ TEST(boot, memory_size)
 	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
 }
 
+/**
+ * A VM whose image is LZ4 compressed in the initrd, and which is only loaded
+ * when it first runs, boots and gets all its memory too.
+ */
+TEST(boot, compressed_memory_size)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	SERVICE_SELECT(SERVICE_VM3, "boot_memory", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+}
+
+/**
+ * A secondary VM can find the ranges its memory is made up of.
+ */
+TEST(boot, memory_ranges)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	/* The primary VM's memory isn't described. */
+	EXPECT_EQ(hf_vm_mem_range_begin(0), -1);
+
+	SERVICE_SELECT(SERVICE_VM0, "boot_memory_ranges", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+}
+
+/**
+ * The time taken to load each secondary VM loaded at boot has been recorded.
+ */
+TEST(boot, load_times)
+{
+	EXPECT_GT(hf_boot_time_get(HF_BOOT_PHASE_LOAD_SECONDARY, 0), 0);
+	EXPECT_GT(hf_boot_time_get(HF_BOOT_PHASE_LOAD_VM, SERVICE_VM0), 0);
+	EXPECT_GT(hf_boot_time_get(HF_BOOT_PHASE_LOAD_VM, SERVICE_VM1), 0);
+	EXPECT_GT(hf_boot_time_get(HF_BOOT_PHASE_LOAD_VM, SERVICE_VM2), 0);
+}
+
 /**
  * Accessing memory outside the given range aborts the VM.
  */
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include "hf/mm.h"
+#include "hf/std.h"
+
+#include "vmapi/hf/call.h"
+#include "vmapi/hf/spci.h"
+
+#include "hftest.h"
+#include "primary_with_secondary.h"
+#include "util.h"
+
+/**
+ * Pages can only be supplied by the primary VM to VMs declared demand_paged.
+ */
+TEST(demand_paging, only_demand_paged)
+{
+	EXPECT_EQ(hf_vm_page_supply(HF_PRIMARY_VM_ID, 0), -1);
+	EXPECT_EQ(hf_vm_page_supply(SERVICE_VM0, 0), -1);
+	EXPECT_EQ(hf_vm_page_supply(SERVICE_VM3, 0), -1);
+}
+
+/**
+ * A fault on a page a demand-paged VM doesn't own is reported to the primary
+ * VM, and retried once the page is supplied.
+ */
+TEST(demand_paging, supply_page)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	struct spci_memory_region *memory_region;
+	hf_ipaddr_t page;
+
+	SERVICE_SELECT(SERVICE_VM3, "demand_paged_write", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	memory_region = spci_get_donated_memory_region(mb.recv);
+	ASSERT_EQ(memory_region->count, 1);
+	page = memory_region->constituents[0].address;
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+
+	/* The write to the page is reported rather than aborting the VM. */
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_PAGE_FAULT);
+	EXPECT_EQ(run_res.page_fault.ipa, page);
+	EXPECT_EQ(run_res.page_fault.access, HF_PAGE_FAULT_WRITE);
+
+	/* Until the page is supplied, the access faults again. */
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_PAGE_FAULT);
+
+	EXPECT_EQ(hf_vm_page_supply(SERVICE_VM3, page), 0);
+	EXPECT_EQ(hf_vm_page_supply(SERVICE_VM3, page), -1);
+
+	run_res = hf_vcpu_run(SERVICE_VM3, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+}
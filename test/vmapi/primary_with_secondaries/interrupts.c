@@ -94,6 +94,37 @@ TEST(interrupts, inject_interrupt_twice)
 	EXPECT_EQ(hf_mailbox_clear(), 0);
 }
 
+/**
+ * Inject an interrupt to every vCPU of the interrupt VM in one call, which will
+ * send a message back. The blocked vCPU is reported as needing a wake-up.
+ */
+TEST(interrupts, inject_interrupt_all)
+{
+	const char expected_response[] = "Got IRQ 07.";
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	SERVICE_SELECT(SERVICE_VM0, "interruptible", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+	EXPECT_EQ(run_res.sleep.ns, HF_SLEEP_INDEFINITE);
+
+	/* Invalid interrupt IDs are rejected. */
+	EXPECT_EQ(hf_interrupt_inject_all(SERVICE_VM0, HF_NUM_INTIDS), -1);
+
+	/* Inject the interrupt and wait for a message. */
+	EXPECT_EQ(hf_interrupt_inject_all(SERVICE_VM0, EXTERNAL_INTERRUPT_ID_A),
+		  1);
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(mb.recv->length, sizeof(expected_response));
+	EXPECT_EQ(memcmp(mb.recv->payload, expected_response,
+			 sizeof(expected_response)),
+		  0);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+}
+
 /**
  * Inject two different interrupts to the interrupt VM, which will send a
  * message back each time.
@@ -302,3 +333,36 @@ TEST(interrupts, deliver_interrupt_and_message)
 	EXPECT_EQ(memcmp(mb.recv->payload, message, sizeof(message)), 0);
 	EXPECT_EQ(hf_mailbox_clear(), 0);
 }
+
+/*
+ * A vCPU blocked on its virtual timer is reported by HF_TIMER_EXPIRED_GET once
+ * the timer expires, and runs when the primary VM runs it.
+ */
+TEST(interrupts, timer_expired_get)
+{
+	const char expected_response[] = "Timer fired";
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	int64_t expired;
+
+	SERVICE_SELECT(SERVICE_VM0, "wfi_timer", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_INTERRUPT);
+	EXPECT_NE(run_res.sleep.ns, HF_SLEEP_INDEFINITE);
+
+	/* Wait for the timer to expire. */
+	do {
+		expired = hf_timer_expired_get();
+	} while (expired == -1);
+	EXPECT_EQ(expired, ((int64_t)SERVICE_VM0 << 32) | 1);
+	EXPECT_EQ(hf_timer_expired_get(), -1);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(mb.recv->length, sizeof(expected_response));
+	EXPECT_EQ(memcmp(mb.recv->payload, expected_response,
+			 sizeof(expected_response)),
+		  0);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+}
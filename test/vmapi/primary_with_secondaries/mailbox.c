@@ -345,3 +345,32 @@ TEST(mailbox, secondary_to_primary_notification)
 	/* Send should now succeed. */
 	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
 }
+
+/**
+ * A blocking receive with a timeout reports its deadline to the primary, and
+ * returns SPCI_TIMEOUT to the secondary once it has passed without a message.
+ */
+TEST(mailbox, receive_timeout)
+{
+	const char expected_response[] = "Timed out";
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	SERVICE_SELECT(SERVICE_VM0, "receive_timeout", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+	EXPECT_NE(run_res.sleep.ns, HF_SLEEP_INDEFINITE);
+
+	/* Keep running it until the timeout passes. */
+	do {
+		run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	} while (run_res.code == HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(mb.recv->length, sizeof(expected_response));
+	EXPECT_EQ(memcmp(mb.recv->payload, expected_response,
+			 sizeof(expected_response)),
+		  0);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include "hf/mm.h"
+#include "hf/std.h"
+
+#include "vmapi/hf/call.h"
+
+#include "hftest.h"
+#include "primary_with_secondary.h"
+#include "util.h"
+
+/** The bits for the pages the write_pattern service writes to. */
+#define WRITTEN_PAGES 0xa
+
+/**
+ * Starts the write_pattern service in SERVICE_VM0 and returns the address of
+ * the pages it writes to, once it is waiting to be told to write them.
+ */
+static hf_ipaddr_t start_write_pattern(struct mailbox_buffers mb)
+{
+	struct hf_vcpu_run_return run_res;
+	hf_ipaddr_t pages;
+
+	SERVICE_SELECT(SERVICE_VM0, "write_pattern", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	memcpy_s(&pages, sizeof(pages), mb.recv->payload, sizeof(pages));
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+
+	return pages;
+}
+
+/**
+ * Only the primary VM can log the pages written by a secondary VM, and only
+ * once it has enabled dirty logging for it.
+ */
+TEST(dirty_log, requires_enabling)
+{
+	EXPECT_EQ(hf_vm_dirty_log_enable(HF_PRIMARY_VM_ID, true), -1);
+	EXPECT_EQ(hf_vm_dirty_log_get(HF_PRIMARY_VM_ID, 0), -1);
+	EXPECT_EQ(hf_vm_dirty_log_get(SERVICE_VM0, 0), -1);
+
+	EXPECT_EQ(hf_vm_dirty_log_enable(SERVICE_VM0, true), 0);
+	EXPECT_EQ(hf_vm_dirty_log_get(SERVICE_VM0, 1), -1);
+	EXPECT_NE(hf_vm_dirty_log_get(SERVICE_VM0, 0), -1);
+
+	EXPECT_EQ(hf_vm_dirty_log_enable(SERVICE_VM0, false), 0);
+	EXPECT_EQ(hf_vm_dirty_log_get(SERVICE_VM0, 0), -1);
+}
+
+/**
+ * The pages a secondary VM writes are logged, and each write is only returned
+ * once.
+ */
+TEST(dirty_log, logs_written_pages)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	hf_ipaddr_t pages = start_write_pattern(mb);
+
+	/* Nothing has been written since dirty logging was enabled. */
+	ASSERT_EQ(hf_vm_dirty_log_enable(SERVICE_VM0, true), 0);
+	EXPECT_EQ(hf_vm_dirty_log_get(SERVICE_VM0, pages) & 0xf, 0);
+
+	for (int i = 0; i < 2; ++i) {
+		spci_message_init(mb.send, 0, SERVICE_VM0, HF_PRIMARY_VM_ID);
+		EXPECT_EQ(spci_msg_send(0), 0);
+		run_res = hf_vcpu_run(SERVICE_VM0, 0);
+		EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+
+		EXPECT_EQ(hf_vm_dirty_log_get(SERVICE_VM0, pages) & 0xf,
+			  WRITTEN_PAGES);
+		EXPECT_EQ(hf_vm_dirty_log_get(SERVICE_VM0, pages) & 0xf, 0);
+
+		run_res = hf_vcpu_run(SERVICE_VM0, 0);
+		EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+	}
+
+	/* Once disabled, writes are no longer logged. */
+	EXPECT_EQ(hf_vm_dirty_log_enable(SERVICE_VM0, false), 0);
+	spci_message_init(mb.send, 0, SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), 0);
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+	EXPECT_EQ(hf_vm_dirty_log_get(SERVICE_VM0, pages), -1);
+}
+
+/**
+ * Only the primary VM can log the pages accessed by a secondary VM.
+ */
+TEST(access_log, only_primary)
+{
+	EXPECT_EQ(hf_vm_access_log_reset(HF_PRIMARY_VM_ID), -1);
+	EXPECT_EQ(hf_vm_access_log_get(HF_PRIMARY_VM_ID, 0), -1);
+	EXPECT_EQ(hf_vm_access_log_get(SERVICE_VM0, 1), -1);
+}
+
+/**
+ * The pages a secondary VM accesses are logged until the log is reset.
+ */
+TEST(access_log, logs_accessed_pages)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	hf_ipaddr_t pages = start_write_pattern(mb);
+
+	/* Nothing is accessed while the VM doesn't run. */
+	EXPECT_GT(hf_vm_access_log_reset(SERVICE_VM0), 0);
+	EXPECT_EQ(hf_vm_access_log_reset(SERVICE_VM0), 0);
+	EXPECT_EQ(hf_vm_access_log_get(SERVICE_VM0, pages) & 0xf, 0);
+
+	spci_message_init(mb.send, 0, SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), 0);
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_YIELD);
+
+	/* The log is kept until it is reset. */
+	EXPECT_EQ(hf_vm_access_log_get(SERVICE_VM0, pages) & WRITTEN_PAGES,
+		  WRITTEN_PAGES);
+	EXPECT_EQ(hf_vm_access_log_get(SERVICE_VM0, pages) & WRITTEN_PAGES,
+		  WRITTEN_PAGES);
+	EXPECT_GE(hf_vm_access_log_reset(SERVICE_VM0), 2);
+	EXPECT_EQ(hf_vm_access_log_get(SERVICE_VM0, pages) & 0xf, 0);
+}
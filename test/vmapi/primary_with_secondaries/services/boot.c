@@ -22,7 +22,7 @@
 #include "hftest.h"
 
 /*
- * This must match the size specified for services0 in
+ * This must match the size specified for services0 and services3 in
  * //test/vmapi/primary_with_secondaries:primary_with_secondaries_test.
  */
 #define SECONDARY_MEMORY_SIZE 1048576
@@ -50,6 +50,21 @@ TEST_SERVICE(boot_memory)
 	spci_yield();
 }
 
+TEST_SERVICE(boot_memory_ranges)
+{
+	/*
+	 * There was enough contiguous memory, so the memory is a single range
+	 * starting at the image with the size passed in by Hafnium.
+	 */
+	ASSERT_EQ(hf_vm_mem_range_begin(0), (int64_t)(uintptr_t)text_begin);
+	ASSERT_EQ(hf_vm_mem_range_end(0),
+		  (int64_t)((uintptr_t)text_begin + SERVICE_MEMORY_SIZE()));
+	ASSERT_EQ(hf_vm_mem_range_begin(1), -1);
+	ASSERT_EQ(hf_vm_mem_range_end(1), -1);
+
+	spci_yield();
+}
+
 TEST_SERVICE(boot_memory_underrun)
 {
 	/*
@@ -23,6 +23,7 @@
 #include "primary_with_secondary.h"
 
 alignas(PAGE_SIZE) static uint8_t page[PAGE_SIZE];
+alignas(PAGE_SIZE) static uint8_t pages[4 * PAGE_SIZE];
 
 TEST_SERVICE(memory_increment)
 {
@@ -616,3 +617,83 @@ TEST_SERVICE(spci_memory_lend_twice)
 		memory_region->constituents, memory_region->count, 0);
 	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
 }
+
+TEST_SERVICE(write_pattern)
+{
+	uint8_t *ptr = pages;
+
+	/* Tell the primary where the pages are. */
+	memcpy_s(SERVICE_SEND_BUFFER()->payload, SPCI_MSG_PAYLOAD_MAX, &ptr,
+		 sizeof(ptr));
+	spci_message_init(SERVICE_SEND_BUFFER(), sizeof(ptr), HF_PRIMARY_VM_ID,
+			  hf_vm_get_id());
+	EXPECT_EQ(spci_msg_send(0), 0);
+
+	/* Loop, writing a pattern to the second and fourth pages. */
+	for (;;) {
+		EXPECT_EQ(spci_msg_recv(SPCI_MSG_RECV_BLOCK), 0);
+		hf_mailbox_clear();
+
+		memset_s(&pages[PAGE_SIZE], PAGE_SIZE, 0xa5, PAGE_SIZE);
+		memset_s(&pages[3 * PAGE_SIZE], PAGE_SIZE, 0x5a, PAGE_SIZE);
+		for (size_t i = 0; i < PAGE_SIZE; ++i) {
+			ASSERT_EQ(pages[PAGE_SIZE + i], 0xa5);
+			ASSERT_EQ(pages[3 * PAGE_SIZE + i], 0x5a);
+		}
+
+		spci_yield();
+	}
+}
+
+TEST_SERVICE(balloon)
+{
+	struct spci_message *send_buf = SERVICE_SEND_BUFFER();
+	struct spci_message *recv_buf = SERVICE_RECV_BUFFER();
+	struct spci_memory_region *memory_region;
+	struct spci_memory_region_constituent constituents[] = {
+		{.address = (uint64_t)pages, .page_count = 1},
+		{.address = (uint64_t)&pages[2 * PAGE_SIZE], .page_count = 2},
+	};
+
+	hf_interrupt_enable(HF_BALLOON_INTID, true);
+
+	/* Wait for the primary VM to ask for memory. */
+	EXPECT_EQ(spci_msg_recv(SPCI_MSG_RECV_BLOCK), SPCI_INTERRUPTED);
+	EXPECT_EQ(hf_interrupt_get(), HF_BALLOON_INTID);
+	EXPECT_EQ(hf_balloon_request_get(), 3);
+
+	/* Return the pages in two ranges, in a single message. */
+	spci_memory_donate(send_buf, HF_PRIMARY_VM_ID, hf_vm_get_id(),
+			   constituents, ARRAY_SIZE(constituents), 0);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+	EXPECT_EQ(hf_balloon_request_get(), 0);
+
+	/* Wait for the first page to be given back, and use it again. */
+	EXPECT_EQ(spci_msg_recv(SPCI_MSG_RECV_BLOCK), SPCI_SUCCESS);
+	memory_region = spci_get_donated_memory_region(recv_buf);
+	EXPECT_EQ(memory_region->count, 1);
+	EXPECT_EQ(memory_region->constituents[0].address, (uint64_t)pages);
+	hf_mailbox_clear();
+
+	pages[0] = 'a';
+	EXPECT_EQ(pages[0], 'a');
+	spci_yield();
+}
+
+TEST_SERVICE(demand_paged_write)
+{
+	struct spci_memory_region_constituent constituents[] = {
+		{.address = (uint64_t)page, .page_count = 1},
+	};
+
+	/* Give the page away, for the primary VM to supply it on demand. */
+	spci_memory_donate(SERVICE_SEND_BUFFER(), HF_PRIMARY_VM_ID,
+			   hf_vm_get_id(), constituents,
+			   ARRAY_SIZE(constituents), 0);
+	EXPECT_EQ(spci_msg_send(0), SPCI_SUCCESS);
+
+	/* Fault on the page, which is retried once it is supplied. */
+	page[0] = 'a';
+	EXPECT_EQ(page[0], 'a');
+	spci_yield();
+}
@@ -57,3 +57,22 @@ TEST_SERVICE(receive_block)
 
 	spci_msg_send(0);
 }
+
+/*
+ * Secondary VM that waits for a message with a timeout, expects it to time
+ * out, and then sends a message to the primary.
+ */
+TEST_SERVICE(receive_timeout)
+{
+	const char message[] = "Timed out";
+
+	EXPECT_EQ(spci_msg_recv_timeout(SPCI_MSG_RECV_BLOCK, 1000000),
+		  SPCI_TIMEOUT);
+
+	memcpy_s(SERVICE_SEND_BUFFER()->payload, SPCI_MSG_PAYLOAD_MAX, message,
+		 sizeof(message));
+	spci_message_init(SERVICE_SEND_BUFFER(), sizeof(message),
+			  HF_PRIMARY_VM_ID, hf_vm_get_id());
+
+	spci_msg_send(0);
+}
@@ -16,6 +16,7 @@
 
 #include "hf/arch/cpu.h"
 #include "hf/arch/vm/interrupts_gicv3.h"
+#include "hf/arch/vm/timer.h"
 
 #include "hf/dlog.h"
 
@@ -55,3 +56,27 @@ TEST_SERVICE(wfi)
 
 	spci_msg_send(0);
 }
+
+/*
+ * Secondary VM that starts its virtual timer, disables interrupts globally, and
+ * calls WFI to block until the timer fires.
+ */
+TEST_SERVICE(wfi_timer)
+{
+	const char message[] = "Timer fired";
+
+	exception_setup(irq);
+	arch_irq_disable();
+	hf_interrupt_enable(HF_VIRTUAL_TIMER_INTID, true);
+
+	timer_set(1000);
+	timer_start();
+	interrupt_wait();
+
+	memcpy_s(SERVICE_SEND_BUFFER()->payload, SPCI_MSG_PAYLOAD_MAX, message,
+		 sizeof(message));
+	spci_message_init(SERVICE_SEND_BUFFER(), sizeof(message),
+			  HF_PRIMARY_VM_ID, hf_vm_get_id());
+
+	spci_msg_send(0);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hf/std.h"
+
+#include "vmapi/hf/call.h"
+#include "vmapi/hf/spci.h"
+
+#include "hftest.h"
+#include "primary_with_secondary.h"
+
+/*
+ * Secondary VM that yields its CPU to a vCPU of another VM, as if it were
+ * spinning on a lock held by it, and then reports back to the primary.
+ */
+
+TEST_SERVICE(yield_to)
+{
+	const char message[] = "Yielded";
+
+	/* A vCPU can't yield to itself or to a vCPU which doesn't exist. */
+	EXPECT_EQ(hf_vcpu_yield_to(hf_vm_get_id(), 0), -1);
+	EXPECT_EQ(hf_vcpu_yield_to(SERVICE_VM1, 1), -1);
+
+	EXPECT_EQ(hf_vcpu_yield_to(SERVICE_VM1, 0), 0);
+
+	memcpy_s(SERVICE_SEND_BUFFER()->payload, SPCI_MSG_PAYLOAD_MAX, message,
+		 sizeof(message));
+	spci_message_init(SERVICE_SEND_BUFFER(), sizeof(message),
+			  HF_PRIMARY_VM_ID, hf_vm_get_id());
+
+	spci_msg_send(0);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdalign.h>
+#include <stdint.h>
+
+#include "hf/mm.h"
+
+#include "vmapi/hf/call.h"
+
+#include "hftest.h"
+#include "primary_with_secondary.h"
+#include "util.h"
+
+alignas(PAGE_SIZE) static struct hf_vcpu_run_state_page run_states;
+
+static volatile struct hf_vcpu_run_state *run_state(spci_vm_id_t vm_id,
+						    spci_vcpu_index_t vcpu)
+{
+	return &run_states.vcpus[vm_id - HF_VM_ID_OFFSET][vcpu];
+}
+
+/**
+ * The run state page follows the secondary vCPUs as they are run, block on
+ * their mailbox and are woken by a message.
+ */
+TEST(vcpu_state, published)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	ASSERT_EQ(hf_vcpu_state_configure((hf_ipaddr_t)&run_states), 0);
+	EXPECT_EQ(hf_vcpu_state_configure((hf_ipaddr_t)&run_states), -1);
+
+	/* Only the first vCPU of each secondary VM is started at boot. */
+	EXPECT_EQ(run_state(SERVICE_VM0, 0)->state, HF_VCPU_STATE_READY);
+	EXPECT_EQ(run_state(SERVICE_VM2, 1)->state, HF_VCPU_STATE_OFF);
+
+	SERVICE_SELECT(SERVICE_VM0, "echo", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+	EXPECT_EQ(run_state(SERVICE_VM0, 0)->state,
+		  HF_VCPU_STATE_BLOCKED_MAILBOX);
+	EXPECT_EQ(run_state(SERVICE_VM0, 0)->needs_wake, 0);
+
+	/* A message for the blocked vCPU asks the scheduler to wake it. */
+	spci_message_init(mb.send, 0, SERVICE_VM0, HF_PRIMARY_VM_ID);
+	EXPECT_EQ(spci_msg_send(0), 0);
+	EXPECT_EQ(run_state(SERVICE_VM0, 0)->needs_wake, 1);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(run_state(SERVICE_VM0, 0)->state, HF_VCPU_STATE_READY);
+	EXPECT_EQ(run_state(SERVICE_VM0, 0)->needs_wake, 0);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include "vmapi/hf/call.h"
+
+#include "hftest.h"
+#include "primary_with_secondary.h"
+#include "util.h"
+
+/**
+ * Lets some virtual counter ticks pass. Each call traps to Hafnium, which
+ * takes many ticks.
+ */
+static void let_time_pass(void)
+{
+	for (int i = 0; i < 1000; ++i) {
+		hf_vm_get_count();
+	}
+}
+
+/**
+ * Only the primary VM can get the time of a vCPU, of an existing activity.
+ */
+TEST(vcpu_time, invalid)
+{
+	EXPECT_EQ(hf_vcpu_time_get(MAX_VMS, 0, HF_VCPU_TIME_RUNNING), -1);
+	EXPECT_EQ(hf_vcpu_time_get(SERVICE_VM0, 0, HF_VCPU_TIME_COUNT), -1);
+}
+
+/**
+ * A vCPU is charged for running while it runs and for being blocked while it
+ * waits for a message, until an interrupt is injected into it. The time from
+ * then until it is run is steal time.
+ */
+TEST(vcpu_time, run_block_steal)
+{
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+	int64_t running;
+	int64_t blocked;
+	int64_t steal;
+
+	SERVICE_SELECT(SERVICE_VM0, "interruptible", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_WAIT_FOR_MESSAGE);
+
+	running = hf_vcpu_time_get(SERVICE_VM0, 0, HF_VCPU_TIME_RUNNING);
+	blocked =
+		hf_vcpu_time_get(SERVICE_VM0, 0, HF_VCPU_TIME_BLOCKED_MAILBOX);
+	steal = hf_vcpu_time_get(SERVICE_VM0, 0, HF_VCPU_TIME_STEAL);
+	EXPECT_GT(running, 0);
+	EXPECT_NE(blocked, -1);
+	EXPECT_NE(steal, -1);
+
+	/* The vCPU is blocked until the interrupt, and waits to run after. */
+	let_time_pass();
+	EXPECT_EQ(hf_interrupt_inject(SERVICE_VM0, 0, EXTERNAL_INTERRUPT_ID_A),
+		  1);
+	let_time_pass();
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+
+	EXPECT_GT(hf_vcpu_time_get(SERVICE_VM0, 0, HF_VCPU_TIME_RUNNING),
+		  running);
+	EXPECT_GT(hf_vcpu_time_get(SERVICE_VM0, 0,
+				   HF_VCPU_TIME_BLOCKED_MAILBOX),
+		  blocked);
+	EXPECT_GT(hf_vcpu_time_get(SERVICE_VM0, 0, HF_VCPU_TIME_STEAL), steal);
+}
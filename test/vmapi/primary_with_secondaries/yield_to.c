@@ -0,0 +1,58 @@
+/*
+ * Copyright 2019 The Hafnium Authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include "hf/std.h"
+
+#include "vmapi/hf/call.h"
+
+#include "hftest.h"
+#include "primary_with_secondary.h"
+#include "util.h"
+
+/**
+ * A vCPU which yields to another vCPU returns to the primary VM naming the
+ * target, and resumes after the yield when it is next run.
+ */
+TEST(yield_to, directed_yield)
+{
+	const char expected_response[] = "Yielded";
+	struct hf_vcpu_run_return run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	SERVICE_SELECT(SERVICE_VM0, "yield_to", mb.send);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_DIRECTED_YIELD);
+	EXPECT_EQ(run_res.directed_yield.vm_id, SERVICE_VM1);
+	EXPECT_EQ(run_res.directed_yield.vcpu, 0);
+
+	run_res = hf_vcpu_run(SERVICE_VM0, 0);
+	EXPECT_EQ(run_res.code, HF_VCPU_RUN_MESSAGE);
+	EXPECT_EQ(mb.recv->length, sizeof(expected_response));
+	EXPECT_EQ(memcmp(mb.recv->payload, expected_response,
+			 sizeof(expected_response)),
+		  0);
+	EXPECT_EQ(hf_mailbox_clear(), 0);
+}
+
+/** Yielding is a no-op for the primary VM, which makes the decisions. */
+TEST(yield_to, primary_noop)
+{
+	EXPECT_EQ(hf_vcpu_yield_to(SERVICE_VM0, 0), 0);
+	EXPECT_EQ(hf_vcpu_yield_to(MAX_VMS, 0), -1);
+}